@@ -9,6 +9,88 @@
 
 #include "common.h"
 #include "gsb-conf.h"
+#include <iostream>
+
+namespace {
+
+bool priorityLess(const ListConfig& a, const ListConfig& b) {
+	return a.priority < b.priority;
+}
+
+/**
+ * Collect lists from [list.NAME] sections of configuration file.  If there are no such
+ * sections, black & malware lists are configured by old options
+ *
+ * @return false if configuration of lists is wrong
+ */
+bool parseLists(const po::parsed_options& parsed, const po::variables_map& cfg,
+				ListConfigs& lists) {
+	static const std::string prefix("list.");
+	lists.clear();
+	for(std::size_t i=0; i < parsed.options.size(); ++i) {
+		const po::option& o=parsed.options[i];
+		if(!o.unregistered)
+			continue;
+		std::string::size_type dot=o.string_key.rfind('.');
+		if(!boost::starts_with(o.string_key, prefix) || dot < prefix.size()+1) {
+			std::cerr << "Unknown option " << o.string_key << std::endl;
+			return false;
+		}
+		std::string name=o.string_key.substr(prefix.size(), dot-prefix.size());
+		std::string opt=o.string_key.substr(dot+1);
+		std::string value=o.value.empty() ? std::string() : o.value[0];
+
+		ListConfigs::iterator it=lists.begin();
+		while(it != lists.end() && it->name != name)
+			++it;
+		if(it == lists.end()) {
+			ListConfig lc;
+			lc.name=name;
+			lc.file=fs::path(__STATEDIR) / (name + ".dat");
+			lc.priority=lists.size()+1;
+			it=lists.insert(lists.end(), lc);
+		}
+		if(opt == "url") {
+			it->url=value;
+		} else if(opt == "file") {
+			it->file=value;
+		} else if(opt == "priority") {
+			it->priority=boost::lexical_cast<int>(value);
+		} else if(opt == "storage") {
+			if(value != "full" && value != "rice") {
+				std::cerr << "Unknown storage " << value << " of list " << name << std::endl;
+				return false;
+			}
+			it->compressed=value == "rice";
+		} else {
+			std::cerr << "Unknown option " << opt << " of list " << name << std::endl;
+			return false;
+		}
+	}
+
+	if(lists.empty()) {
+		ListConfig lc;
+		lc.name="goog-black-hash";
+		lc.file=cfg["black-hash-file"].as<std::string>();
+		if(cfg.count("black-url"))
+			lc.url=cfg["black-url"].as<std::string>();
+		lc.priority=1;
+		lists.push_back(lc);
+		lc.name="goog-malware-hash";
+		lc.file=cfg["malware-hash-file"].as<std::string>();
+		lc.url=cfg.count("malware-url") ? cfg["malware-url"].as<std::string>() : std::string();
+		lc.priority=2;
+		lists.push_back(lc);
+	}
+	if(lists.size() > MaxLists) {
+		std::cerr << "Too many lists, only " << MaxLists << " are supported" << std::endl;
+		return false;
+	}
+	std::stable_sort(lists.begin(), lists.end(), priorityLess);
+	return true;
+}
+
+}
 
 /**
  *
@@ -16,10 +98,11 @@
  * @param argc
  * @param argv
  * @param cfg
+ * @param lists configured lists, sorted by priority
  *
  * @return
  */
-bool parseOptions(int argc, char** argv, po::variables_map& cfg) {
+bool parseOptions(int argc, char** argv, po::variables_map& cfg, ListConfigs& lists) {
 	bool result=false;
 	try {
 		std::string configFile;
@@ -70,6 +153,72 @@ bool parseOptions(int argc, char** argv, po::variables_map& cfg) {
 			("emit-empty",
 			 po::value<bool>()->default_value(false),
 			 "")
+			("reload-interval",
+			 po::value<unsigned int>()->default_value(60),
+			 "")
+			("concurrency",
+			 po::value<bool>()->default_value(false),
+			 "")
+			("threads",
+			 po::value<unsigned int>()->default_value(1),
+			 "")
+			("ok-err-replies",
+			 po::value<bool>()->default_value(false),
+			 "")
+			("lookup-mode",
+			 po::value<std::string>()->default_value("full"),
+			 "")
+			("cache-size",
+			 po::value<unsigned int>()->default_value(65536),
+			 "")
+			("host-cache-size",
+			 po::value<unsigned int>()->default_value(16384),
+			 "")
+			("lists-snapshot",
+			 po::value<std::string>()->default_value(std::string(__LISTSFILE)),
+			 "")
+			("daemon",
+			 po::value<bool>()->default_value(false),
+			 "")
+			("poll-interval",
+			 po::value<unsigned int>()->default_value(1800),
+			 "")
+			("max-poll-interval",
+			 po::value<unsigned int>()->default_value(14400),
+			 "")
+			("update-server",
+			 po::value<std::string>()->default_value("sb.google.com"),
+			 "")
+			("update-timeout",
+			 po::value<unsigned int>()->default_value(300),
+			 "")
+			("update-connections",
+			 po::value<unsigned int>()->default_value(1),
+			 "")
+			("delta-limit",
+			 po::value<unsigned int>()->default_value(5),
+			 "")
+			("hash-storage",
+			 po::value<std::string>()->default_value("full"),
+			 "")
+			("fullhash-cache-file",
+			 po::value<std::string>()->default_value(std::string(__FULLHASHFILE)),
+			 "")
+			("fullhash-cache-size",
+			 po::value<unsigned int>()->default_value(65536),
+			 "")
+			("fullhash-ttl",
+			 po::value<unsigned int>()->default_value(2700),
+			 "")
+			("fullhash-timeout",
+			 po::value<unsigned int>()->default_value(500),
+			 "")
+			("stats-file",
+			 po::value<std::string>()->default_value(""),
+			 "")
+			("stats-interval",
+			 po::value<unsigned int>()->default_value(0),
+			 "")
 			;
 
 		// read config file
@@ -79,11 +228,12 @@ bool parseOptions(int argc, char** argv, po::variables_map& cfg) {
 			return false;
 		}
 
-		po::store(po::parse_config_file(is, cfg_opt), cfg);
+		po::parsed_options parsed=po::parse_config_file(is, cfg_opt, true);
+		po::store(parsed, cfg);
 		po::notify(cfg);
 		is.close();
 
-		result=true;
+		result=parseLists(parsed, cfg, lists);
 	} catch (std::exception& x) {
 #ifdef DEBUG
 		std::cerr << "Catch exception: " << x.what() << std::endl;
@@ -11,23 +11,48 @@
 #define _COMMON_H 1
 
 #include <set>
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <fstream>
-#include <deque>
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/set.hpp>
 #include <boost/serialization/string.hpp>
+#include <boost/serialization/split_member.hpp>
+
+#include "digest.h"
 
 //#define BOOST_FILESYSTEM_VERSION 2
 
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
+/**
+ * Native name of file, for all versions of Boost.Filesystem
+ */
+inline std::string pathString(const fs::path& p) {
+#if defined(BOOST_FILESYSTEM_VERSION) && (BOOST_FILESYSTEM_VERSION == 3)
+	return p.string();
+#else
+	return p.file_string();
+#endif
+}
+
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include <unistd.h>
+
+/**
+ * Temporary name, under which file is written before it's renamed.  Name includes PID,
+ * so processes, that write the same file at once, don't mix their data
+ */
+inline fs::path tempPath(const fs::path& p) {
+	return pathString(p) + ".tmp." + boost::lexical_cast<std::string>(::getpid());
+}
+
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
 
@@ -36,25 +61,73 @@ struct HashData {
 	int minorVersion;
 	std::string name;
 
-	typedef std::set<std::string> HashSet;
-	HashSet hashes;
+	DigestIndex hashes;
 
 	friend class boost::serialization::access;
 
-	template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+	/**
+	 * Hashes are stored in archive as set of hex strings, to be compatible with
+	 * existing data files
+	 */
+	template<class Archive> void save(Archive & ar, const unsigned int version) const {
+		std::set<std::string> hs;
+		for(const Digest* it=hashes.begin(); it != hashes.end(); ++it)
+			hs.insert(hs.end(), formatHexDigest(*it));
+        ar & majorVersion;
+        ar & minorVersion;
+		ar & name;
+        ar & hs;
+    }
+	template<class Archive> void load(Archive & ar, const unsigned int version) {
+		std::set<std::string> hs;
         ar & majorVersion;
         ar & minorVersion;
 		ar & name;
-        ar & hashes;
+        ar & hs;
+		DigestVector dv;
+		dv.reserve(hs.size());
+		Digest d;
+		for(std::set<std::string>::const_iterator it=hs.begin(); it != hs.end(); ++it) {
+			if(parseHexDigest(*it, d))
+				dv.push_back(d);
+		}
+		// hex strings in different case are not sorted in the same order as digests
+		std::sort(dv.begin(), dv.end());
+		dv.erase(std::unique(dv.begin(), dv.end()), dv.end());
+		hashes.assign(dv);
     }
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
     HashData() : majorVersion(1), minorVersion(-1) { }
 
 } ;
 BOOST_CLASS_TRACKING(HashData, boost::serialization::track_never)
 
-typedef std::deque<std::string> StringVector;
+/**
+ * List of hashes, configured in [list.NAME] section of configuration file
+ */
+struct ListConfig {
+	/// name of list in Safe Browsing API
+	std::string name;
+	/// URL to redirect to, if URL is found in list
+	std::string url;
+	/// data file of list
+	fs::path file;
+	/// if URL is found in several lists, list with lower value is used
+	int priority;
+	/// keep list as compressed prefixes, that are confirmed by full hashes
+	bool compressed;
+
+	ListConfig() : priority(0), compressed(false) { }
+} ;
+typedef std::vector<ListConfig> ListConfigs;
+
+/// lists are identified by bits of 32-bit mask
+const std::size_t MaxLists=32;
+
+/// print debug information to stderr, defined by each program
+extern bool runDebug;
 
-bool parseOptions(int argc, char** argv, po::variables_map& cfg);
+bool parseOptions(int argc, char** argv, po::variables_map& cfg, ListConfigs& lists);
 
 #endif /* _COMMON_H */
 
@@ -0,0 +1,192 @@
+/**
+ * @file   corpus.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Synthetic lists & URL streams for benchmarks & load tests
+ *
+ *
+ */
+
+#include "corpus.h"
+
+#include <cmath>
+
+namespace {
+
+const char* sWords[]={
+	"news", "images", "img", "static", "js", "css", "video", "search", "article", "blog",
+	"download", "files", "media", "user", "profile", "forum", "topic", "catalog", "product",
+	"cart", "help", "about", "api", "content", "upload", "archive", "page", "tag"
+};
+const std::size_t sWordCount=sizeof(sWords)/sizeof(sWords[0]);
+
+const char* sNames[]={
+	"index.html", "default.aspx", "logo.png", "style.css", "app.js", "photo.jpg", "view.php",
+	"setup.exe", "feed.xml", "banner.gif"
+};
+const std::size_t sNameCount=sizeof(sNames)/sizeof(sNames[0]);
+
+const char* sSubdomains[]={ "www", "cdn", "img", "mail", "static", "m", "shop", "forum" };
+const std::size_t sSubdomainCount=sizeof(sSubdomains)/sizeof(sSubdomains[0]);
+
+const char* sDomains[]={ "com", "net", "org", "ru", "de", "co.uk", "info", "com.br" };
+const std::size_t sDomainCount=sizeof(sDomains)/sizeof(sDomains[0]);
+
+}
+
+void Corpus::makeLists(std::vector<HashData>& hs) const {
+	hs.resize(names.size());
+	for(std::size_t i=0; i < names.size(); ++i) {
+		DigestVector ds(digests[i]);
+		std::sort(ds.begin(), ds.end());
+		ds.erase(std::unique(ds.begin(), ds.end()), ds.end());
+		hs[i].name=names[i];
+		hs[i].majorVersion=1;
+		hs[i].minorVersion=1;
+		hs[i].hashes.assign(ds);
+	}
+}
+
+/**
+ * Hosts & their probabilities are prepared once, probability of host i is proportional
+ * to 1/(i+1)^zipf
+ */
+CorpusGenerator::CorpusGenerator(const CorpusOptions& o) : opts(o), rng(o.seed) {
+	if(opts.hosts == 0)
+		opts.hosts=1;
+	hosts.reserve(opts.hosts);
+	cdf.reserve(opts.hosts);
+	double sum=0;
+	for(std::size_t i=0; i < opts.hosts; ++i) {
+		hosts.push_back(makeHost(i));
+		sum+=1/std::pow((double)(i+1), opts.zipf);
+		cdf.push_back(sum);
+	}
+	for(std::size_t i=0; i < cdf.size(); ++i)
+		cdf[i]/=sum;
+}
+
+void CorpusGenerator::generate(Corpus& c) {
+	generateLists(c);
+	c.urls.reserve(c.urls.size() + opts.urls);
+	for(std::size_t i=0; i < opts.urls; ++i)
+		c.urls.push_back(nextUrl(c));
+}
+
+void CorpusGenerator::generateLists(Corpus& c) {
+	c.names=opts.lists;
+	c.digests.resize(c.names.size());
+	if(c.names.empty())
+		return;
+	for(std::size_t i=0; i < opts.hashes; ++i) {
+		Digest d;
+		for(std::size_t j=0; j < sizeof(d.bytes); j+=4) {
+			boost::uint32_t r=rng();
+			std::memcpy(d.bytes+j, &r, 4);
+		}
+		c.digests[i % c.names.size()].push_back(d);
+	}
+}
+
+/**
+ * Planted URL gets unique directory, & one of its variants, that include this directory,
+ * is planted.  Other URLs have only directories from dictionary, so they aren't found
+ */
+std::string CorpusGenerator::nextUrl(Corpus& c) {
+	std::string url="http://" + hosts[zipfHost()];
+	unsigned int depth=0;
+	// depth of path has geometric distribution, so short paths are more frequent
+	while(depth < opts.maxDepth && uniform() < 0.6)
+		++depth;
+	bool hit=!c.names.empty() && uniform() < opts.hitRatio;
+	std::size_t hostEnd=url.size();
+	if(hit) {
+		url+="/p" + boost::lexical_cast<std::string>(c.planted);
+		depth=depth ? depth-1 : 0;
+	}
+	std::size_t minPath=url.size() - hostEnd + 1;
+	appendPath(url, depth);
+	if(hit && plant(url, minPath, c))
+		++c.planted;
+	return url;
+}
+
+bool CorpusGenerator::plant(const std::string& url, Corpus& c) {
+	StringPiece u(url);
+	StringPiece host=urlHost(u);
+	if(host.data == 0)
+		return false;
+	std::string::size_type q=url.find('?', host.end()-url.data());
+	std::size_t path=(q == std::string::npos ? url.size() : q) - (host.end()-url.data());
+	return plant(url, path, c);
+}
+
+/**
+ * @param minPath minimal length of path part of planted variant
+ */
+bool CorpusGenerator::plant(const std::string& url, std::size_t minPath, Corpus& c) {
+	if(c.names.empty())
+		return false;
+	UrlVariants uv;
+	if(!generateVariants(StringPiece(url), uv))
+		return false;
+	std::size_t candidates[UrlVariants::MaxVariants];
+	std::size_t n=0;
+	for(std::size_t i=0; i < uv.count; ++i) {
+		if(uv.variants[i].path.size >= minPath)
+			candidates[n++]=i;
+	}
+	if(n == 0)
+		return false;
+	std::size_t v=candidates[rng() % n];
+	hashVariants(uv, v, v+1);
+	c.digests[rng() % c.names.size()].push_back(uv.digests[v]);
+	return true;
+}
+
+double CorpusGenerator::uniform() {
+	return rng()/4294967296.0;
+}
+
+std::size_t CorpusGenerator::zipfHost() {
+	std::vector<double>::const_iterator it=std::lower_bound(cdf.begin(), cdf.end(), uniform());
+	return it == cdf.end() ? cdf.size()-1 : it-cdf.begin();
+}
+
+/**
+ * Host names have 0-2 subdomains, & some hosts are IP addresses
+ */
+std::string CorpusGenerator::makeHost(std::size_t i) {
+	boost::uint32_t r=rng();
+	if(r % 50 == 0) {
+		std::ostringstream os;
+		os << (r >> 24 | 1) << "." << (r >> 16 & 255) << "." << (r >> 8 & 255) << "." << i % 256;
+		return os.str();
+	}
+	std::string host;
+	for(unsigned int s=r/50 % 3; s > 0; --s) {
+		host+=sSubdomains[rng() % sSubdomainCount];
+		host+='.';
+	}
+	return host + "site" + boost::lexical_cast<std::string>(i) + "." + sDomains[r % sDomainCount];
+}
+
+void CorpusGenerator::appendPath(std::string& url, unsigned int depth) {
+	for(unsigned int i=0; i < depth; ++i) {
+		url+='/';
+		url+=sWords[rng() % sWordCount];
+	}
+	url+='/';
+	// most of paths end with file name
+	if(uniform() < 0.7)
+		url+=sNames[rng() % sNameCount];
+	if(uniform() < opts.queryRatio) {
+		unsigned int params=1 + rng() % 3;
+		for(unsigned int i=0; i < params; ++i) {
+			url+=i ? '&' : '?';
+			url+=sWords[rng() % sWordCount];
+			url+='=';
+			url+=boost::lexical_cast<std::string>(rng() % 1000);
+		}
+	}
+}
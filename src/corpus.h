@@ -0,0 +1,102 @@
+/**
+ * @file   corpus.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Synthetic lists & URL streams for benchmarks & load tests
+ *
+ * Popularity of hosts follows Zipf distribution, paths have random depth & optional
+ * query.  Part of URLs is planted into lists: digest of one of their variants, that are
+ * generated by the same rules as redirector uses, is added to random list.  Planted URLs
+ * have unique path component, so other URLs never match them, & share of found URLs is
+ * equal to requested one.
+ */
+
+#ifndef _CORPUS_H
+#define _CORPUS_H 1
+
+#include "common.h"
+#include "variants.h"
+
+#include <boost/random/mersenne_twister.hpp>
+
+/**
+ * Parameters of generated corpus
+ */
+struct CorpusOptions {
+	/// names of lists
+	std::vector<std::string> lists;
+	/// number of random hashes in all lists, without planted ones
+	std::size_t hashes;
+	/// number of URLs
+	std::size_t urls;
+	/// number of distinct hosts
+	std::size_t hosts;
+	/// exponent of Zipf distribution of hosts' popularity
+	double zipf;
+	/// share of URLs, that are found in lists
+	double hitRatio;
+	/// maximal number of directories in path
+	unsigned int maxDepth;
+	/// share of URLs with query
+	double queryRatio;
+	boost::uint32_t seed;
+
+	CorpusOptions() : hashes(1000000), urls(100000), hosts(10000), zipf(1.0), hitRatio(0.01),
+					  maxDepth(6), queryRatio(0.3), seed(5489) {
+		lists.push_back("goog-black-hash");
+		lists.push_back("goog-malware-hash");
+	}
+} ;
+
+/**
+ * Generated lists & URLs
+ */
+struct Corpus {
+	std::vector<std::string> names;
+	/// digests of each list, unsorted & could have duplicates
+	std::vector<DigestVector> digests;
+	std::vector<std::string> urls;
+	/// number of URLs, planted into lists
+	std::size_t planted;
+
+	Corpus() : planted(0) { }
+
+	/// sorted lists with version 1.1
+	void makeLists(std::vector<HashData>& hs) const;
+} ;
+
+class CorpusGenerator {
+public:
+	CorpusGenerator(const CorpusOptions& opts);
+
+	/// generate lists with random hashes & URLs
+	void generate(Corpus& c);
+
+	/// fill lists with random hashes
+	void generateLists(Corpus& c);
+
+	/// generate URL, that is planted into lists with probability hitRatio
+	std::string nextUrl(Corpus& c);
+
+	/**
+	 * Add digest of random variant of URL with full path into random list
+	 *
+	 * @return false if URL has no variants
+	 */
+	bool plant(const std::string& url, Corpus& c);
+
+private:
+	bool plant(const std::string& url, std::size_t minPath, Corpus& c);
+	double uniform();
+	std::size_t zipfHost();
+	std::string makeHost(std::size_t i);
+	void appendPath(std::string& url, unsigned int depth);
+
+	CorpusOptions opts;
+	boost::mt19937 rng;
+	std::vector<std::string> hosts;
+	/// cumulative probabilities of hosts
+	std::vector<double> cdf;
+} ;
+
+#endif /* _CORPUS_H */
@@ -0,0 +1,683 @@
+/**
+ * @file   digest.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary MD5 digests & flat index of them
+ *
+ *
+ */
+
+#include "digest.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace {
+
+inline int hexValue(char c) {
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool opLess(const DigestUpdate::Op& a, const DigestUpdate::Op& b) {
+	return a.digest < b.digest;
+}
+
+inline boost::uint32_t loadWord32(const unsigned char* p) {
+	boost::uint32_t w;
+	std::memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+inline boost::uint64_t loadWord64(const unsigned char* p) {
+	boost::uint64_t w;
+	std::memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/**
+ * Block of filter for digest.  MD5 is uniformly distributed, so bytes of digest, that
+ * aren't used for buckets, are used directly instead of additional hashing
+ */
+inline std::size_t filterBlockOf(const Digest& d, std::size_t blocks) {
+	return (std::size_t)(((boost::uint64_t)loadWord32(d.bytes+4) * blocks) >> 32);
+}
+
+/**
+ * Stable sort of operations: counting sort by first 16 bits of digest, followed by sort
+ * of resulting small buckets (MD5 values are uniform, so they are almost equal).  Each
+ * step is split between threads, & threads take their parts in order, so sort is
+ * stable
+ */
+class OpSorter {
+public:
+	typedef DigestUpdate::Op Op;
+
+	OpSorter(std::vector<Op>& o, unsigned int t)
+		: ops(o), threads(t), offsets((std::size_t)t*Buckets), starts(Buckets+1) { }
+
+	void run() {
+		sorted.resize(ops.size());
+		parallel(&OpSorter::count);
+		std::size_t pos=0;
+		for(std::size_t b=0; b < Buckets; ++b) {
+			starts[b]=pos;
+			for(unsigned int t=0; t < threads; ++t) {
+				std::size_t n=offsets[t*Buckets+b];
+				offsets[t*Buckets+b]=pos;
+				pos+=n;
+			}
+		}
+		starts[Buckets]=pos;
+		parallel(&OpSorter::scatter);
+		parallel(&OpSorter::sortBuckets);
+		ops.swap(sorted);
+	}
+
+private:
+	enum {
+		Buckets=1 << 16
+	};
+
+	static std::size_t bucketOf(const Op& op) {
+		return ((std::size_t)op.digest.bytes[0] << 8) | op.digest.bytes[1];
+	}
+
+	std::size_t slice(std::size_t n, unsigned int t) const {
+		return (std::size_t)((boost::uint64_t)n*t/threads);
+	}
+
+	void count(unsigned int t) {
+		std::size_t* cnt=&offsets[t*Buckets];
+		for(std::size_t i=slice(ops.size(), t); i < slice(ops.size(), t+1); ++i)
+			++cnt[bucketOf(ops[i])];
+	}
+
+	void scatter(unsigned int t) {
+		std::size_t* off=&offsets[t*Buckets];
+		for(std::size_t i=slice(ops.size(), t); i < slice(ops.size(), t+1); ++i)
+			sorted[off[bucketOf(ops[i])]++]=ops[i];
+	}
+
+	void sortBuckets(unsigned int t) {
+		for(std::size_t b=slice(Buckets, t); b < slice(Buckets, t+1); ++b) {
+			if(starts[b+1]-starts[b] > 1)
+				std::stable_sort(sorted.begin()+starts[b], sorted.begin()+starts[b+1], opLess);
+		}
+	}
+
+	void parallel(void (OpSorter::*fn)(unsigned int)) {
+		boost::thread_group group;
+		for(unsigned int t=1; t < threads; ++t)
+			group.create_thread(boost::bind(fn, this, t));
+		(this->*fn)(0);
+		group.join_all();
+	}
+
+	std::vector<Op>& ops;
+	std::vector<Op> sorted;
+	unsigned int threads;
+	/// counts of digests in buckets for each thread, then positions for them
+	std::vector<std::size_t> offsets;
+	std::vector<std::size_t> starts;
+} ;
+
+}
+
+/**
+ * Convert 32-char hex string into digest
+ *
+ * @param str string to parse
+ * @param len length of string
+ * @param d resulting digest
+ *
+ * @return false if string isn't valid hex representation of MD5
+ */
+bool parseHexDigest(const char* str, std::size_t len, Digest& d) {
+	if(len != 32)
+		return false;
+	for(int i=0; i < 16; ++i) {
+		int h=hexValue(str[2*i]);
+		int l=hexValue(str[2*i+1]);
+		if(h < 0 || l < 0)
+			return false;
+		d.bytes[i]=(unsigned char)((h << 4) | l);
+	}
+	return true;
+}
+
+bool parseHexDigest(const std::string& str, Digest& d) {
+	return parseHexDigest(str.data(), str.size(), d);
+}
+
+std::string formatHexDigest(const Digest& d) {
+	static const char hex[]="0123456789abcdef";
+	std::string result(32, '0');
+	for(int i=0; i < 16; ++i) {
+		result[2*i]=hex[d.bytes[i] >> 4];
+		result[2*i+1]=hex[d.bytes[i] & 0x0f];
+	}
+	return result;
+}
+
+namespace {
+
+/**
+ * Memory, owned by index
+ */
+struct DigestStorage {
+	DigestVector digests;
+	std::vector<boost::uint32_t> masks;
+	std::vector<boost::uint32_t> buckets;
+	std::vector<boost::uint64_t> filter;
+} ;
+
+}
+
+unsigned int DigestIndex::bucketBitsFor(std::size_t n) {
+	// select number of buckets as power of 2, nearest to half of number of entries
+	unsigned int bits=0;
+	while(bits < 24 && ((std::size_t)2 << bits) < n)
+		++bits;
+	return bits;
+}
+
+std::size_t DigestIndex::filterBlocksFor(std::size_t n) {
+	const std::size_t blockBits=FilterBlockWords*64;
+	return (n*FilterBitsPerEntry + blockBits-1)/blockBits;
+}
+
+void DigestIndex::assign(DigestVector& sorted, std::vector<boost::uint32_t>* m,
+						 bool withFilter) {
+	boost::shared_ptr<DigestStorage> st(new DigestStorage());
+	st->digests.swap(sorted);
+	sorted.clear();
+	if(m) {
+		st->masks.swap(*m);
+		m->clear();
+	}
+
+	unsigned int bits=bucketBitsFor(st->digests.size());
+	shift=32-bits;
+	st->buckets.resize(((std::size_t)1 << bits) + 1);
+	std::size_t i=0;
+	for(std::size_t p=0; p < st->buckets.size()-1; ++p) {
+		while(i < st->digests.size() && bucketOf(st->digests[i]) < p)
+			++i;
+		st->buckets[p]=i;
+	}
+	st->buckets.back()=st->digests.size();
+
+	filterBlocks=withFilter ? filterBlocksFor(st->digests.size()) : 0;
+	st->filter.assign(filterBlocks*FilterBlockWords, 0);
+	for(std::size_t j=0; j < st->digests.size() && filterBlocks; ++j) {
+		const Digest& d=st->digests[j];
+		boost::uint64_t* b=&st->filter[filterBlockOf(d, filterBlocks)*FilterBlockWords];
+		boost::uint64_t w=loadWord64(d.bytes+8);
+		for(int k=0; k < FilterHashes; ++k, w>>=9)
+			b[(w >> 6) & (FilterBlockWords-1)]|=(boost::uint64_t)1 << (w & 63);
+	}
+
+	owner=st;
+	digests=st->digests.empty() ? 0 : &st->digests[0];
+	masks=st->masks.empty() ? 0 : &st->masks[0];
+	count=st->digests.size();
+	buckets=&st->buckets[0];
+	filter=filterBlocks ? &st->filter[0] : 0;
+}
+
+void DigestIndex::attach(const boost::shared_ptr<const void>& o, const Digest* d,
+						 std::size_t n, const boost::uint32_t* b, unsigned int bits,
+						 const boost::uint32_t* m, const boost::uint64_t* f, std::size_t fb) {
+	owner=o;
+	filter=fb ? f : 0;
+	filterBlocks=f ? fb : 0;
+	digests=d;
+	masks=m;
+	count=n;
+	buckets=b;
+	shift=32-bits;
+}
+
+void DigestIndex::clear() {
+	owner.reset();
+	digests=0;
+	masks=0;
+	count=0;
+	buckets=0;
+	shift=32;
+	filter=0;
+	filterBlocks=0;
+}
+
+bool DigestIndex::mayContain(const Digest& d) const {
+	if(filter == 0)
+		return count != 0;
+	const boost::uint64_t* b=filter + filterBlockOf(d, filterBlocks)*FilterBlockWords;
+	boost::uint64_t w=loadWord64(d.bytes+8);
+	for(int k=0; k < FilterHashes; ++k, w>>=9) {
+		if(!(b[(w >> 6) & (FilterBlockWords-1)] & ((boost::uint64_t)1 << (w & 63))))
+			return false;
+	}
+	return true;
+}
+
+bool DigestIndex::find(const Digest& d, boost::uint32_t& mask) const {
+	if(count == 0 || (filter && !mayContain(d)))
+		return false;
+	boost::uint32_t p=bucketOf(d);
+	const Digest* it=digests+buckets[p];
+	const Digest* itEnd=digests+buckets[p+1];
+	for(; it != itEnd; ++it) {
+		int c=std::memcmp(it->bytes, d.bytes, 16);
+		if(c == 0) {
+			mask=masks ? masks[it-digests] : 1;
+			return true;
+		}
+		if(c > 0)
+			break;
+	}
+	return false;
+}
+
+std::size_t DigestIndex::memoryUsage() const {
+	if(buckets == 0)
+		return 0;
+	return count*sizeof(Digest) + (masks ? count*sizeof(boost::uint32_t) : 0) +
+		(((std::size_t)1 << bucketBits()) + 1)*sizeof(boost::uint32_t) +
+		filterBlocks*FilterBlockWords*sizeof(boost::uint64_t);
+}
+
+namespace {
+
+struct PrefixStorage {
+	std::vector<boost::uint32_t> prefixes;
+	std::vector<boost::uint32_t> masks;
+	std::vector<boost::uint32_t> buckets;
+} ;
+
+}
+
+void PrefixIndex::assign(const DigestIndex& index) {
+	boost::shared_ptr<PrefixStorage> st(new PrefixStorage());
+	st->prefixes.reserve(index.size());
+	st->masks.reserve(index.size());
+	const boost::uint32_t* m=index.maskTable();
+	for(std::size_t i=0; i < index.size(); ++i) {
+		boost::uint32_t p=index.begin()[i].prefix();
+		boost::uint32_t mask=m ? m[i] : 1;
+		if(!st->prefixes.empty() && st->prefixes.back() == p) {
+			st->masks.back()|=mask;
+		} else {
+			st->prefixes.push_back(p);
+			st->masks.push_back(mask);
+		}
+	}
+
+	// buckets are 4 times larger than in DigestIndex: 8 prefixes take one cache line
+	unsigned int bits=DigestIndex::bucketBitsFor(st->prefixes.size()/4);
+	shift=32-bits;
+	st->buckets.resize(((std::size_t)1 << bits) + 1);
+	std::size_t i=0;
+	for(std::size_t b=0; b < st->buckets.size()-1; ++b) {
+		while(i < st->prefixes.size() && bucketOf(st->prefixes[i]) < b)
+			++i;
+		st->buckets[b]=i;
+	}
+	st->buckets.back()=st->prefixes.size();
+
+	owner=st;
+	prefixes=st->prefixes.empty() ? 0 : &st->prefixes[0];
+	masks=st->masks.empty() ? 0 : &st->masks[0];
+	count=st->prefixes.size();
+	buckets=&st->buckets[0];
+}
+
+void PrefixIndex::attach(const boost::shared_ptr<const void>& o, const boost::uint32_t* p,
+						 std::size_t n, const boost::uint32_t* b, unsigned int bits,
+						 const boost::uint32_t* m) {
+	owner=o;
+	prefixes=p;
+	masks=m;
+	count=n;
+	buckets=b;
+	shift=32-bits;
+}
+
+void PrefixIndex::clear() {
+	owner.reset();
+	prefixes=0;
+	masks=0;
+	count=0;
+	buckets=0;
+	shift=32;
+}
+
+boost::uint32_t PrefixIndex::lookup(boost::uint32_t p) const {
+	if(count == 0)
+		return 0;
+	boost::uint32_t b=bucketOf(p);
+	const boost::uint32_t* it=prefixes+buckets[b];
+	const boost::uint32_t* itEnd=prefixes+buckets[b+1];
+	for(; it != itEnd && *it <= p; ++it) {
+		if(*it == p)
+			return masks[it-prefixes];
+	}
+	return 0;
+}
+
+std::size_t PrefixIndex::memoryUsage() const {
+	if(buckets == 0)
+		return 0;
+	return count*2*sizeof(boost::uint32_t) +
+		(((std::size_t)1 << bucketBits()) + 1)*sizeof(boost::uint32_t);
+}
+
+namespace {
+
+struct RiceStorage {
+	std::vector<boost::uint32_t> firsts;
+	std::vector<boost::uint32_t> offsets;
+	std::vector<boost::uint64_t> bits;
+} ;
+
+/**
+ * Writer of bits, starting from lowest bits of words
+ */
+struct BitWriter {
+	BitWriter(std::vector<boost::uint64_t>& w) : words(w), pos(0) { }
+
+	void put(boost::uint64_t value, unsigned int n) {
+		if(n == 0)
+			return;
+		unsigned int o=pos & 63;
+		if(o == 0)
+			words.push_back(0);
+		words.back()|=value << o;
+		if(o + n > 64)
+			words.push_back(value >> (64-o));
+		pos+=n;
+	}
+
+	/// unary code of q: q zero bits followed by one
+	void unary(boost::uint32_t q) {
+		for(; q >= 32; q-=32)
+			put(0, 32);
+		put((boost::uint64_t)1 << q, q+1);
+	}
+
+	std::vector<boost::uint64_t>& words;
+	std::size_t pos;
+} ;
+
+/**
+ * Reader of bits, that doesn't go beyond end of data
+ */
+struct BitReader {
+	BitReader(const boost::uint64_t* w, std::size_t p, std::size_t l) : words(w), pos(p),
+																		limit(l) { }
+
+	bool unary(boost::uint32_t& q) {
+		q=0;
+		while(pos < limit) {
+			boost::uint64_t w=words[pos >> 6] >> (pos & 63);
+			if(w) {
+				unsigned int z=lowestBit(w);
+				q+=z;
+				pos+=z+1;
+				return pos <= limit;
+			}
+			q+=64 - (pos & 63);
+			pos+=64 - (pos & 63);
+		}
+		return false;
+	}
+
+	bool get(unsigned int n, boost::uint32_t& value) {
+		if(pos + n > limit)
+			return false;
+		value=0;
+		if(n == 0)
+			return true;
+		std::size_t i=pos >> 6;
+		unsigned int o=pos & 63;
+		boost::uint64_t v=words[i] >> o;
+		if(o + n > 64)
+			v|=words[i+1] << (64-o);
+		value=v & (((boost::uint64_t)1 << n) - 1);
+		pos+=n;
+		return true;
+	}
+
+	static unsigned int lowestBit(boost::uint64_t w) {
+#ifdef __GNUC__
+		return __builtin_ctzll(w);
+#else
+		unsigned int n=0;
+		for(; !(w & 1); w>>=1)
+			++n;
+		return n;
+#endif
+	}
+
+	const boost::uint64_t* words;
+	std::size_t pos;
+	std::size_t limit;
+} ;
+
+/// quotient, after which difference is written as is, so outliers don't take much space
+const boost::uint32_t RiceEscape=64;
+
+inline bool readDifference(BitReader& r, unsigned int k, boost::uint32_t& d) {
+	boost::uint32_t q, rem;
+	if(!r.unary(q))
+		return false;
+	if(q == RiceEscape)
+		return r.get(32, d);
+	if(q > RiceEscape || !r.get(k, rem))
+		return false;
+	d=(q << k) | rem;
+	return true;
+}
+
+}
+
+/**
+ * Parameter of Rice code is chosen by exact size of encoded differences, so outliers
+ * don't spoil it, like they spoil estimation by average difference.  Random values take
+ * about log2(average difference)+2 bits each
+ */
+void RiceIndex::assign(const std::vector<boost::uint32_t>& sorted) {
+	boost::shared_ptr<RiceStorage> st(new RiceStorage());
+	std::vector<boost::uint64_t> sizes(32, 0);
+	for(std::size_t i=1; i < sorted.size(); ++i) {
+		if(i % BlockSize == 0)
+			continue;
+		boost::uint32_t d=sorted[i] - sorted[i-1];
+		for(unsigned int p=0; p < sizes.size(); ++p) {
+			boost::uint32_t q=d >> p;
+			sizes[p]+=q >= RiceEscape ? RiceEscape + 33 : q + 1 + p;
+		}
+	}
+	k=std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+
+	BitWriter w(st->bits);
+	for(std::size_t i=0; i < sorted.size(); ++i) {
+		if(i % BlockSize == 0) {
+			st->firsts.push_back(sorted[i]);
+			st->offsets.push_back(w.pos);
+			continue;
+		}
+		boost::uint32_t d=sorted[i] - sorted[i-1];
+		if((d >> k) >= RiceEscape) {
+			w.unary(RiceEscape);
+			w.put(d, 32);
+		} else {
+			w.unary(d >> k);
+			w.put(d & (((boost::uint64_t)1 << k) - 1), k);
+		}
+	}
+
+	owner=st;
+	firsts=st->firsts.empty() ? 0 : &st->firsts[0];
+	offsets=st->offsets.empty() ? 0 : &st->offsets[0];
+	bits=st->bits.empty() ? 0 : &st->bits[0];
+	count=sorted.size();
+	blocks=st->firsts.size();
+	words=st->bits.size();
+	buildBuckets();
+}
+
+/**
+ * Buckets have about 2 blocks each, so their table takes 1 bit per prefix
+ */
+void RiceIndex::buildBuckets() {
+	unsigned int b=DigestIndex::bucketBitsFor(blocks);
+	boost::shared_ptr<std::vector<boost::uint32_t> > st(
+		new std::vector<boost::uint32_t>(((std::size_t)1 << b) + 1));
+	shift=32-b;
+	std::size_t i=0;
+	for(std::size_t p=0; p < st->size()-1; ++p) {
+		while(i < blocks && (shift == 32 ? 0 : firsts[i] >> shift) < p)
+			++i;
+		(*st)[p]=i;
+	}
+	st->back()=blocks;
+	bucketStorage=st;
+	buckets=&(*st)[0];
+}
+
+void RiceIndex::attach(const boost::shared_ptr<const void>& o, const boost::uint32_t* f,
+					   const boost::uint32_t* off, std::size_t nb, const boost::uint64_t* b,
+					   std::size_t nw, std::size_t n, unsigned int param) {
+	owner=o;
+	firsts=f;
+	offsets=off;
+	blocks=nb;
+	bits=b;
+	words=nw;
+	count=n;
+	k=param;
+	buildBuckets();
+}
+
+void RiceIndex::clear() {
+	owner.reset();
+	firsts=0;
+	offsets=0;
+	bits=0;
+	count=0;
+	blocks=0;
+	words=0;
+	k=0;
+	bucketStorage.reset();
+	buckets=0;
+	shift=32;
+}
+
+bool RiceIndex::contains(boost::uint32_t p) const {
+	if(blocks == 0)
+		return false;
+	// block with p could start in previous bucket
+	boost::uint32_t bucket=shift == 32 ? 0 : p >> shift;
+	const boost::uint32_t* lo=firsts + (buckets[bucket] ? buckets[bucket]-1 : 0);
+	const boost::uint32_t* it=std::upper_bound(lo, firsts + buckets[bucket+1], p);
+	if(it == firsts)
+		return false;
+	std::size_t b=it-firsts-1;
+	boost::uint32_t v=firsts[b];
+	std::size_t n=std::min((std::size_t)BlockSize, count - b*BlockSize);
+	BitReader r(bits, offsets[b], words*64);
+	for(std::size_t i=1; i < n && v < p; ++i) {
+		boost::uint32_t d;
+		if(!readDifference(r, k, d))
+			return false;
+		v+=d;
+	}
+	return v == p;
+}
+
+void RiceIndex::decode(std::vector<boost::uint32_t>& result) const {
+	result.clear();
+	result.reserve(count);
+	for(std::size_t b=0; b < blocks; ++b) {
+		boost::uint32_t v=firsts[b];
+		result.push_back(v);
+		std::size_t n=std::min((std::size_t)BlockSize, count - b*BlockSize);
+		BitReader r(bits, offsets[b], words*64);
+		for(std::size_t i=1; i < n; ++i) {
+			boost::uint32_t d;
+			if(!readDifference(r, k, d))
+				return;
+			v+=d;
+			result.push_back(v);
+		}
+	}
+}
+
+std::size_t RiceIndex::memoryUsage() const {
+	if(blocks == 0)
+		return 0;
+	return blocks*2*sizeof(boost::uint32_t) + words*sizeof(boost::uint64_t) +
+		bucketStorage->size()*sizeof(boost::uint32_t);
+}
+
+bool RiceIndex::valid() const {
+	if(k > 31 || blocks != (count + BlockSize - 1)/BlockSize)
+		return false;
+	for(std::size_t b=0; b < blocks; ++b) {
+		if(offsets[b] > words*64 || (b && (offsets[b] < offsets[b-1] || firsts[b] <= firsts[b-1])))
+			return false;
+	}
+	return true;
+}
+
+void DigestUpdate::add(const Digest& d) {
+	Op op;
+	op.digest=d;
+	op.add=true;
+	ops.push_back(op);
+}
+
+void DigestUpdate::remove(const Digest& d) {
+	Op op;
+	op.digest=d;
+	op.add=false;
+	ops.push_back(op);
+}
+
+void DigestUpdate::apply(const Digest* first, const Digest* last, DigestVector& result) {
+	// stable sort keeps order of operations for the same digest
+	if(ops.size() < MinRadixSort) {
+		std::stable_sort(ops.begin(), ops.end(), opLess);
+	} else {
+		unsigned int t=threads ? threads : boost::thread::hardware_concurrency();
+		// each thread gets enough of work to pay for its start
+		t=std::max(1u, std::min(t, (unsigned int)(ops.size()/MinRadixSort)));
+		OpSorter(ops, t).run();
+	}
+
+	result.clear();
+	result.reserve((last-first) + ops.size());
+	const Digest* bi=first;
+	std::vector<Op>::const_iterator oi=ops.begin();
+	while(oi != ops.end()) {
+		// last operation for given digest wins
+		std::vector<Op>::const_iterator op=oi;
+		while(oi != ops.end() && oi->digest == op->digest)
+			op=oi++;
+		while(bi != last && *bi < op->digest)
+			result.push_back(*bi++);
+		if(bi != last && *bi == op->digest)
+			++bi;
+		if(op->add)
+			result.push_back(op->digest);
+	}
+	result.insert(result.end(), bi, last);
+	ops.clear();
+}
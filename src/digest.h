@@ -0,0 +1,342 @@
+/**
+ * @file   digest.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary MD5 digests & flat index of them
+ *
+ *
+ */
+
+#ifndef _DIGEST_H
+#define _DIGEST_H 1
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+/**
+ * Raw 128-bit MD5 digest
+ */
+struct Digest {
+	unsigned char bytes[16];
+
+	/**
+	 * First 32 bits of digest, in big endian order, so prefixes are sorted in the same
+	 * order as digests
+	 */
+	boost::uint32_t prefix() const {
+		return ((boost::uint32_t)bytes[0] << 24) | ((boost::uint32_t)bytes[1] << 16) |
+			((boost::uint32_t)bytes[2] << 8) | (boost::uint32_t)bytes[3];
+	}
+} ;
+
+inline bool operator<(const Digest& a, const Digest& b) {
+	return std::memcmp(a.bytes, b.bytes, 16) < 0;
+}
+
+inline bool operator==(const Digest& a, const Digest& b) {
+	return std::memcmp(a.bytes, b.bytes, 16) == 0;
+}
+
+inline bool operator!=(const Digest& a, const Digest& b) {
+	return !(a == b);
+}
+
+typedef std::vector<Digest> DigestVector;
+
+bool parseHexDigest(const char* str, std::size_t len, Digest& d);
+bool parseHexDigest(const std::string& str, Digest& d);
+std::string formatHexDigest(const Digest& d);
+
+/**
+ * Sorted array of digests with direct-mapped table of prefixes on top of it.  Because
+ * MD5 values are uniformly distributed, first bits of digest select small bucket
+ * (2 entries in average), so lookup costs two cache misses at most.
+ *
+ * Data of index are immutable & could be owned by index itself or live in memory-mapped
+ * file, so copies of index share the same memory.
+ *
+ * Index could hold several lists: then each digest has bitmask of lists, that contain it.
+ *
+ * Optional Bloom filter rejects most of absent digests before index is touched.  Filter
+ * is split into blocks of cache line size, so each check costs one cache miss.
+ */
+struct DigestIndex {
+	enum {
+		/// size of filter's block in 64-bit words
+		FilterBlockWords=8,
+		/// number of bits, set for each digest
+		FilterHashes=7,
+		FilterBitsPerEntry=10
+	};
+
+	DigestIndex() : digests(0), masks(0), count(0), buckets(0), shift(32), filter(0),
+					filterBlocks(0) { }
+
+	/**
+	 * Replace content of index with given digests.  Vector should be sorted & without
+	 * duplicates, its content is moved into index
+	 *
+	 * @param sorted digests
+	 * @param m optional masks of lists for each digest, also moved into index
+	 * @param withFilter build Bloom filter for digests
+	 */
+	void assign(DigestVector& sorted, std::vector<boost::uint32_t>* m=0, bool withFilter=false);
+
+	/**
+	 * Use data, stored somewhere else, for example in memory-mapped file
+	 *
+	 * @param owner object, that keeps memory alive
+	 * @param d sorted digests
+	 * @param n number of digests
+	 * @param b table of buckets, built for given number of bits
+	 * @param bits number of bits in bucket table
+	 * @param m optional masks of lists for each digest
+	 * @param f optional Bloom filter
+	 * @param fb number of blocks in filter
+	 */
+	void attach(const boost::shared_ptr<const void>& owner, const Digest* d, std::size_t n,
+				const boost::uint32_t* b, unsigned int bits, const boost::uint32_t* m=0,
+				const boost::uint64_t* f=0, std::size_t fb=0);
+
+	void clear();
+
+	/**
+	 * Find digest in index
+	 *
+	 * @return mask of lists, that contain digest (1 for index without masks), or 0
+	 */
+	boost::uint32_t lookup(const Digest& d) const {
+		boost::uint32_t mask;
+		return find(d, mask) ? mask : 0;
+	}
+
+	/**
+	 * Find digest in index, that could have empty mask
+	 *
+	 * @param mask mask of lists for found digest
+	 *
+	 * @return false if there is no such digest
+	 */
+	bool find(const Digest& d, boost::uint32_t& mask) const;
+
+	/// check digest by filter only: false means that digest isn't in index
+	bool mayContain(const Digest& d) const;
+	bool contains(const Digest& d) const { return lookup(d) != 0; }
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const Digest* begin() const { return digests; }
+	const Digest* end() const { return digests+count; }
+
+	unsigned int bucketBits() const { return 32-shift; }
+	const boost::uint32_t* bucketTable() const { return buckets; }
+	const boost::uint32_t* maskTable() const { return masks; }
+	const boost::uint64_t* filterTable() const { return filter; }
+	std::size_t filterSize() const { return filterBlocks; }
+	static std::size_t filterBlocksFor(std::size_t n);
+	static unsigned int bucketBitsFor(std::size_t n);
+
+	/// number of bytes used by index
+	std::size_t memoryUsage() const;
+
+private:
+	boost::uint32_t bucketOf(const Digest& d) const {
+		return shift == 32 ? 0 : d.prefix() >> shift;
+	}
+
+	boost::shared_ptr<const void> owner;
+	const Digest* digests;
+	const boost::uint32_t* masks;
+	std::size_t count;
+	/// buckets[p] is index of first digest with prefix >= p; has one sentinel element
+	const boost::uint32_t* buckets;
+	unsigned int shift;
+	const boost::uint64_t* filter;
+	std::size_t filterBlocks;
+} ;
+
+/**
+ * Sorted array of 32-bit prefixes of digests with masks of lists & table of buckets, like
+ * in DigestIndex.  It takes 4 bytes per entry instead of 16, but found prefix only means
+ * that digest could be in lists, so match should be confirmed by full digest
+ */
+struct PrefixIndex {
+	PrefixIndex() : prefixes(0), masks(0), count(0), buckets(0), shift(32) { }
+
+	/**
+	 * Build index from prefixes of digests in index.  Masks of digests with the same
+	 * prefix are merged
+	 */
+	void assign(const DigestIndex& index);
+
+	/**
+	 * Use data, stored somewhere else, for example in memory-mapped file
+	 *
+	 * @param owner object, that keeps memory alive
+	 * @param p sorted prefixes without duplicates
+	 * @param n number of prefixes
+	 * @param b table of buckets, built for given number of bits
+	 * @param bits number of bits in bucket table
+	 * @param m masks of lists for each prefix
+	 */
+	void attach(const boost::shared_ptr<const void>& owner, const boost::uint32_t* p,
+				std::size_t n, const boost::uint32_t* b, unsigned int bits,
+				const boost::uint32_t* m);
+
+	void clear();
+
+	/**
+	 * Find prefix in index
+	 *
+	 * @return mask of lists, that could contain digest with this prefix, or 0
+	 */
+	boost::uint32_t lookup(boost::uint32_t prefix) const;
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const boost::uint32_t* begin() const { return prefixes; }
+	const boost::uint32_t* end() const { return prefixes+count; }
+
+	unsigned int bucketBits() const { return 32-shift; }
+	const boost::uint32_t* bucketTable() const { return buckets; }
+	const boost::uint32_t* maskTable() const { return masks; }
+
+	/// number of bytes used by index
+	std::size_t memoryUsage() const;
+
+private:
+	boost::uint32_t bucketOf(boost::uint32_t p) const {
+		return shift == 32 ? 0 : p >> shift;
+	}
+
+	boost::shared_ptr<const void> owner;
+	const boost::uint32_t* prefixes;
+	const boost::uint32_t* masks;
+	std::size_t count;
+	const boost::uint32_t* buckets;
+	unsigned int shift;
+} ;
+
+/**
+ * Compressed set of 32-bit prefixes of one list.  Sorted prefixes are split into blocks of
+ * BlockSize entries: first prefix of each block is kept in block index, & differences
+ * between following prefixes are Golomb-Rice coded with one parameter for whole set.
+ * Lookup finds block through table of buckets on top of block index (like in
+ * DigestIndex, it's built on load) & decodes only this block.  Set takes about 15 bits
+ * per prefix for 2M prefixes (PrefixIndex takes 64 bits with masks), but lookup is
+ * several times slower
+ */
+struct RiceIndex {
+	enum {
+		/// number of prefixes in one block, including first one
+		BlockSize=32
+	};
+
+	RiceIndex() : firsts(0), offsets(0), bits(0), count(0), blocks(0), words(0), k(0),
+				  buckets(0), shift(32) { }
+
+	/**
+	 * Encode prefixes
+	 *
+	 * @param sorted prefixes, sorted & without duplicates
+	 */
+	void assign(const std::vector<boost::uint32_t>& sorted);
+
+	/**
+	 * Use data, stored somewhere else, for example in memory-mapped file
+	 *
+	 * @param owner object, that keeps memory alive
+	 * @param f first prefix of each block
+	 * @param o offset of differences of each block in encoded data, in bits
+	 * @param nb number of blocks
+	 * @param b encoded differences
+	 * @param nw number of 64-bit words in encoded differences
+	 * @param n number of prefixes
+	 * @param param parameter of Rice code
+	 */
+	void attach(const boost::shared_ptr<const void>& owner, const boost::uint32_t* f,
+				const boost::uint32_t* o, std::size_t nb, const boost::uint64_t* b,
+				std::size_t nw, std::size_t n, unsigned int param);
+
+	void clear();
+
+	bool contains(boost::uint32_t prefix) const;
+
+	/// decode all prefixes
+	void decode(std::vector<boost::uint32_t>& result) const;
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	std::size_t blockCount() const { return blocks; }
+	std::size_t wordCount() const { return words; }
+	unsigned int parameter() const { return k; }
+	const boost::uint32_t* firstTable() const { return firsts; }
+	const boost::uint32_t* offsetTable() const { return offsets; }
+	const boost::uint64_t* bitTable() const { return bits; }
+
+	/// number of bytes used by index
+	std::size_t memoryUsage() const;
+
+	/**
+	 * Check that attached data are consistent: offsets are increasing & don't exceed
+	 * encoded data
+	 */
+	bool valid() const;
+
+private:
+	void buildBuckets();
+
+	boost::shared_ptr<const void> owner;
+	const boost::uint32_t* firsts;
+	const boost::uint32_t* offsets;
+	const boost::uint64_t* bits;
+	std::size_t count;
+	std::size_t blocks;
+	std::size_t words;
+	unsigned int k;
+	/// buckets[p] is index of first block, which first prefix is >= p
+	boost::shared_ptr<const std::vector<boost::uint32_t> > bucketStorage;
+	const boost::uint32_t* buckets;
+	unsigned int shift;
+} ;
+
+/**
+ * Changes to digests set, collected from update and applied in bulk: operations are
+ * sorted by parallel radix sort & merged with current digests in one pass.  Operations
+ * are applied in order they were added, so later operation for the same digest wins
+ */
+struct DigestUpdate {
+	enum {
+		/// smaller updates are sorted by one thread with std::stable_sort
+		MinRadixSort=65536
+	};
+
+	DigestUpdate() : threads(0) { }
+
+	void add(const Digest& d);
+	void remove(const Digest& d);
+	void clear() { ops.clear(); }
+	bool empty() const { return ops.empty(); }
+
+	/**
+	 * Merge changes with sorted digests
+	 *
+	 * @param first begin of current sorted digests
+	 * @param last end of current sorted digests
+	 * @param result sorted digests after applying of changes
+	 */
+	void apply(const Digest* first, const Digest* last, DigestVector& result);
+
+	struct Op {
+		Digest digest;
+		bool add;
+	} ;
+	std::vector<Op> ops;
+	/// number of threads, used to sort operations; 0 - number of CPUs
+	unsigned int threads;
+} ;
+
+#endif /* _DIGEST_H */
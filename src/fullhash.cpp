@@ -0,0 +1,559 @@
+/**
+ * @file   fullhash.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Confirmation of prefixes by full digests, requested from server & cached
+ *
+ *
+ */
+
+#include "fullhash.h"
+
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+
+namespace ba=boost::asio;
+
+namespace {
+
+const char sMagic[8]={ 'G', 'S', 'B', 'F', 'U', 'L', 'L', 0 };
+const boost::uint32_t sByteOrder=0x01020304;
+const boost::uint32_t sFormatVersion=1;
+
+/**
+ * Header of saved cache.  It's followed by names of lists (32-bit length & characters) &
+ * by entries: prefix, number of digests, time of expiration & digests with masks
+ */
+struct CacheFileHeader {
+	char magic[8];
+	boost::uint32_t byteOrder;
+	boost::uint32_t formatVersion;
+	boost::uint32_t nameCount;
+	boost::uint32_t reserved;
+	boost::uint64_t count;
+} ;
+
+struct CacheFileEntry {
+	boost::uint32_t prefix;
+	boost::uint32_t count;
+	boost::int64_t expires;
+} ;
+
+/**
+ * Blocking HTTP request over new connection.  Asynchronous operations are run on own
+ * io_service, so whole exchange is limited by timeout in milliseconds
+ */
+class HttpExchange {
+public:
+	typedef boost::system::error_code ErrorCode;
+
+	HttpExchange(unsigned int t) : resolver(io), socket(io), timer(io), timeout(t), buf(4096),
+								   finished(false), result(false) { }
+
+	/**
+	 * Send request & read response till connection is closed by server
+	 *
+	 * @return false on errors or timeout
+	 */
+	bool run(const std::string& server, const std::string& port, const std::string& req,
+			 std::string& resp) {
+		request=req;
+		timer.expires_from_now(boost::posix_time::milliseconds(timeout));
+		timer.async_wait(boost::bind(&HttpExchange::onTimeout, this, ba::placeholders::error));
+		ba::ip::tcp::resolver::query query(server, port);
+		resolver.async_resolve(query, boost::bind(&HttpExchange::onResolve, this,
+												  ba::placeholders::error,
+												  ba::placeholders::iterator));
+		io.run();
+		resp.swap(response);
+		return result;
+	}
+
+private:
+	void onResolve(const ErrorCode& ec, ba::ip::tcp::resolver::iterator it) {
+		if(ec || finished) {
+			finish(false);
+			return;
+		}
+		ba::async_connect(socket, it, boost::bind(&HttpExchange::onConnect, this,
+												  ba::placeholders::error));
+	}
+
+	void onConnect(const ErrorCode& ec) {
+		if(ec || finished) {
+			finish(false);
+			return;
+		}
+		ba::async_write(socket, ba::buffer(request),
+						boost::bind(&HttpExchange::onWrite, this, ba::placeholders::error));
+	}
+
+	void onWrite(const ErrorCode& ec) {
+		if(ec || finished) {
+			finish(false);
+			return;
+		}
+		read();
+	}
+
+	void read() {
+		socket.async_read_some(ba::buffer(buf),
+							   boost::bind(&HttpExchange::onRead, this, ba::placeholders::error,
+										   ba::placeholders::bytes_transferred));
+	}
+
+	void onRead(const ErrorCode& ec, std::size_t n) {
+		if(finished)
+			return;
+		response.append(&buf[0], n);
+		if(ec == ba::error::eof)
+			finish(true);
+		else if(ec)
+			finish(false);
+		else
+			read();
+	}
+
+	void onTimeout(const ErrorCode& ec) {
+		if(ec == ba::error::operation_aborted || finished)
+			return;
+		if(runDebug)
+			std::cerr << "Timeout of full hash request" << std::endl;
+		finish(false);
+	}
+
+	void finish(bool r) {
+		if(finished)
+			return;
+		finished=true;
+		result=r;
+		ErrorCode ignored;
+		timer.cancel(ignored);
+		resolver.cancel();
+		socket.close(ignored);
+	}
+
+	ba::io_service io;
+	ba::ip::tcp::resolver resolver;
+	ba::ip::tcp::socket socket;
+	ba::deadline_timer timer;
+	unsigned int timeout;
+	std::string request;
+	std::string response;
+	std::vector<char> buf;
+	bool finished;
+	bool result;
+} ;
+
+/**
+ * Split HTTP response into status & body
+ *
+ * @return false if response isn't complete
+ */
+bool parseResponse(const std::string& resp, int& code, std::string& body) {
+	std::string::size_type end=resp.find("\r\n\r\n");
+	if(end == std::string::npos)
+		return false;
+	std::istringstream is(resp.substr(0, end));
+	std::string ts, version;
+	std::getline(is, ts);
+	std::istringstream status(ts);
+	code=0;
+	status >> version >> code;
+	if(!boost::starts_with(version, "HTTP/") || code == 0)
+		return false;
+	body=resp.substr(end+4);
+	while(std::getline(is, ts)) {
+		std::string::size_type colon=ts.find(':');
+		if(colon == std::string::npos ||
+		   !boost::iequals(boost::trim_copy(ts.substr(0, colon)), "Content-Length"))
+			continue;
+		try {
+			std::size_t len=boost::lexical_cast<std::size_t>(boost::trim_copy(ts.substr(colon+1)));
+			if(len > body.size())
+				return false;
+			body.resize(len);
+		} catch(boost::bad_lexical_cast&) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template<class T> bool readValue(std::istream& is, T& v) {
+	return !is.read(reinterpret_cast<char*>(&v), sizeof(v)).fail();
+}
+
+template<class T> void writeValue(std::ostream& os, const T& v) {
+	os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+/**
+ * Exclusive lock of file, that is held while object exists.  Lock isn't taken, if file
+ * can't be opened
+ */
+class FileLock {
+public:
+	FileLock(const fs::path& p) : fd(::open(pathString(p).c_str(), O_RDWR | O_CREAT, 0644)) {
+		if(fd >= 0)
+			::flock(fd, LOCK_EX);
+	}
+
+	~FileLock() {
+		if(fd >= 0)
+			::close(fd);
+	}
+
+private:
+	int fd;
+} ;
+
+}
+
+bool parseFullHashes(const std::string& body, FullHashes& hashes, unsigned int& lifetime) {
+	std::size_t pos=0;
+	bool first=true;
+	try {
+		while(pos < body.size()) {
+			std::string::size_type nl=body.find('\n', pos);
+			if(nl == std::string::npos)
+				return false;
+			std::string line=boost::trim_copy(body.substr(pos, nl-pos));
+			pos=nl+1;
+			std::vector<std::string> parts;
+			boost::split(parts, line, boost::is_any_of(":"));
+			if(first && parts.size() == 1) {
+				lifetime=boost::lexical_cast<unsigned int>(line);
+				first=false;
+				continue;
+			}
+			first=false;
+			if(parts.size() != 3 || parts[0].empty())
+				return false;
+			std::size_t len=boost::lexical_cast<std::size_t>(parts[2]);
+			if(len % sizeof(Digest) != 0 || len > body.size()-pos)
+				return false;
+			for(std::size_t i=0; i < len; i+=sizeof(Digest)) {
+				FullHash fh;
+				fh.list=parts[0];
+				std::memcpy(fh.digest.bytes, body.data()+pos+i, sizeof(Digest));
+				hashes.push_back(fh);
+			}
+			pos+=len;
+		}
+	} catch(boost::bad_lexical_cast&) {
+		return false;
+	}
+	return true;
+}
+
+FullHashCache::FullHashCache(const FullHashOptions& o)
+	: opts(o), dirty(false), lastSave(std::time(0)), retryAfter(0), failed(0) {
+}
+
+std::size_t FullHashCache::size() const {
+	boost::mutex::scoped_lock lock(mutex);
+	return entries.size();
+}
+
+/**
+ * Results for prefix are taken from cache, or requested from server.  Lists, found by
+ * server, are ignored, if prefix wasn't found in them locally
+ */
+boost::uint32_t FullHashCache::confirm(const ListsData& ld, const Digest& d,
+									   boost::uint32_t candidates) {
+	boost::uint32_t prefix=d.prefix();
+	std::time_t now=std::time(0);
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		Entries::const_iterator it=entries.find(prefix);
+		if(it != entries.end() && it->second.expires > now)
+			return maskOf(ld, it->second, d) & candidates;
+		if(now < retryAfter) {
+			++failed;
+			return 0;
+		}
+	}
+
+	FullHashes hashes;
+	unsigned int lifetime=opts.ttl;
+	bool result=fetch(prefix, hashes, lifetime);
+	boost::uint32_t mask=0;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if(!result) {
+			++failed;
+			retryAfter=now + RetryDelay;
+			return 0;
+		}
+		insert(prefix, hashes, now + lifetime);
+		mask=maskOf(ld, entries[prefix], d) & candidates;
+	}
+	return mask;
+}
+
+/**
+ * Send prefix to server in "gethash" request: size of prefix & length of data, followed
+ * by raw prefix
+ */
+bool FullHashCache::fetch(boost::uint32_t prefix, FullHashes& hashes,
+						  unsigned int& lifetime) const {
+	std::string body="4:4\n";
+	for(int shift=24; shift >= 0; shift-=8)
+		body+=(char)((prefix >> shift) & 0xff);
+	std::ostringstream os;
+	os << "POST /safebrowsing/gethash?client=api&apikey=" << opts.key << " HTTP/1.0\r\n"
+	   << "Host: " << opts.server << "\r\n"
+	   << "Content-Length: " << body.size() << "\r\n"
+	   << "Connection: close\r\n\r\n" << body;
+
+	std::string resp;
+	HttpExchange ex(opts.timeout);
+	if(!ex.run(opts.server, opts.port, os.str(), resp)) {
+		if(runDebug)
+			std::cerr << "Error requesting full hashes from " << opts.server << std::endl;
+		return false;
+	}
+	int code;
+	std::string rbody;
+	if(!parseResponse(resp, code, rbody)) {
+		if(runDebug)
+			std::cerr << "Bad response to full hash request" << std::endl;
+		return false;
+	}
+	if(runDebug)
+		std::cerr << "Full hash request for " << std::hex << prefix << std::dec
+				  << ": " << code << std::endl;
+	// there are no full hashes for prefix
+	if(code == 204)
+		return true;
+	if(code != 200 || !parseFullHashes(rbody, hashes, lifetime))
+		return false;
+	return true;
+}
+
+void FullHashCache::insert(boost::uint32_t prefix, const FullHashes& hashes,
+						   std::time_t expires) {
+	if(entries.size() >= opts.maxEntries && entries.find(prefix) == entries.end()) {
+		std::time_t now=std::time(0);
+		for(Entries::iterator it=entries.begin(); it != entries.end(); ) {
+			if(it->second.expires <= now)
+				entries.erase(it++);
+			else
+				++it;
+		}
+		// prefixes are uniform, so neighbour of new prefix is random entry
+		if(!entries.empty() && entries.size() >= opts.maxEntries) {
+			Entries::iterator it=entries.lower_bound(prefix);
+			entries.erase(it == entries.end() ? entries.begin() : it);
+		}
+	}
+	Entry& e=entries[prefix];
+	e.expires=expires;
+	e.hashes.clear();
+	for(std::size_t i=0; i < hashes.size(); ++i) {
+		std::size_t bit=std::find(names.begin(), names.end(), hashes[i].list) - names.begin();
+		if(bit == names.size()) {
+			if(names.size() == MaxLists)
+				continue;
+			names.push_back(hashes[i].list);
+		}
+		std::size_t j=0;
+		while(j < e.hashes.size() && e.hashes[j].first != hashes[i].digest)
+			++j;
+		if(j == e.hashes.size())
+			e.hashes.push_back(std::make_pair(hashes[i].digest, 0u));
+		e.hashes[j].second|=(boost::uint32_t)1 << bit;
+	}
+	dirty=true;
+}
+
+boost::uint32_t FullHashCache::maskOf(const ListsData& ld, const Entry& e,
+									  const Digest& d) const {
+	boost::uint32_t mask=0;
+	for(std::size_t i=0; i < e.hashes.size(); ++i) {
+		if(e.hashes[i].first != d)
+			continue;
+		for(std::size_t b=0; b < names.size(); ++b) {
+			int bit=(e.hashes[i].second & ((boost::uint32_t)1 << b)) ? ld.bitOf(names[b]) : -1;
+			if(bit >= 0)
+				mask|=(boost::uint32_t)1 << bit;
+		}
+	}
+	return mask;
+}
+
+bool FullHashCache::load() {
+	if(opts.file.empty())
+		return true;
+	Entries le;
+	std::vector<std::string> lnames;
+	if(!read(le, lnames))
+		return false;
+	boost::mutex::scoped_lock lock(mutex);
+	names.swap(lnames);
+	entries.swap(le);
+	dirty=false;
+	return true;
+}
+
+bool FullHashCache::read(Entries& le, std::vector<std::string>& lnames) const {
+	std::ifstream ifs(pathString(opts.file).c_str(), std::ios::binary);
+	CacheFileHeader hdr;
+	if(!ifs || !readValue(ifs, hdr) ||
+	   std::memcmp(hdr.magic, sMagic, sizeof(sMagic)) != 0 || hdr.byteOrder != sByteOrder ||
+	   hdr.formatVersion != sFormatVersion || hdr.nameCount > MaxLists)
+		return false;
+
+	lnames.resize(hdr.nameCount);
+	for(std::size_t i=0; i < lnames.size(); ++i) {
+		boost::uint32_t len;
+		if(!readValue(ifs, len) || len > 256)
+			return false;
+		lnames[i].resize(len);
+		if(len && ifs.read(&lnames[i][0], len).fail())
+			return false;
+	}
+	std::time_t now=std::time(0);
+	for(boost::uint64_t i=0; i < hdr.count; ++i) {
+		CacheFileEntry fe;
+		if(!readValue(ifs, fe) || fe.count > 1024)
+			return false;
+		Entry e;
+		e.expires=fe.expires;
+		e.hashes.resize(fe.count);
+		for(std::size_t j=0; j < fe.count; ++j) {
+			if(!readValue(ifs, e.hashes[j].first) || !readValue(ifs, e.hashes[j].second))
+				return false;
+		}
+		if(e.expires > now && le.size() < opts.maxEntries)
+			le[fe.prefix]=e;
+	}
+	return true;
+}
+
+/**
+ * Entries from saved cache, that aren't known to this process, are added, if there is
+ * space for them.  Masks are translated to indexes of this process' names
+ */
+void FullHashCache::merge(Entries& es, std::vector<std::string>& ns, const Entries& le,
+						  const std::vector<std::string>& lnames) const {
+	std::vector<int> bits(lnames.size(), -1);
+	for(std::size_t i=0; i < lnames.size(); ++i) {
+		std::size_t bit=std::find(ns.begin(), ns.end(), lnames[i]) - ns.begin();
+		if(bit == ns.size()) {
+			if(ns.size() == MaxLists)
+				continue;
+			ns.push_back(lnames[i]);
+		}
+		bits[i]=bit;
+	}
+	for(Entries::const_iterator it=le.begin(); it != le.end(); ++it) {
+		if(es.size() >= opts.maxEntries)
+			break;
+		if(es.find(it->first) != es.end())
+			continue;
+		Entry& e=es[it->first];
+		e.expires=it->second.expires;
+		for(std::size_t j=0; j < it->second.hashes.size(); ++j) {
+			boost::uint32_t mask=0;
+			for(std::size_t b=0; b < bits.size(); ++b) {
+				if(bits[b] >= 0 && (it->second.hashes[j].second & ((boost::uint32_t)1 << b)))
+					mask|=(boost::uint32_t)1 << bits[b];
+			}
+			if(mask)
+				e.hashes.push_back(std::make_pair(it->second.hashes[j].first, mask));
+		}
+	}
+}
+
+/**
+ * Cache is copied under lock & written without it, so lookups don't wait for file
+ */
+bool FullHashCache::save(bool force) {
+	// all saves of process use the same temporary file
+	boost::mutex::scoped_lock saveLock(saveMutex);
+	Entries es;
+	std::vector<std::string> ns;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		std::time_t now=std::time(0);
+		if(!dirty || opts.file.empty() || (!force && now - lastSave < SaveInterval))
+			return true;
+		es=entries;
+		ns=names;
+		dirty=false;
+		lastSave=now;
+	}
+	bool result;
+	try {
+		result=write(es, ns);
+	} catch(std::exception& x) {
+		if(runDebug)
+			std::cerr << "Catch exception: " << x.what() << std::endl;
+		result=false;
+	}
+	if(!result) {
+		if(runDebug)
+			std::cerr << "Error writing " << opts.file << std::endl;
+		boost::mutex::scoped_lock lock(mutex);
+		dirty=true;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Cache is shared by all redirector's processes, so each of them writes its own
+ * temporary file & replaces cache by rename.  Entries, saved by other processes, are
+ * merged before writing, under lock of file, so they aren't lost
+ */
+bool FullHashCache::write(Entries& es, std::vector<std::string>& ns) const {
+	FileLock fileLock(pathString(opts.file) + ".lock");
+	Entries le;
+	std::vector<std::string> lnames;
+	if(read(le, lnames))
+		merge(es, ns, le, lnames);
+
+	fs::path tname=tempPath(opts.file);
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary | std::ios::trunc);
+		if(!ofs)
+			return false;
+		CacheFileHeader hdr;
+		std::memset(&hdr, 0, sizeof(hdr));
+		std::memcpy(hdr.magic, sMagic, sizeof(sMagic));
+		hdr.byteOrder=sByteOrder;
+		hdr.formatVersion=sFormatVersion;
+		hdr.nameCount=ns.size();
+		hdr.count=es.size();
+		writeValue(ofs, hdr);
+		for(std::size_t i=0; i < ns.size(); ++i) {
+			writeValue(ofs, (boost::uint32_t)ns[i].size());
+			ofs.write(ns[i].data(), ns[i].size());
+		}
+		for(Entries::const_iterator it=es.begin(); it != es.end(); ++it) {
+			CacheFileEntry fe;
+			fe.prefix=it->first;
+			fe.count=it->second.hashes.size();
+			fe.expires=it->second.expires;
+			writeValue(ofs, fe);
+			for(std::size_t j=0; j < it->second.hashes.size(); ++j) {
+				writeValue(ofs, it->second.hashes[j].first);
+				writeValue(ofs, it->second.hashes[j].second);
+			}
+		}
+		ofs.close();
+		if(!ofs) {
+			fs::remove(tname);
+			return false;
+		}
+	}
+	fs::rename(tname, opts.file);
+	return true;
+}
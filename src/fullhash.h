@@ -0,0 +1,127 @@
+/**
+ * @file   fullhash.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Confirmation of prefixes by full digests, requested from server & cached
+ *
+ * When index keeps only prefixes of digests, found prefixes are sent to server, that
+ * returns all full digests with these prefixes (like "gethash" request of Safe Browsing
+ * API v2).  Results, including absence of digests, are cached for time, given by server,
+ * & cache is saved to file, so it survives restarts of redirectors.
+ */
+
+#ifndef _FULLHASH_H
+#define _FULLHASH_H 1
+
+#include "lists.h"
+
+#include <map>
+#include <ctime>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Options of full hash requests, read from configuration file
+ */
+struct FullHashOptions {
+	/// host & port of Safe Browsing API
+	std::string server;
+	std::string port;
+	std::string key;
+	/// maximal duration of one request, in milliseconds.  Lookup waits for it
+	unsigned int timeout;
+	/// time of caching of results, if server doesn't give it, in seconds
+	unsigned int ttl;
+	/// maximal number of cached prefixes
+	std::size_t maxEntries;
+	/// file to keep cache between restarts, could be empty
+	fs::path file;
+
+	FullHashOptions() : server("sb.google.com"), port("http"), timeout(500), ttl(2700),
+						maxEntries(65536) { }
+} ;
+
+/**
+ * Full digest with name of list, that contains it
+ */
+struct FullHash {
+	std::string list;
+	Digest digest;
+} ;
+typedef std::vector<FullHash> FullHashes;
+
+/**
+ * Parse body of response to full hash request: optional line with lifetime of results
+ * in seconds, followed by blocks "LIST:CHUNK:LENGTH", each with LENGTH bytes of digests
+ *
+ * @param lifetime lifetime of results, isn't changed if response doesn't have it
+ *
+ * @return false if response has wrong format
+ */
+bool parseFullHashes(const std::string& body, FullHashes& hashes, unsigned int& lifetime);
+
+/**
+ * Cache of full digests for prefixes.  Missing & expired prefixes are requested from
+ * server synchronously, so lookup waits for response.  After error requests aren't sent
+ * for a minute, & prefixes without cached results are treated as misses.  Lookups only
+ * change cache in memory, it's saved by background thread
+ */
+class FullHashCache : public FullHashSource {
+public:
+	FullHashCache(const FullHashOptions& opts);
+
+	virtual boost::uint32_t confirm(const ListsData& ld, const Digest& d,
+									boost::uint32_t candidates);
+	virtual boost::uint32_t failures() const { return failed.load(); }
+	virtual void flush() { save(false); }
+
+	/// read saved cache, expired entries are skipped
+	bool load();
+	/**
+	 * Save cache, if it was changed, together with entries, saved by other processes.
+	 * Lookups aren't blocked while file is written
+	 *
+	 * @param force save now, otherwise only if previous save was SaveInterval seconds ago
+	 */
+	bool save(bool force=true);
+
+	/// number of cached prefixes
+	std::size_t size() const;
+
+private:
+	enum {
+		/// delay of requests after error, in seconds
+		RetryDelay=60,
+		/// minimal time between saves of changed cache
+		SaveInterval=60
+	};
+
+	struct Entry {
+		std::time_t expires;
+		/// digests with masks of lists, bits are indexes in names
+		std::vector<std::pair<Digest, boost::uint32_t> > hashes;
+	} ;
+	typedef std::map<boost::uint32_t, Entry> Entries;
+
+	bool fetch(boost::uint32_t prefix, FullHashes& hashes, unsigned int& lifetime) const;
+	void insert(boost::uint32_t prefix, const FullHashes& hashes, std::time_t expires);
+	boost::uint32_t maskOf(const ListsData& ld, const Entry& e, const Digest& d) const;
+	bool read(Entries& le, std::vector<std::string>& lnames) const;
+	void merge(Entries& es, std::vector<std::string>& ns, const Entries& le,
+			   const std::vector<std::string>& lnames) const;
+	bool write(Entries& es, std::vector<std::string>& ns) const;
+
+	FullHashOptions opts;
+	/// names of lists, found in responses
+	std::vector<std::string> names;
+	Entries entries;
+	bool dirty;
+	std::time_t lastSave;
+	std::time_t retryAfter;
+	boost::atomic<boost::uint32_t> failed;
+	mutable boost::mutex mutex;
+	/// serializes writing of file
+	boost::mutex saveMutex;
+} ;
+
+#endif /* _FULLHASH_H */
@@ -0,0 +1,460 @@
+/**
+ * @file   gsb-bench.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Microbenchmarks of stages of URL's lookup
+ *
+ * Each benchmark is run several times for fixed time, & the best time per operation is
+ * reported, as it's the least affected by other load.  Results are written as lines
+ * "name ns-per-op", & could be compared with baseline in the same format: benchmark,
+ * that is slower than baseline by more than tolerance, fails the run.
+ */
+
+#include "lists.h"
+#include "listfile.h"
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <boost/chrono.hpp>
+#include <boost/random/mersenne_twister.hpp>
+
+bool runDebug;
+
+namespace {
+
+typedef boost::chrono::high_resolution_clock Clock;
+typedef std::map<std::string, double> BenchResults;
+
+/// prevents optimizing out of results
+volatile std::size_t sink;
+
+const char* sUrls[]={
+	"http://www.google.com/",
+	"http://evil.example.com/malware/download.exe",
+	"http://a.b.c.d.e.f.g/1/2/3/4/5.html?param=1",
+	"http://news.bbc.co.uk/2/hi/technology/default.stm",
+	"http://www.example.org/images/logo.png",
+	"http://search.example.com/search?q=squid+redirector&hl=en",
+	"http://192.168.1.1/admin/",
+	"http://cdn.static.example.net/js/lib/jquery.min.js?v=1.4.2",
+};
+const std::size_t sUrlCount=sizeof(sUrls)/sizeof(sUrls[0]);
+
+/**
+ * Operation, that is measured.  run performs n operations
+ */
+struct Bench {
+	virtual ~Bench() { }
+	virtual void run(std::size_t n)=0;
+} ;
+
+/**
+ * Run benchmark for at least minTime seconds, several times
+ *
+ * @return the best time of one operation in nanoseconds
+ */
+double measure(Bench& b, double minTime, unsigned int repeats) {
+	std::size_t n=1;
+	double best=0;
+	// find number of operations, that takes minTime
+	while(true) {
+		Clock::time_point t=Clock::now();
+		b.run(n);
+		double s=boost::chrono::duration<double>(Clock::now() - t).count();
+		if(s >= minTime) {
+			best=s*1e9/n;
+			break;
+		}
+		n=s > 0 ? std::max(n*2, (std::size_t)(n*minTime*1.2/s)) : n*100;
+	}
+	for(unsigned int i=1; i < repeats; ++i) {
+		Clock::time_point t=Clock::now();
+		b.run(n);
+		best=std::min(best, boost::chrono::duration<double>(Clock::now() - t).count()*1e9/n);
+	}
+	return best;
+}
+
+struct UrlHostBench : Bench {
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i)
+			s+=urlHost(StringPiece(sUrls[i % sUrlCount], std::strlen(sUrls[i % sUrlCount]))).size;
+		sink=s;
+	}
+} ;
+
+struct VariantsBench : Bench {
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			generateVariants(StringPiece(sUrls[i % sUrlCount], std::strlen(sUrls[i % sUrlCount])),
+							 uv);
+			s+=uv.count;
+		}
+		sink=s;
+	}
+
+	UrlVariants uv;
+} ;
+
+struct HostVariantsBench : Bench {
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			StringPiece url(sUrls[i % sUrlCount], std::strlen(sUrls[i % sUrlCount]));
+			s+=generateHostVariants(urlHost(url), hv);
+		}
+		sink=s;
+	}
+
+	StringPiece hv[UrlVariants::MaxHosts];
+} ;
+
+struct PathVariantsBench : Bench {
+	PathVariantsBench() {
+		for(std::size_t i=0; i < sUrlCount; ++i) {
+			StringPiece url(sUrls[i], std::strlen(sUrls[i]));
+			StringPiece host=urlHost(url);
+			StringPiece path(host.end(), url.end()-host.end());
+			const char* q=static_cast<const char*>(std::memchr(path.data, '?', path.size));
+			StringPiece query;
+			if(q != 0) {
+				query=StringPiece(q, path.end()-q);
+				path.size=q-path.data;
+			}
+			paths.push_back(path);
+			queries.push_back(query);
+		}
+	}
+
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i)
+			s+=generatePathVariants(paths[i % sUrlCount], queries[i % sUrlCount], pv);
+		sink=s;
+	}
+
+	std::vector<StringPiece> paths;
+	std::vector<StringPiece> queries;
+	StringPiece pv[UrlVariants::MaxPaths];
+} ;
+
+/**
+ * MD5 of all variants of one URL
+ */
+struct HashBench : Bench {
+	HashBench() {
+		for(std::size_t i=0; i < sUrlCount; ++i)
+			generateVariants(StringPiece(sUrls[i], std::strlen(sUrls[i])), uvs[i]);
+	}
+
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			UrlVariants& uv=uvs[i % sUrlCount];
+			hashVariants(uv);
+			s+=uv.digests[0].bytes[0];
+		}
+		sink=s;
+	}
+
+	UrlVariants uvs[sUrlCount];
+} ;
+
+struct HexBench : Bench {
+	HexBench() {
+		std::memset(d.bytes, 0xa5, sizeof(d.bytes));
+	}
+
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			d.bytes[0]=i;
+			s+=formatHexDigest(d)[1];
+		}
+		sink=s;
+	}
+
+	Digest d;
+} ;
+
+/**
+ * Check of digests against combined index.  One of 16 checked digests is in index, as
+ * most of URLs aren't in lists
+ */
+struct CheckBench : Bench {
+	CheckBench(std::size_t entries, boost::uint32_t compress) {
+		boost::mt19937 rng(entries);
+		DigestVector ds(entries);
+		for(std::size_t i=0; i < entries; ++i)
+			randomDigest(rng, ds[i]);
+		probes.resize(65536);
+		for(std::size_t i=0; i < probes.size(); ++i) {
+			if(i % 16 == 0)
+				probes[i]=ds[rng() % entries];
+			else
+				randomDigest(rng, probes[i]);
+		}
+		std::sort(ds.begin(), ds.end());
+		ds.erase(std::unique(ds.begin(), ds.end()), ds.end());
+		HashData h;
+		h.name="goog-black-hash";
+		h.minorVersion=1;
+		h.hashes.assign(ds);
+		std::vector<const HashData*> hp(1, &h);
+		combineLists(hp, ld, compress);
+		uv.count=1;
+	}
+
+	static void randomDigest(boost::mt19937& rng, Digest& d) {
+		for(std::size_t j=0; j < sizeof(d.bytes); j+=4) {
+			boost::uint32_t r=rng();
+			std::memcpy(d.bytes+j, &r, 4);
+		}
+	}
+
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			uv.digests[0]=probes[i % probes.size()];
+			s+=ld.check(uv);
+		}
+		sink=s;
+	}
+
+	ListsData ld;
+	DigestVector probes;
+	UrlVariants uv;
+} ;
+
+/**
+ * Load of data file of list, in binary format or as Boost text archive of older versions.
+ * One operation is load of whole file
+ */
+struct ListLoadBench : Bench {
+	ListLoadBench(const fs::path& f) : fname(f) { }
+
+	void run(std::size_t n) {
+		std::size_t s=0;
+		for(std::size_t i=0; i < n; ++i) {
+			HashData h;
+			if(!loadListFile(fname, h))
+				throw std::runtime_error("can't read " + pathString(fname));
+			s+=h.hashes.size();
+		}
+		sink=s;
+	}
+
+	fs::path fname;
+} ;
+
+/**
+ * Write list with given number of random digests in both formats
+ */
+void writeLists(std::size_t entries, const fs::path& binary, const fs::path& text) {
+	boost::mt19937 rng(entries);
+	DigestVector ds(entries);
+	for(std::size_t i=0; i < entries; ++i)
+		CheckBench::randomDigest(rng, ds[i]);
+	std::sort(ds.begin(), ds.end());
+	ds.erase(std::unique(ds.begin(), ds.end()), ds.end());
+	HashData h;
+	h.name="goog-black-hash";
+	h.majorVersion=1;
+	h.minorVersion=1;
+	h.hashes.assign(ds);
+	if(!writeListFile(binary, h))
+		throw std::runtime_error("can't write " + pathString(binary));
+	std::ofstream ofs(pathString(text).c_str(), std::ios::binary);
+	{
+		boost::archive::text_oarchive oa(ofs);
+		oa << h;
+	}
+	ofs.close();
+	if(!ofs)
+		throw std::runtime_error("can't write " + pathString(text));
+}
+
+/**
+ * Runs benchmarks & compares them with baseline.  Slow benchmark is measured again, so
+ * short spike of other load isn't reported as regression
+ */
+struct BenchRunner {
+	enum {
+		/// number of measurements before regression is reported
+		Attempts=3
+	};
+
+	BenchRunner(const BenchResults& b, double t, double m, unsigned int r)
+		: base(b), tolerance(t), minTime(m), repeats(r), failed(false) { }
+
+	void run(const std::string& name, Bench& b) {
+		BenchResults::const_iterator it=base.find(name);
+		double value=measure(b, minTime, repeats);
+		for(unsigned int i=1; i < Attempts && it != base.end() && slower(value, it->second); ++i)
+			value=std::min(value, measure(b, minTime, repeats));
+		results.push_back(std::make_pair(name, value));
+
+		std::cout << std::left << std::setw(24) << name << std::right << std::setprecision(2)
+				  << std::setw(12) << value;
+		if(it != base.end() && it->second > 0) {
+			std::cout << std::setw(12) << it->second << std::setprecision(1) << std::setw(9)
+					  << (value/it->second - 1)*100 << "%";
+			if(slower(value, it->second)) {
+				std::cout << " REGRESSION";
+				failed=true;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	bool slower(double value, double baseline) const {
+		return baseline > 0 && (value/baseline - 1)*100 > tolerance;
+	}
+
+	const BenchResults& base;
+	double tolerance;
+	double minTime;
+	unsigned int repeats;
+	std::vector<std::pair<std::string, double> > results;
+	bool failed;
+} ;
+
+bool readResults(const std::string& fname, BenchResults& results) {
+	std::ifstream ifs(fname.c_str());
+	if(!ifs)
+		return false;
+	std::string line, name;
+	while(std::getline(ifs, line)) {
+		if(line.empty() || line[0] == '#')
+			continue;
+		std::istringstream is(line);
+		double value;
+		if(!(is >> name >> value))
+			return false;
+		results[name]=value;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::string baseline, output;
+	double tolerance, minTime;
+	unsigned int repeats;
+	std::size_t maxEntries, listEntries;
+	po::options_description command("Usage: gsb_bench [options]\nOptions");
+	command.add_options()
+		("baseline,b", po::value<std::string>(&baseline),
+		 "compare results with baseline, fail if some benchmark is slower")
+		("output,o", po::value<std::string>(&output), "write results to file")
+		("tolerance,t", po::value<double>(&tolerance)->default_value(30),
+		 "allowed slowdown relative to baseline, in percents")
+		("time", po::value<double>(&minTime)->default_value(0.05),
+		 "minimal duration of one run of benchmark, in seconds")
+		("repeats", po::value<unsigned int>(&repeats)->default_value(5),
+		 "number of runs of each benchmark")
+		("max-entries", po::value<std::size_t>(&maxEntries)->default_value(10000000),
+		 "maximal size of index for check benchmarks")
+		("list-entries", po::value<std::size_t>(&listEntries)->default_value(2000000),
+		 "number of digests in list for load benchmarks, 0 disables them")
+		("help,h", "Print help message and exit");
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(command).run(), vm);
+		po::notify(vm);
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		return 1;
+	}
+	if(vm.count("help")) {
+		std::cerr << command << std::endl;
+		return 0;
+	}
+
+	BenchResults base;
+	if(!baseline.empty() && !readResults(baseline, base)) {
+		std::cerr << "Can't read baseline " << baseline << std::endl;
+		return 1;
+	}
+
+	BenchRunner runner(base, tolerance, minTime, repeats);
+	std::cout << std::left << std::setw(24) << "# benchmark" << std::right << std::setw(12)
+			  << "ns/op" << std::setw(12) << "baseline" << std::setw(10) << "change" << std::endl;
+	std::cout << std::fixed;
+	{
+		UrlHostBench b;
+		runner.run("url_host", b);
+	}
+	{
+		HostVariantsBench b;
+		runner.run("host_variants", b);
+	}
+	{
+		PathVariantsBench b;
+		runner.run("path_variants", b);
+	}
+	{
+		VariantsBench b;
+		runner.run("generate_variants", b);
+	}
+	{
+		HashBench b;
+		runner.run("md5_url_variants", b);
+	}
+	{
+		HexBench b;
+		runner.run("format_hex_digest", b);
+	}
+	for(std::size_t n=10000; n <= maxEntries; n*=10) {
+		std::string size=boost::lexical_cast<std::string>(n);
+		{
+			CheckBench b(n, 0);
+			runner.run("check_" + size, b);
+		}
+		{
+			CheckBench b(n, 1);
+			runner.run("check_rice_" + size, b);
+		}
+	}
+	if(listEntries) {
+		std::string size=boost::lexical_cast<std::string>(listEntries);
+		fs::path dir=fs::temp_directory_path() / fs::unique_path("gsb-bench-%%%%-%%%%");
+		try {
+			fs::create_directories(dir);
+			writeLists(listEntries, dir / "list.dat", dir / "list.txt");
+			{
+				ListLoadBench b(dir / "list.dat");
+				runner.run("load_list_" + size, b);
+			}
+			{
+				ListLoadBench b(dir / "list.txt");
+				runner.run("load_list_text_" + size, b);
+			}
+			fs::remove_all(dir);
+		} catch(std::exception& x) {
+			std::cerr << x.what() << std::endl;
+			fs::remove_all(dir);
+			return 1;
+		}
+	}
+	const std::vector<std::pair<std::string, double> >& results=runner.results;
+
+	if(!output.empty()) {
+		std::ofstream ofs(output.c_str());
+		ofs << "# gsb_bench results: benchmark, nanoseconds per operation" << std::endl;
+		ofs << std::fixed << std::setprecision(2);
+		for(std::size_t i=0; i < results.size(); ++i)
+			ofs << results[i].first << " " << results[i].second << std::endl;
+		ofs.close();
+		if(!ofs) {
+			std::cerr << "Can't write " << output << std::endl;
+			return 1;
+		}
+	}
+	return runner.failed ? 1 : 0;
+}
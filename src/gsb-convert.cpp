@@ -0,0 +1,75 @@
+/**
+ * @file   gsb-convert.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Conversion of data files of lists between text & binary formats
+ *
+ *
+ */
+
+#include "listfile.h"
+#include <iostream>
+
+bool runDebug;
+
+int main(int argc, char** argv) {
+	std::string input, output;
+	po::options_description command("Usage: gsb_convert [options] input [output]\nOptions");
+	command.add_options()
+		("text,t", "write Boost text archive, used by older versions")
+		("debug,d", "print debug information")
+		("help,h", "Print help message and exit");
+	po::options_description hidden;
+	hidden.add_options()
+		("input", po::value<std::string>(&input))
+		("output", po::value<std::string>(&output));
+	po::options_description all;
+	all.add(command).add(hidden);
+	po::positional_options_description pos;
+	pos.add("input", 1).add("output", 1);
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(all).positional(pos).run(), vm);
+		po::notify(vm);
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		return 1;
+	}
+	if(vm.count("help") || input.empty()) {
+		std::cerr << command << std::endl;
+		return vm.count("help") ? 0 : 1;
+	}
+	runDebug=vm.count("debug") != 0;
+	// file is converted in place, if output isn't specified
+	if(output.empty())
+		output=input;
+
+	HashData h;
+	if(!loadListFile(input, h)) {
+		std::cerr << "Can't read " << input << std::endl;
+		return 1;
+	}
+	bool result;
+	if(vm.count("text")) {
+		fs::path tname=tempPath(output);
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary);
+		{
+			boost::archive::text_oarchive oa(ofs);
+			oa << h;
+		}
+		ofs.close();
+		result=ofs;
+		if(result)
+			fs::rename(tname, output);
+	} else {
+		result=writeListFile(output, h);
+	}
+	if(!result) {
+		std::cerr << "Can't write " << output << std::endl;
+		return 1;
+	}
+	std::cerr << h.name << " " << h.majorVersion << "." << h.minorVersion << ": "
+			  << h.hashes.size() << " hashes written to " << output << std::endl;
+	return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * @file   gsb-corpus.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Generation of synthetic lists & URL streams
+ *
+ *
+ */
+
+#include "corpus.h"
+#include "listfile.h"
+#include "snapshot.h"
+
+#include <iostream>
+
+bool runDebug;
+
+namespace {
+
+/**
+ * Write URLs as plain list, as request lines of redirector or as Squid's access log in
+ * native format
+ */
+bool writeUrls(std::ostream& os, const std::vector<std::string>& urls, const std::string& format) {
+	for(std::size_t i=0; i < urls.size(); ++i) {
+		if(format == "plain") {
+			os << urls[i] << "\n";
+		} else if(format == "helper") {
+			os << urls[i] << " 10.0.0." << (i % 250 + 1) << "/- - GET\n";
+		} else {
+			os << 1300000000 + i/100 << "." << (i % 100)*10 << " " << (i*7) % 500 << " 10.0.0."
+			   << (i % 250 + 1) << " TCP_MISS/200 " << 500 + (i*31) % 20000 << " GET "
+			   << urls[i] << " - DIRECT/192.0.2.1 text/html\n";
+		}
+	}
+	os.flush();
+	return os;
+}
+
+}
+
+int main(int argc, char** argv) {
+	CorpusOptions opts;
+	std::string listsDir, snapshot, output, format;
+	std::vector<std::string> names;
+	po::options_description command("Usage: gsb_corpus [options]\nOptions");
+	command.add_options()
+		("hashes,n", po::value<std::size_t>(&opts.hashes)->default_value(opts.hashes),
+		 "number of random hashes in all lists")
+		("urls,u", po::value<std::size_t>(&opts.urls)->default_value(opts.urls),
+		 "number of URLs")
+		("hosts", po::value<std::size_t>(&opts.hosts)->default_value(opts.hosts),
+		 "number of distinct hosts")
+		("zipf", po::value<double>(&opts.zipf)->default_value(opts.zipf),
+		 "exponent of Zipf distribution of hosts' popularity")
+		("hit-ratio", po::value<double>(&opts.hitRatio)->default_value(opts.hitRatio),
+		 "share of URLs, that are found in lists")
+		("max-depth", po::value<unsigned int>(&opts.maxDepth)->default_value(opts.maxDepth),
+		 "maximal number of directories in path")
+		("query-ratio", po::value<double>(&opts.queryRatio)->default_value(opts.queryRatio),
+		 "share of URLs with query")
+		("seed", po::value<boost::uint32_t>(&opts.seed)->default_value(opts.seed),
+		 "seed of random generator")
+		("list,l", po::value<std::vector<std::string> >(&names),
+		 "name of list, could be repeated; goog-black-hash & goog-malware-hash by default")
+		("lists-dir,d", po::value<std::string>(&listsDir),
+		 "write data file of each list into directory, as NAME.dat")
+		("text,t", "write data files as Boost text archive, used by older versions")
+		("snapshot,s", po::value<std::string>(&snapshot), "write snapshot of all lists")
+		("output,o", po::value<std::string>(&output),
+		 "write URLs to file, \"-\" for standard output")
+		("format,f", po::value<std::string>(&format)->default_value("helper"),
+		 "format of URLs: plain, helper (request lines of redirector) or access-log")
+		("help,h", "Print help message and exit");
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(command).run(), vm);
+		po::notify(vm);
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		return 1;
+	}
+	if(vm.count("help") || (format != "plain" && format != "helper" && format != "access-log") ||
+	   (listsDir.empty() && snapshot.empty() && output.empty())) {
+		std::cerr << command << std::endl;
+		return vm.count("help") ? 0 : 1;
+	}
+	if(!names.empty())
+		opts.lists=names;
+	if(opts.lists.size() > MaxLists) {
+		std::cerr << "Too many lists, only " << MaxLists << " are supported" << std::endl;
+		return 1;
+	}
+
+	Corpus c;
+	CorpusGenerator gen(opts);
+	gen.generate(c);
+	std::vector<HashData> hs;
+	c.makeLists(hs);
+
+	try {
+		if(!listsDir.empty()) {
+			fs::create_directories(listsDir);
+			for(std::size_t i=0; i < hs.size(); ++i) {
+				fs::path fname=fs::path(listsDir) / (hs[i].name + ".dat");
+				bool result;
+				if(vm.count("text")) {
+					std::ofstream ofs(pathString(fname).c_str(), std::ios::binary);
+					{
+						boost::archive::text_oarchive oa(ofs);
+						oa << hs[i];
+					}
+					ofs.close();
+					result=ofs;
+				} else {
+					result=writeListFile(fname, hs[i]);
+				}
+				if(!result)
+					throw std::runtime_error("can't write " + pathString(fname));
+			}
+		}
+		if(!snapshot.empty()) {
+			std::vector<const HashData*> hp;
+			for(std::size_t i=0; i < hs.size(); ++i)
+				hp.push_back(&hs[i]);
+			ListsData ld;
+			combineLists(hp, ld);
+			ld.generation=1;
+			if(!writeSnapshot(snapshot, ld))
+				throw std::runtime_error("can't write " + snapshot);
+		}
+		if(output == "-") {
+			if(!writeUrls(std::cout, c.urls, format))
+				throw std::runtime_error("can't write URLs");
+		} else if(!output.empty()) {
+			std::ofstream ofs(output.c_str());
+			if(!writeUrls(ofs, c.urls, format))
+				throw std::runtime_error("can't write " + output);
+		}
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		return 1;
+	}
+
+	std::cerr << c.urls.size() << " URLs, " << c.planted << " planted into lists";
+	for(std::size_t i=0; i < hs.size(); ++i)
+		std::cerr << ", " << hs[i].name << ": " << hs[i].hashes.size() << " hashes";
+	std::cerr << std::endl;
+	return 0;
+}
@@ -9,288 +9,151 @@
 
 #include "common.h"
 #include <iostream>
-#include <boost/md5.hpp>
-
-#include<boost/tokenizer.hpp>
-typedef boost::tokenizer<boost::char_separator<char> > tokenizer;
+#include <stdexcept>
+#include <unistd.h>
+#include "redirector.h"
+#include "fullhash.h"
 
 bool runDebug;
 
-static const std::string sEmptyString("");
-
-struct HashFile {
-	HashData h;
-	fs::path fname;
-	std::string url;
-	std::time_t wtime;
-
-	/**
-	 * Update file with hash, using last update time of file
-	 *
-	 */
-	void updateHash() {
-		std::time_t nt;
-		if(fs::exists(fname)) {
-			if(wtime < (nt=last_write_time(fname))) {
-				if(runDebug) {
-#if defined(BOOST_FILESYSTEM_VERSION) && (BOOST_FILESYSTEM_VERSION == 3)
-					std::cerr << "Going to read " << fname.string() << std::endl;
-#else
-					std::cerr << "Going to read " << fname.file_string() << std::endl;
-#endif
-				}
-
-#if defined(BOOST_FILESYSTEM_VERSION) && (BOOST_FILESYSTEM_VERSION == 3)
-				std::ifstream ifs(fname.string().c_str(), std::ios::binary);
-#else
-				std::ifstream ifs(fname.file_string().c_str(), std::ios::binary);
-#endif
-				if(!ifs) {
-					if(runDebug)
-						std::cerr << "Error opening " << fname << std::endl;
-
-					return;
-				}
-				boost::archive::text_iarchive ia(ifs);
-				ia >> h;
-				wtime=nt;
-			}
-		} else {
-			if(runDebug)
-				std::cerr << fname <<  " doesn't exists" << std::endl;
-
-		}
-	}
-
-	HashFile(): fname(""), url(""), wtime(0) { }
-
-	/**
-	 * Check is url in hash?
-	 *
-	 * @param sv list of generated url's
-	 * @param u new url, that will updated if match found
-	 *
-	 * @return if one of url's found in hash
-	 */
-	bool checkHash(StringVector& sv, std::string& u) {
-		if(h.minorVersion == -1)
-			return false;
-
-		StringVector::iterator it=sv.begin();
-		StringVector::iterator itEnd=sv.end();
-		HashData::HashSet::iterator hi;
-		for(; it != itEnd; ++it) {
-			if ((hi=h.hashes.find(*it)) != h.hashes.end()) {
-				if(runDebug)
-					std::cerr << "Match is found in " << h.name
-							  << ": " << *it << std::endl;
-
-				u=url;
-				return true;
-			}
-		}
-		return false;
-	}
-
-} ;
-
-/**
- *
- *
- * @param host
- * @param hv
- */
-void generateHostVariants(const std::string& host, StringVector& hv) {
-	StringVector tsl;
-	boost::char_separator<char> hostsep(".");
-	tokenizer hosttokens(host, hostsep);
-	for (tokenizer::iterator tok_iter = hosttokens.begin();
-		 tok_iter != hosttokens.end(); ++tok_iter) {
-		tsl.push_front(*tok_iter);
-	}
-	if(tsl.size() > 1) {
-		std::string t=tsl[0];
-		unsigned int count=0;
-		tsl.pop_front();
-		for(StringVector::iterator ti=tsl.begin();
-			ti != tsl.end() && count < 4 ; ++ti, ++count  ) {
-			t=*ti+"."+t;
-			if(t != host)
-				hv.push_back(t);
-		}
-	}
-}
-
-/**
- *
- *
- * @param path
- * @param pv
- */
-void generatePathVariants(const std::string& path, StringVector& pv) {
-	StringVector tsl;
-	boost::split( tsl, path, boost::is_any_of("/"), boost::token_compress_on );
-	unsigned int maxcount=tsl.size()-1;
-	if(maxcount >= 0) {
-		std::string t="/";
-		unsigned int count=0;
-		for(StringVector::iterator ti=tsl.begin();
-			ti != tsl.end() && count < 4 ; ++ti, ++count  ) {
-			t+=*ti;
-			if(count != maxcount)
-				t+="/";
- 			if(t != path)
- 				pv.push_back(t);
-		}
-	}
-}
-
-/**
- * Generate list of MD5 hashes
- *
- * TODO: use url parser from cpp-netlib?
- *
- * @param url
- * @param sv
- *
- * @return true, if success, false - if no variants generated
- */
-bool generateVariants(const std::string& url, StringVector& sv) {
-	sv.clear();
-	StringVector tv, hv, pv;
-
-	std::string t, tm, host, path(""),query("");
- 	std::string::size_type idx;
-	if(!boost::istarts_with(url,"http://")){
-		if(runDebug)
-			std::cerr << "Not http protocol: " << url << std::endl;
-
-		return false;
-	}
-	t=url.substr(7);
-	if ((idx=t.find('/')) == std::string::npos) {
-		host=t;
-	} else {
-		host=t.substr(0,idx);
-		path=t.substr(idx);
-		if((idx=path.find('?')) != std::string::npos) {
-			query=path.substr(idx);
-			path=path.substr(0,idx);
-		}
-		pv.push_back(path);
-	}
-	hv.push_back(host);
-	// generate additional variants for host & pathes
-	generateHostVariants(host,hv);
-	generatePathVariants(path,pv);
-
-	for(StringVector::iterator hi=hv.begin(); hi != hv.end(); ++hi) {
-		tv.push_back(*hi+"/");
-		if(pv.size()>0 && query != "")
-			tv.push_back(*hi+pv[0]+query);
-		for(StringVector::iterator pi=pv.begin(); pi != pv.end(); ++pi) {
-			tv.push_back(*hi+*pi);
-		}
-	}
-
-	StringVector::iterator it=tv.begin();
-	StringVector::iterator itEnd=tv.end();
-	for(; it != itEnd; ++it) {
-		boost::md5 m(it->begin(),it->end());
-		tm=boost::lexical_cast<std::string>(m);
-		sv.push_back(tm);
-		if(runDebug)
-			std::cerr << "hash for " << *it << " = " << tm  << std::endl;
-
-	}
-
-	return sv.size() > 0;
-}
-
-inline std::string produceResult(bool emitEmpty,
-								 const std::string& inputStr,
-								 const std::string& newURL,
-								 const StringVector& sv) 
-{
-	if(newURL.empty()) {
-		if(emitEmpty)
-			return sEmptyString;
-		else
-			return inputStr;
-	}
-	if(sv.size() == 1)
-		return newURL;
-	std::string tmp(newURL);
-	for (StringVector::const_iterator it=sv.begin()+1; it != sv.end(); ++it) {
-		tmp += ' ';
-		tmp += *it;
-	}
-	return tmp;
-}
-
 int main(int argc, char** argv) {
 	//read settings
 	po::variables_map cfg;
-	if(!parseOptions(argc,argv,cfg))
+	ListConfigs lists;
+	if(!parseOptions(argc,argv,cfg,lists))
 		return 1;
 
-	HashFile bh;
-	HashFile mh;
-	bool emitEmptyString=false;
+	HashFile hashes;
+	Redirector r;
+	unsigned int reloadInterval=60;
+	unsigned int threads=1;
+	std::size_t cacheSize=0;
+	std::size_t hostCacheSize=0;
+	FullHashOptions fhOpts;
+	std::string statsFile;
+	unsigned int statsInterval=0;
 	try {
 		runDebug=cfg["debug"].as<bool>();
-		emitEmptyString=cfg["emit-empty"].as<bool>();
-		bh.fname=cfg["black-hash-file"].as<std::string>();
-		bh.url=cfg["black-url"].as<std::string>();
-		mh.fname=cfg["malware-hash-file"].as<std::string>();
-		mh.url=cfg["malware-url"].as<std::string>();
+		r.emitEmpty=cfg["emit-empty"].as<bool>();
+		r.okErr=cfg["ok-err-replies"].as<bool>();
+		std::string mode=cfg["lookup-mode"].as<std::string>();
+		if(mode != "staged" && mode != "full")
+			throw std::runtime_error("unknown lookup mode " + mode);
+		r.staged=mode == "staged";
+		r.concurrency=cfg["concurrency"].as<bool>();
+		threads=cfg["threads"].as<unsigned int>();
+		hashes.fname=cfg["lists-snapshot"].as<std::string>();
+		for(ListConfigs::const_iterator it=lists.begin(); it != lists.end(); ++it) {
+			if(it->url.empty())
+				throw std::runtime_error("no URL for list " + it->name);
+		}
+		reloadInterval=cfg["reload-interval"].as<unsigned int>();
+		cacheSize=cfg["cache-size"].as<unsigned int>();
+		hostCacheSize=cfg["host-cache-size"].as<unsigned int>();
+		std::string storage=cfg["hash-storage"].as<std::string>();
+		if(storage != "full" && storage != "prefix")
+			throw std::runtime_error("unknown hash storage " + storage);
+		hashes.prefixOnly=storage == "prefix";
+		// full hashes are requested from the same server, as updates
+		std::string server=cfg["update-server"].as<std::string>();
+		std::string::size_type colon=server.rfind(':');
+		fhOpts.server=server.substr(0,colon);
+		if(colon != std::string::npos)
+			fhOpts.port=server.substr(colon+1);
+		if(cfg.count("key"))
+			fhOpts.key=cfg["key"].as<std::string>();
+		fhOpts.file=cfg["fullhash-cache-file"].as<std::string>();
+		fhOpts.maxEntries=cfg["fullhash-cache-size"].as<unsigned int>();
+		fhOpts.ttl=cfg["fullhash-ttl"].as<unsigned int>();
+		fhOpts.timeout=cfg["fullhash-timeout"].as<unsigned int>();
+		// each helper process writes its own file
+		statsFile=cfg["stats-file"].as<std::string>();
+		if(!statsFile.empty())
+			statsFile+="." + boost::lexical_cast<std::string>(::getpid());
+		statsInterval=cfg["stats-interval"].as<unsigned int>();
 	} catch (...) {
 		std::cerr << "Please check configuration file!" << std::endl;
 		return 1;
 	}
+	hashes.lists=lists;
+	r.lists=lists;
+
+	// hashes are loaded here & then reloaded in background, when updater publishes them
+	HashWatcher watcher(reloadInterval);
+	watcher.add(&hashes);
+	watcher.start();
+
+	r.hashes=&hashes;
+	boost::shared_ptr<VerdictCache> urlCache, hostCache;
+	if(cacheSize) {
+		urlCache.reset(new VerdictCache(cacheSize));
+		r.urlCache=urlCache.get();
+	}
+	if(hostCacheSize) {
+		hostCache.reset(new VerdictCache(hostCacheSize));
+		r.hostCache=hostCache.get();
+	}
+	// prefixes, found in hashes, are confirmed by full hashes from server.  Snapshot could
+	// keep prefixes, even if data files are read as full hashes
+	FullHashCache fullHashes(fhOpts);
+	if(!fullHashes.load() && hashes.prefixOnly && runDebug)
+		std::cerr << "Can't read cache of full hashes " << fhOpts.file << std::endl;
+	r.fullHashes=&fullHashes;
+	// statistics is always gathered, & is written on SIGUSR1 or every stats-interval seconds
+	RedirectorStats stats;
+	r.stats=&stats;
+	StatsReporter reporter(r, statsFile, statsInterval);
+	reporter.start();
+	// replies are gathered & written when there is no more input, so reading & writing
+	// don't require system call per line under load
+	std::ios::sync_with_stdio(false);
+	LineReader in(0);
+	ReplyWriter out(std::cout);
+
+	// with channel-ID protocol lines could be processed concurrently, as replies could be
+	// written out of order
+	boost::shared_ptr<WorkerPool> pool;
+	if(r.concurrency && threads > 1)
+		pool.reset(new WorkerPool(r, threads, out));
+
+	std::string line, reply;
+	UrlVariants uv;
+	StringPiece input;
+	ThreadStats* ts=stats.addThread();
 
-	std::string url, input;
-	StringVector sv;
-	const int MaxCount=10;
-	int count=MaxCount;
-
-	StringVector tsl;
 	while(true) {
-		std::getline(std::cin, input);
-		if (std::cin.eof()) {
+		if(!pool && !in.buffered())
+			out.flush();
+		if(!in.next(input)) {
 			if(runDebug)
 				std::cerr << "got EOF from std::cin" << std::endl;
 		    break;
 		}
-		boost::trim(input);
+		input=trimPiece(input);
 		if(runDebug)
 			std::cerr << "got " << input << " from std::cin" << std::endl;
 
-		if(count >= MaxCount) {
-			mh.updateHash();
-			bh.updateHash();
-		}
-		if(bh.h.minorVersion == -1 && mh.h.minorVersion == -1) {
-			std::cout << produceResult(emitEmptyString, input, sEmptyString, tsl) << std::endl;
-			continue;
-		}
-
-		boost::split( tsl, input, boost::is_any_of(" \t"), boost::token_compress_on );
-		if(tsl.empty()) {
-			std::cout << produceResult(emitEmptyString, input, sEmptyString, tsl) << std::endl;
-			continue;
-		} 
-		url = tsl[0];
-
-		if(!generateVariants(url,sv)) {
-			std::cout << produceResult(emitEmptyString, input, sEmptyString, tsl) << std::endl;
-			continue;
+		if(pool) {
+			line.assign(input.data, input.size);
+			pool->submit(line);
+		} else {
+			r.process(input, uv, reply, ts);
+			out.add(reply);
+			if(out.due())
+				out.flush();
 		}
-		if(bh.checkHash(sv,url) || mh.checkHash(sv,url))
-			std::cout << produceResult(emitEmptyString, input, url, tsl) << std::endl;
-		else
-			std::cout << produceResult(emitEmptyString, input, sEmptyString, tsl) << std::endl;
 	}
+	if(pool)
+		pool->finish();
+	out.flush();
+	reporter.stop();
+	watcher.stop();
+	fullHashes.save();
+
+	if(!statsFile.empty())
+		reporter.write();
+	if(runDebug)
+		r.writeStats(std::cerr);
 
 	return 0;
 }
@@ -0,0 +1,452 @@
+/**
+ * @file   gsb-replay.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Replay of Squid's access log through redirector, to measure its throughput &
+ *         latency
+ *
+ * Requests are taken from access log in native Squid format (or from file with request
+ * lines of redirector), or are generated.  They are checked against given snapshot, or
+ * against generated one with given number of hashes, where part of requests is planted.
+ * Requests are processed in-process by the same code, as redirector uses, and over pipes
+ * by real redirector, one request at time, like Squid sends them to helper without
+ * concurrency.  So lines per second of pipe mode is the capacity of one url_rewrite child.
+ */
+
+#include "corpus.h"
+#include "redirector.h"
+#include "snapshot.h"
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/chrono.hpp>
+
+bool runDebug;
+
+namespace {
+
+// count of heap allocations, to find allocations on request path
+std::size_t allocCount=0;
+
+}
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+	++allocCount;
+	void* p=std::malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) throw() {
+	std::free(p);
+}
+
+namespace {
+
+typedef boost::chrono::high_resolution_clock Clock;
+
+/**
+ * Measurements of one run
+ */
+struct ReplayResult {
+	/// latencies of requests in nanoseconds
+	std::vector<boost::uint64_t> latencies;
+	double seconds;
+	std::size_t matches;
+	/// number of allocations, or -1 if they aren't counted
+	long allocations;
+
+	ReplayResult() : seconds(0), matches(0), allocations(-1) { }
+} ;
+
+/**
+ * Read requests from Squid's access log in native format ("time elapsed client
+ * code/status bytes method URL ..."), lines with other number of fields are used as
+ * request lines as is
+ */
+bool readRequests(const std::string& fname, std::vector<std::string>& lines) {
+	std::ifstream ifs(fname.c_str());
+	if(!ifs)
+		return false;
+	std::string line;
+	std::vector<std::string> fields;
+	while(std::getline(ifs, line)) {
+		boost::trim(line);
+		if(line.empty())
+			continue;
+		boost::split(fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+		if(fields.size() >= 7)
+			lines.push_back(fields[6] + " " + fields[2] + "/- - " + fields[5]);
+		else
+			lines.push_back(line);
+	}
+	return true;
+}
+
+/**
+ * Request line of redirector for URL
+ */
+std::string requestLine(const std::string& url, std::size_t i) {
+	std::ostringstream os;
+	os << url << " 10.0.0." << (i % 250 + 1) << "/- - GET";
+	return os.str();
+}
+
+/**
+ * Plant URL of each 1/hitRate-th request into lists of corpus, so these requests are found
+ */
+void plantRequests(const std::vector<std::string>& lines, double hitRate, CorpusGenerator& gen,
+				   Corpus& corpus) {
+	std::size_t step=hitRate > 0 ? (std::size_t)(1/hitRate) : 0;
+	for(std::size_t i=0; step && i < lines.size(); i+=step) {
+		std::string::size_type space=lines[i].find(' ');
+		if(gen.plant(lines[i].substr(0, space), corpus))
+			++corpus.planted;
+	}
+}
+
+/**
+ * Write snapshot with lists of corpus
+ */
+bool makeSnapshot(const fs::path& fname, const Corpus& corpus) {
+	std::vector<HashData> hs;
+	corpus.makeLists(hs);
+	std::vector<const HashData*> hp;
+	for(std::size_t i=0; i < hs.size(); ++i)
+		hp.push_back(&hs[i]);
+	ListsData ld;
+	combineLists(hp, ld);
+	ld.generation=1;
+	return writeSnapshot(fname, ld);
+}
+
+/**
+ * Process requests by Redirector in this process
+ */
+bool replayInProcess(const fs::path& snapshot, const ListConfigs& lists,
+					 std::size_t cacheSize, const std::vector<std::string>& lines,
+					 ReplayResult& res) {
+	HashFile hashes;
+	hashes.fname=snapshot;
+	if(!hashes.updateHash() || !hashes.loaded())
+		return false;
+	Redirector r;
+	r.hashes=&hashes;
+	r.lists=lists;
+	r.okErr=true;
+	boost::shared_ptr<VerdictCache> urlCache, hostCache;
+	if(cacheSize) {
+		urlCache.reset(new VerdictCache(cacheSize));
+		hostCache.reset(new VerdictCache(cacheSize/4 + 1));
+		r.urlCache=urlCache.get();
+		r.hostCache=hostCache.get();
+	}
+
+	UrlVariants uv;
+	std::string reply;
+	reply.reserve(1024);
+	res.latencies.resize(lines.size());
+	std::size_t allocs=allocCount;
+	Clock::time_point start=Clock::now();
+	for(std::size_t i=0; i < lines.size(); ++i) {
+		Clock::time_point t=Clock::now();
+		r.process(StringPiece(lines[i]), uv, reply);
+		res.latencies[i]=boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+			Clock::now() - t).count();
+		if(reply != "ERR")
+			++res.matches;
+	}
+	res.seconds=boost::chrono::duration<double>(Clock::now() - start).count();
+	res.allocations=allocCount - allocs;
+	return true;
+}
+
+bool writeAll(int fd, const char* data, std::size_t size) {
+	while(size) {
+		ssize_t n=::write(fd, data, size);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		data+=n;
+		size-=n;
+	}
+	return true;
+}
+
+/**
+ * Reader of reply lines from pipe
+ */
+class ReplyReader {
+public:
+	ReplyReader(int f) : fd(f), buf(65536), begin(0), end(0) { }
+
+	bool next(StringPiece& reply) {
+		while(true) {
+			char* nl=static_cast<char*>(std::memchr(&buf[begin], '\n', end-begin));
+			if(nl) {
+				reply=StringPiece(&buf[begin], nl-&buf[begin]);
+				begin=nl-&buf[0]+1;
+				return true;
+			}
+			if(begin == end) {
+				begin=end=0;
+			} else if(end == buf.size()) {
+				// too long reply
+				if(begin == 0)
+					return false;
+				std::memmove(&buf[0], &buf[begin], end-begin);
+				end-=begin;
+				begin=0;
+			}
+			ssize_t n=::read(fd, &buf[end], buf.size()-end);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			end+=n;
+		}
+	}
+
+private:
+	int fd;
+	std::vector<char> buf;
+	std::size_t begin;
+	std::size_t end;
+} ;
+
+/**
+ * Process requests by redirector, started with given configuration file.  Each request
+ * waits for reply before next one is sent.  First request is sent before measurement,
+ * so start of redirector isn't counted
+ */
+bool replayOverPipes(const std::string& redirector, const fs::path& config,
+					 const std::vector<std::string>& lines, ReplayResult& res) {
+	int in[2], out[2];
+	if(::pipe(in) != 0)
+		return false;
+	if(::pipe(out) != 0) {
+		::close(in[0]);
+		::close(in[1]);
+		return false;
+	}
+	std::string cname=pathString(config);
+	pid_t pid=::fork();
+	if(pid < 0)
+		return false;
+	if(pid == 0) {
+		::dup2(in[0], 0);
+		::dup2(out[1], 1);
+		::close(in[0]);
+		::close(in[1]);
+		::close(out[0]);
+		::close(out[1]);
+		::execl(redirector.c_str(), redirector.c_str(), "-c", cname.c_str(), (char*)0);
+		::_exit(127);
+	}
+	::close(in[0]);
+	::close(out[1]);
+
+	ReplyReader reader(out[0]);
+	StringPiece reply;
+	std::string line;
+	bool result=false;
+	if(!lines.empty()) {
+		line=lines[0] + "\n";
+		result=writeAll(in[1], line.data(), line.size()) && reader.next(reply);
+	}
+	res.latencies.resize(lines.size());
+	Clock::time_point start=Clock::now();
+	for(std::size_t i=0; i < lines.size() && result; ++i) {
+		Clock::time_point t=Clock::now();
+		line=lines[i];
+		line+='\n';
+		result=writeAll(in[1], line.data(), line.size()) && reader.next(reply);
+		res.latencies[i]=boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+			Clock::now() - t).count();
+		if(result && !(reply == StringPiece("ERR", 3)))
+			++res.matches;
+	}
+	res.seconds=boost::chrono::duration<double>(Clock::now() - start).count();
+	::close(in[1]);
+	::close(out[0]);
+	int status=0;
+	while(::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	return result && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void writeConfig(const fs::path& fname, const fs::path& snapshot, const ListConfigs& lists,
+				 const fs::path& dir, std::size_t cacheSize) {
+	std::ofstream ofs(pathString(fname).c_str());
+	ofs << "lists-snapshot = " << pathString(snapshot) << "\n"
+		<< "ok-err-replies = 1\n"
+		<< "cache-size = " << cacheSize << "\n"
+		<< "host-cache-size = " << cacheSize/4 + 1 << "\n"
+		<< "fullhash-cache-file = " << pathString(dir / "fullhash.cache") << "\n";
+	for(ListConfigs::const_iterator it=lists.begin(); it != lists.end(); ++it) {
+		ofs << "[list." << it->name << "]\n"
+			<< "url = " << it->url << "\n"
+			<< "file = " << pathString(it->file) << "\n";
+	}
+}
+
+boost::uint64_t percentile(const std::vector<boost::uint64_t>& sorted, double p) {
+	if(sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size()-1, (std::size_t)(p*sorted.size()))];
+}
+
+void printResult(const char* name, ReplayResult& res) {
+	std::sort(res.latencies.begin(), res.latencies.end());
+	std::size_t n=res.latencies.size();
+	std::cout << std::fixed << std::setprecision(1) << name << ": " << n << " lines, "
+			  << (res.seconds > 0 ? n/res.seconds : 0) << " lines/sec, "
+			  << res.matches << " matches, latency p50/p99/p999 "
+			  << percentile(res.latencies, 0.5)/1000.0 << "/"
+			  << percentile(res.latencies, 0.99)/1000.0 << "/"
+			  << percentile(res.latencies, 0.999)/1000.0 << " us";
+	if(res.allocations >= 0)
+		std::cout << ", " << std::setprecision(2) << (n ? (double)res.allocations/n : 0)
+				  << " allocations/request";
+	std::cout << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::string input, snapshot, mode, redirector;
+	std::size_t hashCount, urlCount, hostCount, cacheSize;
+	double hitRate;
+	boost::uint32_t seed;
+	po::options_description command("Usage: gsb_replay [options] [access.log]\nOptions");
+	command.add_options()
+		("snapshot,s", po::value<std::string>(&snapshot),
+		 "use existing snapshot, instead of generated one")
+		("hashes,n", po::value<std::size_t>(&hashCount)->default_value(1000000),
+		 "number of hashes in generated snapshot")
+		("hit-rate", po::value<double>(&hitRate)->default_value(0.01),
+		 "part of requests, planted into generated snapshot")
+		("urls,u", po::value<std::size_t>(&urlCount)->default_value(100000),
+		 "number of generated requests, if log isn't given")
+		("hosts", po::value<std::size_t>(&hostCount)->default_value(10000),
+		 "number of distinct hosts in generated requests")
+		("cache-size", po::value<std::size_t>(&cacheSize)->default_value(65536),
+		 "size of cache of URLs, 0 disables caches")
+		("mode,m", po::value<std::string>(&mode)->default_value("both"),
+		 "inproc, pipe or both")
+		("redirector,r", po::value<std::string>(&redirector),
+		 "redirector to run in pipe mode, by default gsb_redirector near this program")
+		("seed", po::value<boost::uint32_t>(&seed)->default_value(5489),
+		 "seed of random generator")
+		("debug,d", "print debug information")
+		("help,h", "Print help message and exit");
+	po::options_description hidden;
+	hidden.add_options()
+		("input", po::value<std::string>(&input));
+	po::options_description all;
+	all.add(command).add(hidden);
+	po::positional_options_description pos;
+	pos.add("input", 1);
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(all).positional(pos).run(), vm);
+		po::notify(vm);
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		return 1;
+	}
+	if(vm.count("help") || (mode != "inproc" && mode != "pipe" && mode != "both")) {
+		std::cerr << command << std::endl;
+		return vm.count("help") ? 0 : 1;
+	}
+	runDebug=vm.count("debug") != 0;
+	if(redirector.empty())
+		redirector=pathString(fs::path(argv[0]).parent_path() / "gsb_redirector");
+
+	CorpusOptions opts;
+	opts.hashes=hashCount;
+	opts.urls=urlCount;
+	opts.hosts=hostCount;
+	opts.hitRatio=hitRate;
+	opts.seed=seed;
+	CorpusGenerator gen(opts);
+	Corpus corpus;
+	std::vector<std::string> lines;
+	if(!input.empty()) {
+		if(!readRequests(input, lines)) {
+			std::cerr << "Can't read " << input << std::endl;
+			return 1;
+		}
+		if(snapshot.empty()) {
+			gen.generateLists(corpus);
+			plantRequests(lines, hitRate, gen, corpus);
+		}
+	} else {
+		// URLs are planted only into generated snapshot
+		if(snapshot.empty())
+			gen.generateLists(corpus);
+		for(std::size_t i=0; i < urlCount; ++i)
+			lines.push_back(requestLine(gen.nextUrl(corpus), i));
+	}
+
+	fs::path dir=fs::temp_directory_path() / fs::unique_path("gsb-replay-%%%%-%%%%");
+	fs::create_directories(dir);
+	int result=0;
+	try {
+		if(snapshot.empty()) {
+			snapshot=pathString(dir / "lists.snap");
+			Clock::time_point t=Clock::now();
+			if(!makeSnapshot(snapshot, corpus))
+				throw std::runtime_error("can't write snapshot " + snapshot);
+			std::cout << "generated snapshot with " << hashCount << " hashes, "
+					  << corpus.planted << " planted requests in "
+					  << boost::chrono::duration<double>(Clock::now() - t).count() << " sec"
+					  << std::endl;
+		}
+		ListsData ld;
+		if(!mapSnapshot(snapshot, ld))
+			throw std::runtime_error("can't read snapshot " + snapshot);
+		ListConfigs lists;
+		for(std::size_t i=0; i < ld.lists.size(); ++i) {
+			ListConfig lc;
+			lc.name=ld.lists[i].name;
+			lc.url="http://blocked/" + lc.name;
+			lc.file=dir / (lc.name + ".dat");
+			lc.priority=i+1;
+			lists.push_back(lc);
+		}
+		std::cout << lines.size() << " requests, " << ld.hashes.size() << " hashes, "
+				  << ld.hashes.memoryUsage() << " bytes of index" << std::endl;
+
+		if(mode != "pipe") {
+			ReplayResult res;
+			if(!replayInProcess(snapshot, lists, cacheSize, lines, res))
+				throw std::runtime_error("can't load snapshot " + snapshot);
+			printResult("in-process", res);
+		}
+		if(mode != "inproc") {
+			fs::path config=dir / "squid-gsb.conf";
+			writeConfig(config, snapshot, lists, dir, cacheSize);
+			// broken pipe is reported as error of write
+			std::signal(SIGPIPE, SIG_IGN);
+			ReplayResult res;
+			if(!replayOverPipes(redirector, config, lines, res))
+				throw std::runtime_error("error running " + redirector);
+			printResult("pipe", res);
+		}
+	} catch(std::exception& x) {
+		std::cerr << x.what() << std::endl;
+		result=1;
+	}
+	fs::remove_all(dir);
+	return result;
+}
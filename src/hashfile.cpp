@@ -0,0 +1,295 @@
+/**
+ * @file   hashfile.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Hashes, used by redirector, & their reloading in background
+ *
+ *
+ */
+
+#include "hashfile.h"
+#include "snapshot.h"
+#include "listfile.h"
+#include "probes.h"
+
+#include <iostream>
+#include <set>
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace {
+
+/// period of checks of files, if interval is 0, but inotify isn't available
+const unsigned int sDefaultInterval=60;
+
+}
+
+std::vector<fs::path> HashFile::files() const {
+	std::vector<fs::path> result(1, fname);
+	result.push_back(deltaPath(fname));
+	for(ListConfigs::const_iterator it=lists.begin(); it != lists.end(); ++it)
+		result.push_back(it->file);
+	return result;
+}
+
+/**
+ * Reload lists if their files were changed.  Snapshot, published by updater, is mapped
+ * into memory, & its delta is applied on top of it; data files of lists are read only if
+ * there is no snapshot yet.  Files are replaced by rename, so change of inode is enough
+ * to detect new version
+ *
+ * @return true if new data were published
+ */
+bool HashFile::updateHash() {
+	// damaged files could make reading throw, that shouldn't stop watching thread
+	try {
+		return reload();
+	} catch(std::exception& x) {
+		reloadFailures.add();
+		GSB_PROBE2(reload__finish, fname.c_str(), 0);
+		if(runDebug)
+			std::cerr << "Error reloading " << fname << ": " << x.what() << std::endl;
+		return false;
+	}
+}
+
+bool HashFile::reload() {
+	std::vector<fs::path> names;
+	bool isSnapshot=true;
+	names.push_back(fname);
+	names.push_back(deltaPath(fname));
+	struct stat st;
+	if(::stat(pathString(fname).c_str(), &st) != 0) {
+		isSnapshot=false;
+		names.clear();
+		for(ListConfigs::const_iterator it=lists.begin(); it != lists.end(); ++it)
+			names.push_back(it->file);
+	}
+
+	std::vector<FileId> newIds;
+	bool found=false;
+	for(std::size_t i=0; i < names.size(); ++i) {
+		FileId id={ 0, 0, 0 };
+		if(::stat(pathString(names[i]).c_str(), &st) == 0) {
+			id.dev=st.st_dev;
+			id.ino=st.st_ino;
+			id.mtime=st.st_mtime;
+			found=true;
+		} else if(runDebug) {
+			std::cerr << names[i] <<  " doesn't exists" << std::endl;
+		}
+		newIds.push_back(id);
+	}
+	if(!found || (data && newIds == ids))
+		return false;
+	GSB_PROBE1(reload__start, fname.c_str());
+
+	boost::shared_ptr<ListsData> ld(new ListsData());
+	if(isSnapshot && base && newIds[0] == baseId) {
+		*ld=*base;
+	} else if(isSnapshot) {
+		if(runDebug)
+			std::cerr << "Going to map " << pathString(fname) << std::endl;
+
+		base.reset();
+		if(mapSnapshot(fname, *ld)) {
+			base.reset(new ListsData(*ld));
+			baseId=newIds[0];
+		} else {
+			if(runDebug)
+				std::cerr << "Error mapping " << fname << std::endl;
+
+			// snapshot of older format is replaced by updater, till then data files are used
+			if(!readLists(*ld)) {
+				reloadFailures.add();
+				GSB_PROBE2(reload__finish, fname.c_str(), 0);
+				return false;
+			}
+		}
+	} else {
+		base.reset();
+		if(!readLists(*ld)) {
+			reloadFailures.add();
+			GSB_PROBE2(reload__finish, fname.c_str(), 0);
+			return false;
+		}
+	}
+	if(base && newIds[1].ino != 0) {
+		SnapshotDelta delta;
+		if(!readDelta(deltaPath(fname), delta)) {
+			reloadFailures.add();
+			if(runDebug)
+				std::cerr << "Error reading delta of " << fname << std::endl;
+		} else if(delta.base != ld->generation) {
+			// snapshot is already replaced, but delta isn't removed yet
+			if(runDebug)
+				std::cerr << "Delta isn't for current snapshot" << std::endl;
+		} else if(!applyDelta(delta, *ld)) {
+			reloadFailures.add();
+			if(runDebug)
+				std::cerr << "Delta has other lists, than " << fname << std::endl;
+		}
+	}
+
+	boost::atomic_store(&data, DataPtr(ld));
+	// generation is changed after data, so results for new generation never use old data
+	++gen;
+	ids.swap(newIds);
+	reloads.add();
+	GSB_PROBE2(snapshot__swap, gen.load(), ld->generation);
+	GSB_PROBE2(reload__finish, fname.c_str(), 1);
+	return true;
+}
+
+/**
+ * Read data files of all lists & combine them
+ */
+bool HashFile::readLists(ListsData& ld) const {
+	std::vector<HashData> hs(lists.size());
+	std::vector<const HashData*> hp;
+	for(std::size_t i=0; i < lists.size(); ++i) {
+		HashData& h=hs[i];
+		h.name=lists[i].name;
+		hp.push_back(&h);
+		if(!fs::exists(lists[i].file))
+			continue;
+		if(runDebug)
+			std::cerr << "Going to read " << pathString(lists[i].file) << std::endl;
+
+		if(!loadListFile(lists[i].file, h))
+			return false;
+	}
+	combineLists(hp, ld, compressedLists(lists));
+	if(prefixOnly)
+		ld.usePrefixes();
+	return true;
+}
+
+HashWatcher::HashWatcher(unsigned int i) : interval(i), notifyFd(-1), watched(false) {
+	wakeFds[0]=wakeFds[1]=-1;
+}
+
+HashWatcher::~HashWatcher() {
+	stop();
+}
+
+void HashWatcher::start() {
+	reloadAll();
+	if(thread)
+		return;
+	if(::pipe(wakeFds) != 0) {
+		if(runDebug)
+			std::cerr << "Can't create pipe, hashes won't be reloaded" << std::endl;
+		return;
+	}
+	watchFiles();
+	thread.reset(new boost::thread(boost::bind(&HashWatcher::run, this)));
+}
+
+void HashWatcher::stop() {
+	if(!thread)
+		return;
+	char c=0;
+	if(::write(wakeFds[1], &c, 1) == 1)
+		thread->join();
+	else
+		thread->detach();
+	thread.reset();
+	::close(wakeFds[0]);
+	::close(wakeFds[1]);
+	wakeFds[0]=wakeFds[1]=-1;
+	if(notifyFd >= 0)
+		::close(notifyFd);
+	notifyFd=-1;
+}
+
+/**
+ * Watch directories with hashes for renamed & written files
+ */
+void HashWatcher::watchFiles() {
+#ifdef __linux__
+	notifyFd=inotify_init();
+	if(notifyFd < 0) {
+		if(runDebug)
+			std::cerr << "inotify isn't available, will check files every "
+					  << (interval ? interval : sDefaultInterval) << " seconds" << std::endl;
+		return;
+	}
+	addWatches();
+#endif
+}
+
+/**
+ * Directories, that don't exist yet, can't be watched, so watches are added again on each
+ * periodic check, till all of them succeed.  Existing watches aren't duplicated
+ */
+void HashWatcher::addWatches() {
+#ifdef __linux__
+	std::set<std::string> dirs;
+	for(std::vector<HashFile*>::iterator it=hashes.begin(); it != hashes.end(); ++it) {
+		std::vector<fs::path> files=(*it)->files();
+		for(std::size_t i=0; i < files.size(); ++i) {
+			fs::path dir=files[i].parent_path();
+			dirs.insert(dir.empty() ? std::string(".") : pathString(dir));
+		}
+	}
+	watched=true;
+	for(std::set<std::string>::iterator it=dirs.begin(); it != dirs.end(); ++it) {
+		if(inotify_add_watch(notifyFd, it->c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+			watched=false;
+			if(runDebug)
+				std::cerr << "Can't watch " << *it << ", will check it every "
+						  << (interval ? interval : sDefaultInterval) << " seconds" << std::endl;
+		}
+	}
+#endif
+}
+
+void HashWatcher::reloadAll() {
+	for(std::vector<HashFile*>::iterator it=hashes.begin(); it != hashes.end(); ++it)
+		(*it)->updateHash();
+}
+
+void HashWatcher::run() {
+	while(true) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(wakeFds[0], &fds);
+		int maxFd=wakeFds[0];
+		if(notifyFd >= 0) {
+			FD_SET(notifyFd, &fds);
+			if(notifyFd > maxFd)
+				maxFd=notifyFd;
+		}
+		// interval 0 disables periodic checks, if all files are watched by inotify
+		struct timeval tv;
+		tv.tv_sec=interval ? interval : sDefaultInterval;
+		tv.tv_usec=0;
+		int r=::select(maxFd+1, &fds, 0, 0, interval || !watched ? &tv : 0);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			if(runDebug)
+				std::cerr << "select failed, stop reloading of hashes" << std::endl;
+			return;
+		}
+		if(FD_ISSET(wakeFds[0], &fds))
+			return;
+		if(notifyFd >= 0 && FD_ISSET(notifyFd, &fds)) {
+			// events are used only as signal to recheck files
+			char buf[4096];
+			if(::read(notifyFd, buf, sizeof(buf)) < 0 && runDebug)
+				std::cerr << "Error reading inotify events" << std::endl;
+		}
+		if(notifyFd >= 0 && !watched)
+			addWatches();
+		reloadAll();
+	}
+}
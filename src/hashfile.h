@@ -0,0 +1,118 @@
+/**
+ * @file   hashfile.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Hashes, used by redirector, & their reloading in background
+ *
+ *
+ */
+
+#ifndef _HASHFILE_H
+#define _HASHFILE_H 1
+
+#include "lists.h"
+#include "stats.h"
+
+#include <ctime>
+#include <vector>
+#include <sys/types.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * Combined index of lists, loaded from snapshot or from data files of lists.  Loaded
+ * data are immutable & replaced by atomic swap of pointer, so lookups never wait for
+ * reload.  When only delta of snapshot is changed, mapped snapshot is reused, so reload
+ * costs proportionally to size of delta
+ */
+struct HashFile {
+	typedef boost::shared_ptr<const ListsData> DataPtr;
+
+	/// snapshot of all lists, published by updater
+	fs::path fname;
+	/// data files of lists, that are read if there is no snapshot yet
+	ListConfigs lists;
+	/// keep only prefixes of digests, read from data files
+	bool prefixOnly;
+	/// published reloads & reloads, that failed to read changed files
+	StatCounter reloads;
+	StatCounter reloadFailures;
+
+	HashFile(): fname(""), prefixOnly(false), gen(0) { }
+
+	/// reload hash if its file was changed.  Should be called from one thread only
+	bool updateHash();
+
+	/// current data, could be used without locking while pointer is held
+	DataPtr current() const { return boost::atomic_load(&data); }
+
+	bool loaded() const {
+		DataPtr d=current();
+		return d && d->loaded();
+	}
+
+	/// incremented after each reload, could be used to invalidate cached results
+	boost::uint32_t generation() const { return gen.load(); }
+
+	/// files, that are used to load data
+	std::vector<fs::path> files() const;
+
+private:
+	/// identity of loaded file, to detect its replacement
+	struct FileId {
+		dev_t dev;
+		ino_t ino;
+		std::time_t mtime;
+
+		bool operator==(const FileId& o) const {
+			return dev == o.dev && ino == o.ino && mtime == o.mtime;
+		}
+	} ;
+
+	bool reload();
+	bool readLists(ListsData& ld) const;
+
+	DataPtr data;
+	/// mapped snapshot without delta, & identity of its file
+	DataPtr base;
+	FileId baseId;
+	boost::atomic<boost::uint32_t> gen;
+	std::vector<FileId> ids;
+} ;
+
+/**
+ * Background thread, that reloads hashes when updater publishes new snapshots.  Uses
+ * inotify, where it's available, and also rechecks files periodically
+ */
+class HashWatcher {
+public:
+	/**
+	 * @param interval period of rechecking of files, in seconds
+	 */
+	HashWatcher(unsigned int interval);
+	~HashWatcher();
+
+	void add(HashFile* hf) { hashes.push_back(hf); }
+
+	/// load all hashes synchronously & start watching thread
+	void start();
+	void stop();
+
+private:
+	void run();
+	void watchFiles();
+	void addWatches();
+	void reloadAll();
+
+	std::vector<HashFile*> hashes;
+	unsigned int interval;
+	int notifyFd;
+	/// all directories with files are watched by inotify
+	bool watched;
+	/// pipe to wake up thread on stop
+	int wakeFds[2];
+	boost::shared_ptr<boost::thread> thread;
+} ;
+
+#endif /* _HASHFILE_H */
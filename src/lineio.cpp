@@ -0,0 +1,113 @@
+/**
+ * @file   lineio.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Buffered reading of request lines & gathered writing of replies
+ *
+ *
+ */
+
+#include "lineio.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+LineReader::LineReader(int f, std::size_t bufSize)
+	: fd(f), buf(bufSize ? bufSize : 1), pos(0), len(0), eof(false) {
+}
+
+bool LineReader::buffered() const {
+	return std::memchr(&buf[0]+pos, '\n', len-pos) != 0;
+}
+
+/**
+ * Read more data after unprocessed part of buffer.  Unprocessed part is moved to
+ * beginning of buffer, & buffer grows if it's full
+ *
+ * @return false if nothing was read
+ */
+bool LineReader::fill() {
+	if(pos) {
+		std::memmove(&buf[0], &buf[0]+pos, len-pos);
+		len-=pos;
+		pos=0;
+	}
+	if(len == buf.size())
+		buf.resize(buf.size()*2);
+	while(true) {
+		ssize_t r=::read(fd, &buf[0]+len, buf.size()-len);
+		if(r > 0) {
+			len+=r;
+			return true;
+		}
+		if(r < 0 && errno == EINTR)
+			continue;
+		eof=true;
+		return false;
+	}
+}
+
+bool LineReader::next(StringPiece& line) {
+	std::size_t scanned=pos;
+	while(true) {
+		const char* nl=static_cast<const char*>(std::memchr(&buf[0]+scanned, '\n', len-scanned));
+		if(nl) {
+			line=StringPiece(&buf[0]+pos, nl-&buf[0]-pos);
+			pos=nl-&buf[0]+1;
+			return true;
+		}
+		if(eof)
+			break;
+		scanned=len-pos;
+		if(!fill())
+			break;
+	}
+	// last line without newline
+	if(pos == len)
+		return false;
+	line=StringPiece(&buf[0]+pos, len-pos);
+	pos=len;
+	return true;
+}
+
+ReplyWriter::ReplyWriter(std::ostream& o, std::size_t b, unsigned int d)
+	: os(o), maxBytes(b), maxDelay(boost::chrono::microseconds(d)) {
+	buf.reserve(maxBytes+1024);
+}
+
+void ReplyWriter::add(const std::string& reply) {
+	if(buf.empty())
+		first=Clock::now();
+	buf+=reply;
+	buf+='\n';
+}
+
+bool ReplyWriter::due() const {
+	return !buf.empty() && (buf.size() >= maxBytes || Clock::now()-first >= maxDelay);
+}
+
+void ReplyWriter::flush() {
+	if(buf.empty())
+		return;
+	os.write(buf.data(), buf.size());
+	os.flush();
+	buf.clear();
+}
+
+namespace {
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+}
+
+StringPiece trimPiece(const StringPiece& s) {
+	const char* b=s.data;
+	const char* e=s.end();
+	while(b != e && isSpace(*b))
+		++b;
+	while(e != b && isSpace(e[-1]))
+		--e;
+	return StringPiece(b, e-b);
+}
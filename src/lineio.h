@@ -0,0 +1,81 @@
+/**
+ * @file   lineio.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Buffered reading of request lines & gathered writing of replies
+ *
+ *
+ */
+
+#ifndef _LINEIO_H
+#define _LINEIO_H 1
+
+#include "variants.h"
+
+#include <vector>
+#include <boost/chrono.hpp>
+
+/**
+ * Reads lines directly from file descriptor into large buffer.  Lines are returned as
+ * pieces of this buffer, so they are valid only until next call of next()
+ */
+class LineReader {
+public:
+	/**
+	 * @param fd file descriptor to read
+	 * @param bufSize initial size of buffer, it grows if line doesn't fit into it
+	 */
+	LineReader(int fd, std::size_t bufSize=65536);
+
+	/**
+	 * Get next line, without trailing newline
+	 *
+	 * @return false on end of file or error
+	 */
+	bool next(StringPiece& line);
+
+	/// is complete line available without reading from file?
+	bool buffered() const;
+
+private:
+	bool fill();
+
+	int fd;
+	std::vector<char> buf;
+	std::size_t pos;
+	std::size_t len;
+	bool eof;
+} ;
+
+/**
+ * Gathers replies & writes them by one call.  Caller flushes it when there is no more
+ * input to process; due() reports when replies shouldn't wait anymore
+ */
+class ReplyWriter {
+public:
+	/**
+	 * @param os stream for replies
+	 * @param maxBytes flush after this amount of gathered data
+	 * @param maxDelay flush if oldest reply waits longer, in microseconds
+	 */
+	ReplyWriter(std::ostream& os, std::size_t maxBytes=65536, unsigned int maxDelay=1000);
+
+	/// add reply, newline is appended
+	void add(const std::string& reply);
+	bool due() const;
+	void flush();
+
+private:
+	typedef boost::chrono::steady_clock Clock;
+
+	std::ostream& os;
+	std::string buf;
+	std::size_t maxBytes;
+	Clock::duration maxDelay;
+	Clock::time_point first;
+} ;
+
+/// strip spaces from both ends of string
+StringPiece trimPiece(const StringPiece& s);
+
+#endif /* _LINEIO_H */
@@ -0,0 +1,188 @@
+/**
+ * @file   listfile.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary data files of lists, kept by updater
+ *
+ *
+ */
+
+#include "listfile.h"
+#include <iostream>
+
+namespace {
+
+const char sMagic[8]={ 'G', 'S', 'B', 'L', 'I', 'S', 'T', 0 };
+const boost::uint32_t sByteOrder=0x01020304;
+const boost::uint32_t sFormatVersion=1;
+/// number of digests, read by one call
+const std::size_t sReadBlock=65536;
+
+inline boost::uint64_t alignOffset(boost::uint64_t off) {
+	return (off + 63) & ~(boost::uint64_t)63;
+}
+
+inline boost::uint64_t mixWord(boost::uint64_t h, const unsigned char* p) {
+	boost::uint64_t w;
+	std::memcpy(&w, p, sizeof(w));
+	h=(h ^ w)*0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+}
+
+boost::uint64_t digestsChecksum(const Digest* d, std::size_t n, boost::uint64_t seed) {
+	boost::uint64_t h=seed;
+	for(std::size_t i=0; i < n; ++i)
+		h=mixWord(mixWord(h, d[i].bytes), d[i].bytes+8);
+	return h;
+}
+
+/**
+ * Write data file of list.  File is written under temporary name & renamed, so readers
+ * always see complete file
+ *
+ * @param fname name of data file
+ * @param h list to write
+ *
+ * @return true on success
+ */
+bool writeListFile(const fs::path& fname, const HashData& h) {
+	static const char zeros[64]={ 0 };
+	ListFileHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, sMagic, sizeof(sMagic));
+	hdr.byteOrder=sByteOrder;
+	hdr.formatVersion=sFormatVersion;
+	std::strncpy(hdr.name, h.name.c_str(), sizeof(hdr.name)-1);
+	hdr.majorVersion=h.majorVersion;
+	hdr.minorVersion=h.minorVersion;
+	hdr.count=h.hashes.size();
+	hdr.checksum=digestsChecksum(h.hashes.begin(), h.hashes.size());
+	hdr.digestsOffset=alignOffset(sizeof(hdr));
+
+	fs::path tname=tempPath(fname);
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary | std::ios::trunc);
+		if(!ofs) {
+			if(runDebug)
+				std::cerr << "Error opening " << tname << std::endl;
+			return false;
+		}
+		ofs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		ofs.write(zeros, hdr.digestsOffset-sizeof(hdr));
+		if(hdr.count)
+			ofs.write(reinterpret_cast<const char*>(h.hashes.begin()), hdr.count*sizeof(Digest));
+		ofs.close();
+		if(!ofs) {
+			if(runDebug)
+				std::cerr << "Error writing " << tname << std::endl;
+			fs::remove(tname);
+			return false;
+		}
+	}
+	fs::rename(tname, fname);
+	return true;
+}
+
+/**
+ * Read data file of list in binary format.  Digests are read by large blocks directly
+ * into index, & checked to be sorted & to match checksum from header
+ *
+ * @param fname name of data file
+ * @param h list to fill, unchanged on error
+ *
+ * @return false if file couldn't be read or is damaged
+ */
+bool readListFile(const fs::path& fname, HashData& h) {
+	std::ifstream ifs(pathString(fname).c_str(), std::ios::binary);
+	if(!ifs) {
+		if(runDebug)
+			std::cerr << "Error opening " << fname << std::endl;
+		return false;
+	}
+	ListFileHeader hdr;
+	boost::uint64_t size=0;
+	try {
+		size=fs::file_size(fname);
+	} catch(std::exception&) {
+		return false;
+	}
+	if(!ifs.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) ||
+	   std::memcmp(hdr.magic, sMagic, sizeof(sMagic)) != 0 || hdr.byteOrder != sByteOrder ||
+	   hdr.formatVersion != sFormatVersion || hdr.digestsOffset < sizeof(hdr) ||
+	   hdr.digestsOffset > size || (size - hdr.digestsOffset) % sizeof(Digest) != 0 ||
+	   hdr.count != (size - hdr.digestsOffset)/sizeof(Digest)) {
+		if(runDebug)
+			std::cerr << "Wrong format of " << fname << std::endl;
+		return false;
+	}
+
+	DigestVector dv(hdr.count);
+	boost::uint64_t checksum=0;
+	ifs.seekg(hdr.digestsOffset);
+	for(std::size_t i=0; i < dv.size(); i+=sReadBlock) {
+		std::size_t n=std::min(sReadBlock, dv.size()-i);
+		if(!ifs.read(reinterpret_cast<char*>(&dv[i]), n*sizeof(Digest)))
+			return false;
+		checksum=digestsChecksum(&dv[i], n, checksum);
+	}
+	bool sorted=true;
+	for(std::size_t i=1; i < dv.size() && sorted; ++i)
+		sorted=dv[i-1] < dv[i];
+	if(checksum != hdr.checksum || !sorted) {
+		if(runDebug)
+			std::cerr << "Damaged data in " << fname << std::endl;
+		return false;
+	}
+
+	h.name.assign(hdr.name, strnlen(hdr.name, sizeof(hdr.name)));
+	h.majorVersion=hdr.majorVersion;
+	h.minorVersion=hdr.minorVersion;
+	h.hashes.assign(dv);
+	return true;
+}
+
+/**
+ * Read data file of list in old format, Boost text archive
+ */
+bool readTextListFile(const fs::path& fname, HashData& h) {
+	std::ifstream ifs(pathString(fname).c_str(), std::ios::binary);
+	if(!ifs) {
+		if(runDebug)
+			std::cerr << "Error opening " << fname << std::endl;
+		return false;
+	}
+	try {
+		HashData th;
+		boost::archive::text_iarchive ia(ifs);
+		ia >> th;
+		h=th;
+	} catch(std::exception& x) {
+		if(runDebug)
+			std::cerr << "Catch exception: " << x.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Check, is file in binary format?
+ */
+bool isListFile(const fs::path& fname) {
+	char magic[sizeof(sMagic)];
+	std::ifstream ifs(pathString(fname).c_str(), std::ios::binary);
+	return ifs.read(magic, sizeof(magic)) && std::memcmp(magic, sMagic, sizeof(magic)) == 0;
+}
+
+/**
+ * Read data file of list in any format
+ *
+ * @param fname name of data file
+ * @param h list to fill
+ *
+ * @return false if file couldn't be read
+ */
+bool loadListFile(const fs::path& fname, HashData& h) {
+	return isListFile(fname) ? readListFile(fname, h) : readTextListFile(fname, h);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file   listfile.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary data files of lists, kept by updater
+ *
+ * Data file of list contains header with name & version of list, number of digests &
+ * their checksum, followed by sorted raw digests.  Digests start at aligned offset, so
+ * file could be read by large blocks or mapped into memory.  Data files in old format
+ * (Boost text archive) are still read, & replaced by updater on next update.
+ */
+
+#ifndef _LISTFILE_H
+#define _LISTFILE_H 1
+
+#include "common.h"
+
+/**
+ * Header of data file.  All numbers are in native byte order, that is checked with
+ * byteOrder field
+ */
+struct ListFileHeader {
+	char magic[8];
+	boost::uint32_t byteOrder;
+	boost::uint32_t formatVersion;
+	char name[64];
+	boost::int32_t majorVersion;
+	boost::int32_t minorVersion;
+	boost::uint64_t count;
+	/// checksum of all digests, see digestsChecksum()
+	boost::uint64_t checksum;
+	boost::uint64_t digestsOffset;
+} ;
+
+/**
+ * Update checksum with given digests.  Checksum of concatenated ranges is the same as
+ * checksum of whole array
+ *
+ * @param seed checksum of previous digests, or 0
+ */
+boost::uint64_t digestsChecksum(const Digest* d, std::size_t n, boost::uint64_t seed=0);
+
+bool writeListFile(const fs::path& fname, const HashData& h);
+bool readListFile(const fs::path& fname, HashData& h);
+bool readTextListFile(const fs::path& fname, HashData& h);
+bool isListFile(const fs::path& fname);
+bool loadListFile(const fs::path& fname, HashData& h);
+
+#endif /* _LISTFILE_H */
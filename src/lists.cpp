@@ -0,0 +1,143 @@
+/**
+ * @file   lists.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Combined index of all lists, used by redirector
+ *
+ *
+ */
+
+#include "lists.h"
+
+int ListsData::bitOf(const std::string& name) const {
+	for(std::size_t i=0; i < lists.size(); ++i) {
+		if(lists[i].name == name)
+			return i;
+	}
+	return -1;
+}
+
+bool ListsData::loaded() const {
+	for(std::size_t i=0; i < lists.size(); ++i) {
+		if(lists[i].minorVersion != -1)
+			return true;
+	}
+	return false;
+}
+
+boost::uint32_t ListsData::check(const UrlVariants& uv, bool hostOnly, std::size_t first,
+								 std::size_t last, FullHashSource* source) const {
+	boost::uint32_t mask=0;
+	if(last > uv.count)
+		last=uv.count;
+	for(std::size_t i=first; i < last; ++i) {
+		if(hostOnly && !(uv.variants[i].path == StringPiece("/", 1)))
+			continue;
+		// candidates are lists, where only prefix of digest is found
+		boost::uint32_t m=0, c=0;
+		if(prefixOnly)
+			c=prefixes.lookup(uv.digests[i].prefix());
+		else if(overlay.empty() || !overlay.find(uv.digests[i], m))
+			m=hashes.lookup(uv.digests[i]);
+		if(compressedMask & ~mask) {
+			boost::uint32_t p=uv.digests[i].prefix();
+			for(std::size_t b=0; b < compressed.size(); ++b) {
+				boost::uint32_t bit=(boost::uint32_t)1 << b;
+				if((compressedMask & ~mask & bit) && compressed[b].contains(p))
+					c|=bit;
+			}
+		}
+		// lists, that are already found, don't need confirmation
+		c&=~(mask | m);
+		if(c)
+			m|=source ? source->confirm(*this, uv.digests[i], c) : c;
+		mask|=m;
+	}
+	return mask;
+}
+
+void ListsData::usePrefixes() {
+	prefixes.assign(hashes);
+	hashes.clear();
+	overlay.clear();
+	prefixOnly=true;
+}
+
+std::size_t ListsData::memoryUsage() const {
+	std::size_t result=hashes.memoryUsage() + overlay.memoryUsage() + prefixes.memoryUsage();
+	for(std::size_t i=0; i < compressed.size(); ++i)
+		result+=compressed[i].memoryUsage();
+	return result;
+}
+
+/**
+ * Lists are merged one by one into sorted vector of digests with parallel vector of
+ * masks.  Combined index also gets Bloom filter, as most of lookups are misses
+ */
+void combineLists(const std::vector<const HashData*>& hs, ListsData& ld,
+				  boost::uint32_t compress) {
+	DigestVector digests;
+	std::vector<boost::uint32_t> masks;
+	ld.lists.clear();
+	ld.compressed.clear();
+	ld.compressedMask=0;
+	for(std::size_t i=0; i < hs.size() && i < MaxLists; ++i) {
+		const HashData& h=*hs[i];
+		ListInfo li;
+		li.name=h.name;
+		li.majorVersion=h.majorVersion;
+		li.minorVersion=h.minorVersion;
+		ld.lists.push_back(li);
+		if(h.minorVersion == -1)
+			continue;
+
+		boost::uint32_t bit=(boost::uint32_t)1 << i;
+		if(compress & bit) {
+			std::vector<boost::uint32_t> prefixes;
+			prefixes.reserve(h.hashes.size());
+			for(const Digest* it=h.hashes.begin(); it != h.hashes.end(); ++it) {
+				if(prefixes.empty() || prefixes.back() != it->prefix())
+					prefixes.push_back(it->prefix());
+			}
+			ld.compressed.resize(i+1);
+			ld.compressed[i].assign(prefixes);
+			ld.compressedMask|=bit;
+			continue;
+		}
+
+		DigestVector rd;
+		std::vector<boost::uint32_t> rm;
+		rd.reserve(digests.size() + h.hashes.size());
+		rm.reserve(digests.size() + h.hashes.size());
+		std::size_t j=0;
+		const Digest* it=h.hashes.begin();
+		while(j < digests.size() || it != h.hashes.end()) {
+			if(it == h.hashes.end() || (j < digests.size() && digests[j] < *it)) {
+				rd.push_back(digests[j]);
+				rm.push_back(masks[j]);
+				++j;
+			} else if(j == digests.size() || *it < digests[j]) {
+				rd.push_back(*it);
+				rm.push_back(bit);
+				++it;
+			} else {
+				rd.push_back(digests[j]);
+				rm.push_back(masks[j] | bit);
+				++j;
+				++it;
+			}
+		}
+		digests.swap(rd);
+		masks.swap(rm);
+	}
+	ld.hashes.assign(digests, &masks, true);
+}
+
+boost::uint32_t compressedLists(const ListConfigs& lists) {
+	boost::uint32_t mask=0;
+	for(std::size_t i=0; i < lists.size() && i < MaxLists; ++i) {
+		if(lists[i].compressed)
+			mask|=(boost::uint32_t)1 << i;
+	}
+	return mask;
+}
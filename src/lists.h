@@ -0,0 +1,121 @@
+/**
+ * @file   lists.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Combined index of all lists, used by redirector
+ *
+ *
+ */
+
+#ifndef _LISTS_H
+#define _LISTS_H 1
+
+#include "common.h"
+#include "variants.h"
+
+/**
+ * Name & version of one list in combined index
+ */
+struct ListInfo {
+	std::string name;
+	int majorVersion;
+	int minorVersion;
+
+	ListInfo() : majorVersion(1), minorVersion(-1) { }
+} ;
+
+struct ListsData;
+
+/**
+ * Confirmation of prefixes, found in index of prefixes, by full digests
+ */
+class FullHashSource {
+public:
+	virtual ~FullHashSource() { }
+
+	/**
+	 * Find lists, that contain full digest
+	 *
+	 * @param ld lists, that are used to map names of lists to bits
+	 * @param d full digest
+	 * @param candidates mask of lists, where prefix of digest was found
+	 *
+	 * @return mask of lists, or 0 if digest isn't found or couldn't be checked
+	 */
+	virtual boost::uint32_t confirm(const ListsData& ld, const Digest& d,
+									boost::uint32_t candidates)=0;
+
+	/// number of failed confirmations, results of lookups shouldn't be cached after them
+	virtual boost::uint32_t failures() const=0;
+
+	/// save changed results, if it's time for it.  Called every second from background thread
+	virtual void flush() { }
+} ;
+
+/**
+ * Digests of all lists in one index.  Each digest has mask of lists, that contain it:
+ * bit i corresponds to lists[i], so one probe answers for all lists.
+ *
+ * Changes, published after snapshot, are kept in small overlay index: its masks replace
+ * masks from base index (empty mask means that digest was removed from all lists).
+ *
+ * Index could keep only prefixes of digests: then matches are confirmed by full digests.
+ * Separate lists could also be kept as compressed prefixes outside of combined index
+ */
+struct ListsData {
+	std::vector<ListInfo> lists;
+	DigestIndex hashes;
+	DigestIndex overlay;
+	/// prefixes of digests, used instead of hashes, if prefixOnly is set
+	PrefixIndex prefixes;
+	bool prefixOnly;
+	/// compressed prefixes of lists, which bits are set in compressedMask, by bit of list
+	std::vector<RiceIndex> compressed;
+	boost::uint32_t compressedMask;
+	/// generation of snapshot with base index, 0 if it wasn't published
+	boost::uint64_t generation;
+
+	ListsData() : prefixOnly(false), compressedMask(0), generation(0) { }
+
+	/// bit of list with given name, or -1 if there is no such list
+	int bitOf(const std::string& name) const;
+
+	/// is at least one list loaded?
+	bool loaded() const;
+
+	/**
+	 * Check variants of URL
+	 *
+	 * @param uv generated variants of url, with digests
+	 * @param hostOnly check only variants with root path
+	 * @param first index of first variant to check
+	 * @param last index after last variant to check
+	 * @param source confirmation of found prefixes; without it found prefixes are
+	 * treated as matches
+	 *
+	 * @return mask of lists, that contain at least one variant
+	 */
+	boost::uint32_t check(const UrlVariants& uv, bool hostOnly=false, std::size_t first=0,
+						  std::size_t last=UrlVariants::MaxVariants,
+						  FullHashSource* source=0) const;
+
+	/// replace digests with their prefixes
+	void usePrefixes();
+
+	/// memory, used by indexes, in bytes
+	std::size_t memoryUsage() const;
+} ;
+
+/**
+ * Merge lists into combined index.  Lists with minorVersion -1 aren't loaded & are
+ * skipped
+ *
+ * @param compress bits of lists, that are kept as compressed prefixes instead
+ */
+void combineLists(const std::vector<const HashData*>& hs, ListsData& ld,
+				  boost::uint32_t compress=0);
+
+/// bits of lists, configured with compressed storage
+boost::uint32_t compressedLists(const ListConfigs& lists);
+
+#endif /* _LISTS_H */
@@ -0,0 +1,16 @@
+/**
+ * @file   md5-avx2.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  8-lane MD5 kernel, compiled with AVX2 instructions enabled
+ *
+ *
+ */
+
+#include "md5-lanes.h"
+
+typedef boost::uint32_t Md5Vector8 __attribute__((vector_size(32)));
+
+void md5KernelAvx2(const boost::uint32_t* words, boost::uint32_t* state) {
+	Md5Lanes<Md5Vector8, 8>::run(words, state);
+}
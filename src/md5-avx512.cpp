@@ -0,0 +1,16 @@
+/**
+ * @file   md5-avx512.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  16-lane MD5 kernel, compiled with AVX-512 instructions enabled
+ *
+ *
+ */
+
+#include "md5-lanes.h"
+
+typedef boost::uint32_t Md5Vector16 __attribute__((vector_size(64)));
+
+void md5KernelAvx512(const boost::uint32_t* words, boost::uint32_t* state) {
+	Md5Lanes<Md5Vector16, 16>::run(words, state);
+}
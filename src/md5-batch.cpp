@@ -0,0 +1,186 @@
+/**
+ * @file   md5-batch.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  MD5 of many short messages at once, using SIMD instructions if available
+ *
+ * Almost all variants of URL fit into one 64-byte block of MD5, so they are padded here
+ * and processed by kernel in 4, 8 or 16 lanes.  Longer messages & CPUs without SIMD
+ * support are handled by boost::md5.
+ */
+
+#include "md5-batch.h"
+#include <boost/md5.hpp>
+
+typedef void (*Md5Kernel)(const boost::uint32_t* words, boost::uint32_t* state);
+
+#ifdef GSB_MD5_SIMD
+void md5KernelSse2(const boost::uint32_t* words, boost::uint32_t* state);
+void md5KernelAvx2(const boost::uint32_t* words, boost::uint32_t* state);
+void md5KernelAvx512(const boost::uint32_t* words, boost::uint32_t* state);
+#endif
+
+namespace {
+
+struct KernelInfo {
+	Md5Impl impl;
+	Md5Kernel kernel;
+	unsigned int lanes;
+	const char* name;
+} ;
+
+const KernelInfo sKernels[]={
+	{ Md5Scalar, 0, 1, "scalar" },
+#ifdef GSB_MD5_SIMD
+	{ Md5Sse2, md5KernelSse2, 4, "sse2" },
+	{ Md5Avx2, md5KernelAvx2, 8, "avx2" },
+	{ Md5Avx512, md5KernelAvx512, 16, "avx512" },
+#endif
+};
+const std::size_t sKernelsCount=sizeof(sKernels)/sizeof(sKernels[0]);
+const unsigned int MaxLanes=16;
+
+bool cpuSupports(Md5Impl impl) {
+#ifdef GSB_MD5_SIMD
+	__builtin_cpu_init();
+	switch(impl) {
+	case Md5Sse2:
+		return __builtin_cpu_supports("sse2");
+	case Md5Avx2:
+		return __builtin_cpu_supports("avx2");
+	case Md5Avx512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		break;
+	}
+#endif
+	return impl == Md5Scalar;
+}
+
+const KernelInfo* findKernel(Md5Impl impl) {
+	if(impl == Md5Auto) {
+		const KernelInfo* best=sKernels;
+		for(std::size_t i=1; i < sKernelsCount; ++i) {
+			if(cpuSupports(sKernels[i].impl))
+				best=&sKernels[i];
+		}
+		return best;
+	}
+	for(std::size_t i=0; i < sKernelsCount; ++i) {
+		if(sKernels[i].impl == impl)
+			return cpuSupports(impl) ? &sKernels[i] : 0;
+	}
+	return 0;
+}
+
+// selected once, at program start
+const KernelInfo* sBestKernel=findKernel(Md5Auto);
+
+void md5Scalar(const UrlVariant& m, Digest& d) {
+	boost::md5 h(m.host.data, m.host.size);
+	h.process(m.path.data, m.path.size, true);
+	std::memcpy(d.bytes, h.digest(), 16);
+}
+
+/**
+ * Put padded message into lane of interleaved block
+ */
+void fillLane(const UrlVariant& m, boost::uint32_t* words, unsigned int lane,
+			  unsigned int lanes) {
+	unsigned char block[64];
+	std::memcpy(block, m.host.data, m.host.size);
+	std::memcpy(block+m.host.size, m.path.data, m.path.size);
+	std::size_t len=m.size();
+	block[len]=0x80;
+	std::memset(block+len+1, 0, 56-len-1);
+	boost::uint64_t bits=(boost::uint64_t)len*8;
+	for(int i=0; i < 8; ++i)
+		block[56+i]=(unsigned char)(bits >> (8*i));
+	for(int i=0; i < 16; ++i) {
+		const unsigned char* p=block+4*i;
+		words[i*lanes+lane]=(boost::uint32_t)p[0] | ((boost::uint32_t)p[1] << 8) |
+			((boost::uint32_t)p[2] << 16) | ((boost::uint32_t)p[3] << 24);
+	}
+}
+
+void runKernel(const KernelInfo& k, const UrlVariant* msgs, const std::size_t* idx,
+			   std::size_t n, Digest* digests) {
+	boost::uint32_t words[16*MaxLanes];
+	boost::uint32_t state[4*MaxLanes];
+	std::memset(words, 0, 16*k.lanes*sizeof(boost::uint32_t));
+	for(std::size_t l=0; l < n; ++l)
+		fillLane(msgs[idx[l]], words, l, k.lanes);
+	k.kernel(words, state);
+	for(std::size_t l=0; l < n; ++l) {
+		unsigned char* out=digests[idx[l]].bytes;
+		for(int j=0; j < 4; ++j) {
+			boost::uint32_t v=state[j*k.lanes+l];
+			out[4*j]=(unsigned char)v;
+			out[4*j+1]=(unsigned char)(v >> 8);
+			out[4*j+2]=(unsigned char)(v >> 16);
+			out[4*j+3]=(unsigned char)(v >> 24);
+		}
+	}
+}
+
+void hashWith(const KernelInfo& k, const UrlVariant* msgs, std::size_t count,
+			  Digest* digests) {
+	// messages, that fit into one block, are collected into lanes
+	std::size_t idx[MaxLanes];
+	std::size_t n=0;
+	for(std::size_t i=0; i < count; ++i) {
+		if(k.kernel == 0 || msgs[i].size() > 55) {
+			md5Scalar(msgs[i], digests[i]);
+			continue;
+		}
+		idx[n++]=i;
+		if(n == k.lanes) {
+			runKernel(k, msgs, idx, n, digests);
+			n=0;
+		}
+	}
+	if(n == 1)
+		md5Scalar(msgs[idx[0]], digests[idx[0]]);
+	else if(n > 0)
+		runKernel(k, msgs, idx, n, digests);
+}
+
+}
+
+/**
+ * Calculate MD5 digests of messages, using the fastest implementation
+ *
+ * @param msgs messages, each consisting from 2 parts
+ * @param count number of messages
+ * @param digests array of count elements to fill
+ */
+void md5Batch(const UrlVariant* msgs, std::size_t count, Digest* digests) {
+	hashWith(*sBestKernel, msgs, count, digests);
+}
+
+/**
+ * Calculate MD5 digests of messages with given implementation
+ *
+ * @return false, if implementation isn't supported by CPU or build
+ */
+bool md5Batch(Md5Impl impl, const UrlVariant* msgs, std::size_t count, Digest* digests) {
+	const KernelInfo* k=findKernel(impl);
+	if(k == 0)
+		return false;
+	hashWith(*k, msgs, count, digests);
+	return true;
+}
+
+bool md5BatchSupported(Md5Impl impl) {
+	return findKernel(impl) != 0;
+}
+
+const char* md5BatchName(Md5Impl impl) {
+	const KernelInfo* k=impl == Md5Auto ? sBestKernel : findKernel(impl);
+	return k ? k->name : "unsupported";
+}
+
+unsigned int md5BatchLanes(Md5Impl impl) {
+	const KernelInfo* k=impl == Md5Auto ? sBestKernel : findKernel(impl);
+	return k ? k->lanes : 1;
+}
@@ -0,0 +1,33 @@
+/**
+ * @file   md5-batch.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  MD5 of many short messages at once, using SIMD instructions if available
+ *
+ *
+ */
+
+#ifndef _MD5_BATCH_H
+#define _MD5_BATCH_H 1
+
+#include "variants.h"
+
+/**
+ * Implementations of batch hashing.  Md5Auto selects the widest one, supported by CPU
+ */
+enum Md5Impl {
+	Md5Auto,
+	Md5Scalar,
+	Md5Sse2,
+	Md5Avx2,
+	Md5Avx512
+} ;
+
+void md5Batch(const UrlVariant* msgs, std::size_t count, Digest* digests);
+bool md5Batch(Md5Impl impl, const UrlVariant* msgs, std::size_t count, Digest* digests);
+bool md5BatchSupported(Md5Impl impl);
+const char* md5BatchName(Md5Impl impl=Md5Auto);
+/// number of messages, hashed at once by implementation
+unsigned int md5BatchLanes(Md5Impl impl=Md5Auto);
+
+#endif /* _MD5_BATCH_H */
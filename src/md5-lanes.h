@@ -0,0 +1,146 @@
+/**
+ * @file   md5-lanes.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  MD5 of single 64-byte blocks in several SIMD lanes at once
+ *
+ * Kernel is written with GCC vector extensions and instantiated in separate translation
+ * units, compiled for SSE2, AVX2 & AVX-512.  This header should be included only from
+ * them, to not leak code for wide instruction sets into generic code.
+ */
+
+#ifndef _MD5_LANES_H
+#define _MD5_LANES_H 1
+
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+namespace {
+
+/**
+ * Process one prepared block for each lane.  Input words are interleaved: word i of
+ * lane l is stored in words[i*Lanes+l].  Resulting state is stored in the same way:
+ * state[j*Lanes+l] is j-th word of state for lane l.
+ */
+template<typename V, int Lanes>
+struct Md5Lanes {
+	typedef boost::uint32_t uint32;
+
+	static V splat(uint32 x) {
+		V v;
+		for(int n=0; n < Lanes; ++n)
+			v[n]=x;
+		return v;
+	}
+
+	template<int S> static V rotl(V x) {
+		return (x << S) | (x >> (32-S));
+	}
+
+	static V f(V x, V y, V z) { return (x & y) | (~x & z); }
+	static V g(V x, V y, V z) { return (x & z) | (y & ~z); }
+	static V h(V x, V y, V z) { return x ^ y ^ z; }
+	static V i(V x, V y, V z) { return y ^ (x | ~z); }
+
+#define MD5_LANES_STEP(F, a, b, c, d, k, s, t)				\
+	a = b + rotl<s>(a + F(b,c,d) + x[k] + splat(t))
+
+	static void run(const uint32* words, uint32* state) {
+		V x[16];
+		for(int n=0; n < 16; ++n)
+			std::memcpy(&x[n], words+n*Lanes, sizeof(V));
+
+		V a=splat(0x67452301);
+		V b=splat(0xefcdab89);
+		V c=splat(0x98badcfe);
+		V d=splat(0x10325476);
+
+		// round 1
+		MD5_LANES_STEP(f, a, b, c, d,  0,  7, 0xd76aa478);
+		MD5_LANES_STEP(f, d, a, b, c,  1, 12, 0xe8c7b756);
+		MD5_LANES_STEP(f, c, d, a, b,  2, 17, 0x242070db);
+		MD5_LANES_STEP(f, b, c, d, a,  3, 22, 0xc1bdceee);
+		MD5_LANES_STEP(f, a, b, c, d,  4,  7, 0xf57c0faf);
+		MD5_LANES_STEP(f, d, a, b, c,  5, 12, 0x4787c62a);
+		MD5_LANES_STEP(f, c, d, a, b,  6, 17, 0xa8304613);
+		MD5_LANES_STEP(f, b, c, d, a,  7, 22, 0xfd469501);
+		MD5_LANES_STEP(f, a, b, c, d,  8,  7, 0x698098d8);
+		MD5_LANES_STEP(f, d, a, b, c,  9, 12, 0x8b44f7af);
+		MD5_LANES_STEP(f, c, d, a, b, 10, 17, 0xffff5bb1);
+		MD5_LANES_STEP(f, b, c, d, a, 11, 22, 0x895cd7be);
+		MD5_LANES_STEP(f, a, b, c, d, 12,  7, 0x6b901122);
+		MD5_LANES_STEP(f, d, a, b, c, 13, 12, 0xfd987193);
+		MD5_LANES_STEP(f, c, d, a, b, 14, 17, 0xa679438e);
+		MD5_LANES_STEP(f, b, c, d, a, 15, 22, 0x49b40821);
+
+		// round 2
+		MD5_LANES_STEP(g, a, b, c, d,  1,  5, 0xf61e2562);
+		MD5_LANES_STEP(g, d, a, b, c,  6,  9, 0xc040b340);
+		MD5_LANES_STEP(g, c, d, a, b, 11, 14, 0x265e5a51);
+		MD5_LANES_STEP(g, b, c, d, a,  0, 20, 0xe9b6c7aa);
+		MD5_LANES_STEP(g, a, b, c, d,  5,  5, 0xd62f105d);
+		MD5_LANES_STEP(g, d, a, b, c, 10,  9,  0x2441453);
+		MD5_LANES_STEP(g, c, d, a, b, 15, 14, 0xd8a1e681);
+		MD5_LANES_STEP(g, b, c, d, a,  4, 20, 0xe7d3fbc8);
+		MD5_LANES_STEP(g, a, b, c, d,  9,  5, 0x21e1cde6);
+		MD5_LANES_STEP(g, d, a, b, c, 14,  9, 0xc33707d6);
+		MD5_LANES_STEP(g, c, d, a, b,  3, 14, 0xf4d50d87);
+		MD5_LANES_STEP(g, b, c, d, a,  8, 20, 0x455a14ed);
+		MD5_LANES_STEP(g, a, b, c, d, 13,  5, 0xa9e3e905);
+		MD5_LANES_STEP(g, d, a, b, c,  2,  9, 0xfcefa3f8);
+		MD5_LANES_STEP(g, c, d, a, b,  7, 14, 0x676f02d9);
+		MD5_LANES_STEP(g, b, c, d, a, 12, 20, 0x8d2a4c8a);
+
+		// round 3
+		MD5_LANES_STEP(h, a, b, c, d,  5,  4, 0xfffa3942);
+		MD5_LANES_STEP(h, d, a, b, c,  8, 11, 0x8771f681);
+		MD5_LANES_STEP(h, c, d, a, b, 11, 16, 0x6d9d6122);
+		MD5_LANES_STEP(h, b, c, d, a, 14, 23, 0xfde5380c);
+		MD5_LANES_STEP(h, a, b, c, d,  1,  4, 0xa4beea44);
+		MD5_LANES_STEP(h, d, a, b, c,  4, 11, 0x4bdecfa9);
+		MD5_LANES_STEP(h, c, d, a, b,  7, 16, 0xf6bb4b60);
+		MD5_LANES_STEP(h, b, c, d, a, 10, 23, 0xbebfbc70);
+		MD5_LANES_STEP(h, a, b, c, d, 13,  4, 0x289b7ec6);
+		MD5_LANES_STEP(h, d, a, b, c,  0, 11, 0xeaa127fa);
+		MD5_LANES_STEP(h, c, d, a, b,  3, 16, 0xd4ef3085);
+		MD5_LANES_STEP(h, b, c, d, a,  6, 23,  0x4881d05);
+		MD5_LANES_STEP(h, a, b, c, d,  9,  4, 0xd9d4d039);
+		MD5_LANES_STEP(h, d, a, b, c, 12, 11, 0xe6db99e5);
+		MD5_LANES_STEP(h, c, d, a, b, 15, 16, 0x1fa27cf8);
+		MD5_LANES_STEP(h, b, c, d, a,  2, 23, 0xc4ac5665);
+
+		// round 4
+		MD5_LANES_STEP(i, a, b, c, d,  0,  6, 0xf4292244);
+		MD5_LANES_STEP(i, d, a, b, c,  7, 10, 0x432aff97);
+		MD5_LANES_STEP(i, c, d, a, b, 14, 15, 0xab9423a7);
+		MD5_LANES_STEP(i, b, c, d, a,  5, 21, 0xfc93a039);
+		MD5_LANES_STEP(i, a, b, c, d, 12,  6, 0x655b59c3);
+		MD5_LANES_STEP(i, d, a, b, c,  3, 10, 0x8f0ccc92);
+		MD5_LANES_STEP(i, c, d, a, b, 10, 15, 0xffeff47d);
+		MD5_LANES_STEP(i, b, c, d, a,  1, 21, 0x85845dd1);
+		MD5_LANES_STEP(i, a, b, c, d,  8,  6, 0x6fa87e4f);
+		MD5_LANES_STEP(i, d, a, b, c, 15, 10, 0xfe2ce6e0);
+		MD5_LANES_STEP(i, c, d, a, b,  6, 15, 0xa3014314);
+		MD5_LANES_STEP(i, b, c, d, a, 13, 21, 0x4e0811a1);
+		MD5_LANES_STEP(i, a, b, c, d,  4,  6, 0xf7537e82);
+		MD5_LANES_STEP(i, d, a, b, c, 11, 10, 0xbd3af235);
+		MD5_LANES_STEP(i, c, d, a, b,  2, 15, 0x2ad7d2bb);
+		MD5_LANES_STEP(i, b, c, d, a,  9, 21, 0xeb86d391);
+
+		a+=splat(0x67452301);
+		b+=splat(0xefcdab89);
+		c+=splat(0x98badcfe);
+		d+=splat(0x10325476);
+
+		std::memcpy(state, &a, sizeof(V));
+		std::memcpy(state+Lanes, &b, sizeof(V));
+		std::memcpy(state+2*Lanes, &c, sizeof(V));
+		std::memcpy(state+3*Lanes, &d, sizeof(V));
+	}
+
+#undef MD5_LANES_STEP
+} ;
+
+}
+
+#endif /* _MD5_LANES_H */
@@ -0,0 +1,16 @@
+/**
+ * @file   md5-sse2.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  4-lane MD5 kernel, compiled with SSE2 instructions enabled
+ *
+ *
+ */
+
+#include "md5-lanes.h"
+
+typedef boost::uint32_t Md5Vector4 __attribute__((vector_size(16)));
+
+void md5KernelSse2(const boost::uint32_t* words, boost::uint32_t* state) {
+	Md5Lanes<Md5Vector4, 4>::run(words, state);
+}
@@ -76,7 +76,7 @@ void md5::process(const void* vdata, size_type len, bool add)
 
   std::memcpy(padding + bytes_in_buf, data + index, remaining_bytes);
   padding[bytes_in_buf + remaining_bytes] = 0x80;
-  if (remaining_bytes >= 56)
+  if (bytes_in_buf + remaining_bytes >= 56)
   {
     process(ctx_, padding);
     std::memset(padding, 0, 64);
@@ -0,0 +1,45 @@
+/**
+ * @file   probes.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Static tracepoints (USDT) of provider squid_gsb
+ *
+ * Tracepoints are defined by systemtap's sys/sdt.h, if it's available: each of them is
+ * single nop instruction, that is replaced by breakpoint only when tracer (perf, stap,
+ * bpftrace) is attached, so their arguments should be cheap to compute.  Without
+ * sys/sdt.h tracepoints are compiled out.  Names with "__" are shown with "-" by some
+ * tools.
+ *
+ * Tracepoints & their arguments:
+ *  - request__receive (line, size) -- request line is got by redirector
+ *  - request__reply (reply, verdict) -- reply is ready, verdict is number of list or 0
+ *  - reload__start (file) -- changed files of hashes are found
+ *  - reload__finish (file, result) -- reload is finished, result is 1 if data were published
+ *  - snapshot__swap (generation, snapshot) -- new data replace old ones: generation of
+ *    loaded hashes & generation of snapshot
+ *  - update__start (list) -- request for update of list is started
+ *  - update__header (list, major, minor, incremental) -- header of update is parsed
+ *  - update__data (list, size) -- next part of body of update is got
+ *  - update__parsed (list, records, hashes) -- update is applied to list
+ *  - update__finish (list, result) -- update of list is finished
+ *  - update__publish (generation, changes) -- snapshot (changes is 0) or delta is published
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H 1
+
+#ifdef GSB_HAVE_SDT
+#include <sys/sdt.h>
+
+#define GSB_PROBE1(name, a1) DTRACE_PROBE1(squid_gsb, name, a1)
+#define GSB_PROBE2(name, a1, a2) DTRACE_PROBE2(squid_gsb, name, a1, a2)
+#define GSB_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(squid_gsb, name, a1, a2, a3)
+#define GSB_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(squid_gsb, name, a1, a2, a3, a4)
+#else
+#define GSB_PROBE1(name, a1) do { } while(0)
+#define GSB_PROBE2(name, a1, a2) do { } while(0)
+#define GSB_PROBE3(name, a1, a2, a3) do { } while(0)
+#define GSB_PROBE4(name, a1, a2, a3, a4) do { } while(0)
+#endif
+
+#endif /* _PROBES_H */
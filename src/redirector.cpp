@@ -0,0 +1,416 @@
+/**
+ * @file   redirector.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Processing of Squid's request lines & pool of threads for concurrent helper
+ *         protocol
+ *
+ */
+
+#include "redirector.h"
+#include "md5-batch.h"
+#include "probes.h"
+
+#include <iostream>
+#include <csignal>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+namespace {
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t';
+}
+
+/**
+ * Extract next field of line, separated by spaces
+ */
+StringPiece nextField(const char*& p, const char* pEnd) {
+	while(p != pEnd && isSpace(*p))
+		++p;
+	const char* t=p;
+	while(p != pEnd && !isSpace(*p))
+		++p;
+	return StringPiece(t, p-t);
+}
+
+void append(std::string& s, const StringPiece& p) {
+	s.append(p.data, p.size);
+}
+
+const char* sTimerNames[StatTimers]={ "variants", "hashing", "lookup", "request" };
+
+void writeCacheStats(std::ostream& os, const char* name, const VerdictCache* c) {
+	if(!c)
+		return;
+	VerdictCache::Stats st=c->stats();
+	os << name << "_misses " << st.misses << "\n"
+	   << name << "_entries " << st.entries << "\n"
+	   << name << "_memory " << st.memory << "\n";
+}
+
+/// set by SIGUSR1, statistics is written by thread of StatsReporter
+volatile std::sig_atomic_t statsRequested=0;
+
+void requestStats(int) {
+	statsRequested=1;
+}
+
+}
+
+/**
+ * Check URL against all lists.  Results are cached for URL, & for its host, if only root
+ * paths of host are matched.  Only host, found in list with highest priority, answers
+ * without checking of other variants; host, found in other list, doesn't save lookups,
+ * as each probe of index finds all lists at once.  Results aren't cached, if prefixes
+ * couldn't be confirmed
+ */
+Verdict Redirector::check(const StringPiece& url, UrlVariants& uv, StageTimer& timer) const {
+	ThreadStats* ts=timer.threadStats();
+	boost::uint32_t gen=hashes->generation();
+	boost::uint32_t failures=fullHashes ? fullHashes->failures() : 0;
+	Verdict v=VerdictNone;
+	if(urlCache && urlCache->get(url, gen, v)) {
+		if(ts)
+			ts->urlCacheHits.add();
+		return v;
+	}
+
+	StringPiece host=urlHost(url);
+	if(host.data == 0) {
+		if(ts)
+			ts->parseFailures.add();
+		if(runDebug)
+			std::cerr << "Not http protocol: " << url << std::endl;
+		return VerdictNone;
+	}
+	Verdict hv=VerdictNone;
+	bool hostKnown=hostCache && hostCache->get(host, gen, hv);
+	if(hostKnown && hv == 1) {
+		if(ts)
+			ts->hostCacheHits.add();
+		v=hv;
+	} else {
+		HashFile::DataPtr ld=hashes->current();
+		boost::uint32_t mask=0;
+		bool complete=true;
+		if(staged) {
+			complete=checkStaged(*ld, url, uv, mask, timer);
+		} else {
+			timer.mark();
+			generateVariants(url, uv);
+			timer.stage(TimeVariants);
+			hashVariants(uv);
+			timer.stage(TimeHashing);
+			mask=ld->check(uv, false, 0, UrlVariants::MaxVariants, fullHashes);
+			timer.stage(TimeLookup);
+		}
+		if(runDebug) {
+			for(std::size_t i=0; i < uv.count; ++i)
+				std::cerr << "hash for " << uv.variants[i] << " = "
+						  << formatHexDigest(uv.digests[i]) << std::endl;
+		}
+		v=verdictOf(*ld, mask);
+		// root paths of all hosts are needed to know result for host
+		if(hostCache && !hostKnown && complete) {
+			Verdict hv=VerdictNone;
+			if(mask) {
+				timer.mark();
+				hv=verdictOf(*ld, ld->check(uv, true, 0, UrlVariants::MaxVariants, fullHashes));
+				timer.stage(TimeLookup);
+			}
+			if(!fullHashes || fullHashes->failures() == failures)
+				hostCache->put(host, gen, hv);
+		}
+	}
+	if(urlCache && (!fullHashes || fullHashes->failures() == failures))
+		urlCache->put(url, gen, v);
+	return v;
+}
+
+/**
+ * Check variants in batches, that are hashed at once, starting from variants of full
+ * host.  Checking stops as soon as list with highest priority is found, as other
+ * variants couldn't change result.  Misses cost the same as check of all variants
+ *
+ * @param mask mask of lists, found for checked variants
+ *
+ * @return true if all variants were checked
+ */
+bool Redirector::checkStaged(const ListsData& ld, const StringPiece& url, UrlVariants& uv,
+							 boost::uint32_t& mask, StageTimer& timer) const {
+	int bit=lists.empty() ? -1 : ld.bitOf(lists[0].name);
+	boost::uint32_t stop=bit < 0 ? 0 : (boost::uint32_t)1 << bit;
+	std::size_t step=md5BatchLanes();
+	mask=0;
+	timer.mark();
+	generateVariants(url, uv);
+	timer.stage(TimeVariants);
+	for(std::size_t first=0; first < uv.count; first+=step) {
+		hashVariants(uv, first, first+step);
+		timer.stage(TimeHashing);
+		mask|=ld.check(uv, false, first, first+step, fullHashes);
+		timer.stage(TimeLookup);
+		if(mask & stop)
+			return first+step >= uv.count;
+	}
+	return true;
+}
+
+/**
+ * Select list with highest priority from mask of lists
+ */
+Verdict Redirector::verdictOf(const ListsData& ld, boost::uint32_t mask) const {
+	if(mask == 0)
+		return VerdictNone;
+	for(std::size_t i=0; i < lists.size(); ++i) {
+		int bit=ld.bitOf(lists[i].name);
+		if(bit >= 0 && (mask & ((boost::uint32_t)1 << bit)))
+			return i+1;
+	}
+	return VerdictNone;
+}
+
+const std::string* Redirector::verdictURL(Verdict v) const {
+	if(v == VerdictNone || v > lists.size())
+		return 0;
+	return &lists[v-1].url;
+}
+
+void Redirector::process(const StringPiece& line, UrlVariants& uv, std::string& reply,
+						 ThreadStats* ts) const {
+	StageTimer timer(ts);
+	GSB_PROBE2(request__receive, line.data, line.size);
+	reply.clear();
+	const char* p=line.data;
+	const char* pEnd=line.end();
+	StringPiece input(line);
+	if(concurrency) {
+		StringPiece channel=nextField(p, pEnd);
+		append(reply, channel);
+		while(p != pEnd && isSpace(*p))
+			++p;
+		input=StringPiece(p, pEnd-p);
+	}
+	// URL is the first field of request line
+	StringPiece url=nextField(p, pEnd);
+
+	const std::string* newURL=0;
+	Verdict v=VerdictNone;
+	if(url.empty()) {
+		if(ts)
+			ts->parseFailures.add();
+	} else if(hashes && hashes->loaded()) {
+		v=check(url, uv, timer);
+		newURL=verdictURL(v);
+		if(ts && newURL)
+			ts->hits[v-1].add();
+	}
+	if(ts)
+		ts->requests.add();
+
+	if(okErr) {
+		if(concurrency)
+			reply+=' ';
+		if(newURL) {
+			reply+="OK rewrite-url=";
+			reply+=*newURL;
+		} else {
+			reply+="ERR";
+		}
+	} else if(newURL) {
+		if(concurrency)
+			reply+=' ';
+		reply+=*newURL;
+		// copy other fields, separated by single space
+		StringPiece f;
+		while(!(f=nextField(p, pEnd)).empty()) {
+			reply+=' ';
+			append(reply, f);
+		}
+	} else if(!emitEmpty && !input.empty()) {
+		if(concurrency)
+			reply+=' ';
+		append(reply, input);
+	}
+	GSB_PROBE2(request__reply, reply.c_str(), v);
+}
+
+void Redirector::writeStats(std::ostream& os) const {
+	StatsSummary s;
+	if(stats)
+		stats->summary(s);
+	os << "pid " << ::getpid() << "\n"
+	   << "uptime " << (StatValue)s.uptime << "\n"
+	   << "requests " << s.requests << "\n"
+	   << "parse_failures " << s.parseFailures << "\n";
+	for(std::size_t i=0; i < lists.size() && i < MaxLists; ++i)
+		os << "hits." << lists[i].name << " " << s.hits[i] << "\n";
+	for(int t=0; t < StatTimers; ++t) {
+		const HistogramData& h=s.times[t];
+		os << "time." << sTimerNames[t] << ".count " << h.count << "\n"
+		   << "time." << sTimerNames[t] << ".mean_ns " << h.mean() << "\n"
+		   << "time." << sTimerNames[t] << ".p50_ns " << h.percentile(0.5) << "\n"
+		   << "time." << sTimerNames[t] << ".p99_ns " << h.percentile(0.99) << "\n"
+		   << "time." << sTimerNames[t] << ".p999_ns " << h.percentile(0.999) << "\n";
+	}
+	os << "url_cache_hits " << s.urlCacheHits << "\n";
+	writeCacheStats(os, "url_cache", urlCache);
+	os << "host_cache_hits " << s.hostCacheHits << "\n";
+	writeCacheStats(os, "host_cache", hostCache);
+	if(fullHashes)
+		os << "fullhash_failures " << fullHashes->failures() << "\n";
+	if(hashes) {
+		os << "reloads " << hashes->reloads.get() << "\n"
+		   << "reload_failures " << hashes->reloadFailures.get() << "\n";
+		HashFile::DataPtr ld=hashes->current();
+		if(ld) {
+			os << "snapshot_generation " << ld->generation << "\n"
+			   << "index_entries " << ld->hashes.size() + ld->prefixes.size() << "\n"
+			   << "overlay_entries " << ld->overlay.size() << "\n"
+			   << "index_memory " << ld->memoryUsage() << "\n";
+			for(std::size_t i=0; i < ld->lists.size(); ++i)
+				os << "version." << ld->lists[i].name << " " << ld->lists[i].majorVersion << "."
+				   << ld->lists[i].minorVersion << "\n";
+		}
+	}
+	os.flush();
+}
+
+WorkerPool::WorkerPool(const Redirector& r, unsigned int n, ReplyWriter& o)
+	: redirector(r), out(o), slots(n*16), head(0), pending(0), busy(0), done(false) {
+	for(unsigned int i=0; i < n; ++i)
+		threads.create_thread(boost::bind(&WorkerPool::run, this));
+}
+
+WorkerPool::~WorkerPool() {
+	finish();
+}
+
+void WorkerPool::submit(std::string& line) {
+	boost::mutex::scoped_lock lock(queueMutex);
+	while(pending == slots.size())
+		notFull.wait(lock);
+	slots[(head+pending) % slots.size()].swap(line);
+	++pending;
+	notEmpty.notify_one();
+}
+
+void WorkerPool::finish() {
+	{
+		boost::mutex::scoped_lock lock(queueMutex);
+		if(done)
+			return;
+		done=true;
+		notEmpty.notify_all();
+	}
+	threads.join_all();
+}
+
+void WorkerPool::run() {
+	std::string line, reply;
+	UrlVariants uv;
+	ThreadStats* ts=redirector.stats ? redirector.stats->addThread() : 0;
+	while(true) {
+		{
+			boost::mutex::scoped_lock lock(queueMutex);
+			while(pending == 0 && !done)
+				notEmpty.wait(lock);
+			if(pending == 0)
+				return;
+			slots[head].swap(line);
+			head=(head+1) % slots.size();
+			--pending;
+			++busy;
+			notFull.notify_one();
+		}
+		redirector.process(StringPiece(line), uv, reply, ts);
+		boost::mutex::scoped_lock lock(outMutex);
+		out.add(reply);
+		bool idle;
+		{
+			boost::mutex::scoped_lock qlock(queueMutex);
+			--busy;
+			idle=pending == 0 && busy == 0;
+		}
+		// last thread flushes replies, when there are no more lines to process
+		if(idle || out.due())
+			out.flush();
+	}
+}
+
+StatsReporter::StatsReporter(const Redirector& r, const fs::path& f, unsigned int i)
+	: redirector(r), fname(f), interval(i) {
+}
+
+StatsReporter::~StatsReporter() {
+	stop();
+}
+
+void StatsReporter::start() {
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=requestStats;
+	sa.sa_flags=SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	::sigaction(SIGUSR1, &sa, 0);
+	thread.reset(new boost::thread(boost::bind(&StatsReporter::run, this)));
+}
+
+void StatsReporter::stop() {
+	if(!thread)
+		return;
+	thread->interrupt();
+	thread->join();
+	thread.reset();
+}
+
+/**
+ * File is written under temporary name & renamed, so readers never see partial
+ * statistics
+ */
+bool StatsReporter::write() const {
+	if(fname.empty()) {
+		redirector.writeStats(std::cerr);
+		return std::cerr;
+	}
+	fs::path tname=pathString(fname) + ".tmp";
+	try {
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::trunc);
+		redirector.writeStats(ofs);
+		ofs.close();
+		if(!ofs) {
+			fs::remove(tname);
+			return false;
+		}
+		fs::rename(tname, fname);
+	} catch(std::exception& x) {
+		if(runDebug)
+			std::cerr << "Can't write statistics: " << x.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Signal only sets flag, that is checked every second, so statistics is written outside
+ * of signal handler
+ */
+void StatsReporter::run() {
+	unsigned int elapsed=0;
+	try {
+		while(true) {
+			boost::this_thread::sleep(boost::posix_time::seconds(1));
+			++elapsed;
+			if(redirector.fullHashes)
+				redirector.fullHashes->flush();
+			if(statsRequested || (interval && elapsed >= interval)) {
+				statsRequested=0;
+				elapsed=0;
+				if(!write() && runDebug)
+					std::cerr << "Can't write statistics to " << fname << std::endl;
+			}
+		}
+	} catch(boost::thread_interrupted&) {
+	}
+}
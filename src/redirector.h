@@ -0,0 +1,149 @@
+/**
+ * @file   redirector.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Processing of Squid's request lines & pool of threads for concurrent helper
+ *         protocol
+ *
+ */
+
+#ifndef _REDIRECTOR_H
+#define _REDIRECTOR_H 1
+
+#include "hashfile.h"
+#include "lineio.h"
+#include "verdictcache.h"
+#include "stats.h"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * Check of request lines against hashes
+ */
+struct Redirector {
+	HashFile* hashes;
+	/// lists in order of priority, each with URL to redirect to
+	ListConfigs lists;
+	/// output empty line if URL isn't rewritten (Squid 2 style)
+	bool emitEmpty;
+	/// reply in Squid 3.4+ style: "OK rewrite-url=..." or "ERR"
+	bool okErr;
+	/// request lines are prefixed with channel-ID
+	bool concurrency;
+	/// check variants in batches & stop on match in list with highest priority
+	bool staged;
+	/// optional caches of results for URLs & for root paths of hosts
+	VerdictCache* urlCache;
+	VerdictCache* hostCache;
+	/// confirmation of matches, if hashes keep only prefixes of digests
+	FullHashSource* fullHashes;
+	/// optional statistics of processing
+	RedirectorStats* stats;
+
+	Redirector() : hashes(0), emitEmpty(false), okErr(false), concurrency(false),
+				   staged(false), urlCache(0), hostCache(0), fullHashes(0), stats(0) { }
+
+	/**
+	 * Process one request line
+	 *
+	 * @param line request line, without trailing newline
+	 * @param uv buffer for variants of URL, should be separate for each thread
+	 * @param reply reply to fill, without trailing newline
+	 * @param ts statistics of calling thread, from stats
+	 */
+	void process(const StringPiece& line, UrlVariants& uv, std::string& reply,
+				 ThreadStats* ts=0) const;
+
+	/**
+	 * Write statistics as lines "name value": counters & latencies of requests, state
+	 * of caches & of loaded hashes
+	 */
+	void writeStats(std::ostream& os) const;
+
+private:
+	Verdict check(const StringPiece& url, UrlVariants& uv, StageTimer& timer) const;
+	bool checkStaged(const ListsData& ld, const StringPiece& url, UrlVariants& uv,
+					 boost::uint32_t& mask, StageTimer& timer) const;
+	Verdict verdictOf(const ListsData& ld, boost::uint32_t mask) const;
+	const std::string* verdictURL(Verdict v) const;
+} ;
+
+/**
+ * Pool of threads, that process request lines concurrently & write replies as soon as
+ * they are ready.  Replies are reordered, so it's used only with channel-ID protocol.
+ * Replies are gathered & flushed when queue of lines is drained
+ */
+class WorkerPool {
+public:
+	/**
+	 * @param r redirector to process lines
+	 * @param threads number of threads
+	 * @param out writer for replies
+	 */
+	WorkerPool(const Redirector& r, unsigned int threads, ReplyWriter& out);
+	~WorkerPool();
+
+	/**
+	 * Queue line for processing.  Line is swapped with free buffer, so no memory is
+	 * allocated in steady state
+	 */
+	void submit(std::string& line);
+
+	/// wait for processing of all queued lines & stop threads
+	void finish();
+
+private:
+	void run();
+
+	const Redirector& redirector;
+	ReplyWriter& out;
+	/// should be locked before queueMutex, if both are needed
+	boost::mutex outMutex;
+
+	/// ring of line buffers
+	std::vector<std::string> slots;
+	std::size_t head;
+	std::size_t pending;
+	/// number of lines, that are processed now
+	std::size_t busy;
+	bool done;
+	boost::mutex queueMutex;
+	boost::condition_variable notEmpty;
+	boost::condition_variable notFull;
+
+	boost::thread_group threads;
+} ;
+
+/**
+ * Background thread, that writes statistics of redirector on SIGUSR1 & periodically.
+ * Statistics is written to file (replaced atomically), or to stderr.  Thread also flushes
+ * cache of full hashes, so requests don't wait for its saving
+ */
+class StatsReporter {
+public:
+	/**
+	 * @param r redirector with statistics
+	 * @param fname file for statistics, stderr is used if it's empty
+	 * @param interval period of writing, in seconds, 0 to write only on signal
+	 */
+	StatsReporter(const Redirector& r, const fs::path& fname, unsigned int interval);
+	~StatsReporter();
+
+	/// install handler of SIGUSR1 & start thread
+	void start();
+	void stop();
+
+	/// write statistics now
+	bool write() const;
+
+private:
+	void run();
+
+	const Redirector& redirector;
+	fs::path fname;
+	unsigned int interval;
+	boost::shared_ptr<boost::thread> thread;
+} ;
+
+#endif /* _REDIRECTOR_H */
@@ -0,0 +1,438 @@
+/**
+ * @file   snapshot.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary snapshots of hashes, that are memory-mapped by redirectors
+ *
+ *
+ */
+
+#include "snapshot.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace bip=boost::interprocess;
+
+namespace {
+
+const char sMagic[8]={ 'G', 'S', 'B', 'S', 'N', 'A', 'P', 0 };
+const boost::uint32_t sByteOrder=0x01020304;
+const boost::uint32_t sFormatVersion=6;
+const char sDeltaMagic[8]={ 'G', 'S', 'B', 'D', 'E', 'L', 'T', 0 };
+const boost::uint32_t sDeltaFormatVersion=1;
+
+inline boost::uint64_t alignOffset(boost::uint64_t off) {
+	return (off + 63) & ~(boost::uint64_t)63;
+}
+
+inline boost::uint64_t bucketTableSize(unsigned int bits) {
+	return (((boost::uint64_t)1 << bits) + 1)*sizeof(boost::uint32_t);
+}
+
+inline boost::uint64_t filterSize(boost::uint64_t blocks) {
+	return blocks*DigestIndex::FilterBlockWords*sizeof(boost::uint64_t);
+}
+
+void writePadding(std::ostream& os, boost::uint64_t from, boost::uint64_t to) {
+	static const char zeros[64]={ 0 };
+	os.write(zeros, to-from);
+}
+
+void fillLists(const std::vector<ListInfo>& from, std::vector<SnapshotList>& to) {
+	to.resize(from.size());
+	for(std::size_t i=0; i < from.size(); ++i) {
+		std::memset(&to[i], 0, sizeof(SnapshotList));
+		std::strncpy(to[i].name, from[i].name.c_str(), sizeof(to[i].name)-1);
+		to[i].majorVersion=from[i].majorVersion;
+		to[i].minorVersion=from[i].minorVersion;
+	}
+}
+
+void readLists(const SnapshotList* from, std::size_t n, std::vector<ListInfo>& to) {
+	to.resize(n);
+	for(std::size_t i=0; i < n; ++i) {
+		to[i].name.assign(from[i].name, strnlen(from[i].name, sizeof(from[i].name)));
+		to[i].majorVersion=from[i].majorVersion;
+		to[i].minorVersion=from[i].minorVersion;
+	}
+}
+
+inline boost::uint32_t maskAt(const DigestIndex& idx, std::size_t i) {
+	return idx.maskTable() ? idx.maskTable()[i] : 1;
+}
+
+}
+
+/**
+ * Write snapshot of lists.  File is written under temporary name & renamed, so readers
+ * always see complete file
+ *
+ * @param fname name of snapshot
+ * @param ld lists to write
+ *
+ * @return true on success
+ */
+bool writeSnapshot(const fs::path& fname, const ListsData& ld) {
+	const boost::uint32_t emptyBuckets[2]={ 0, 0 };
+	const boost::uint32_t* buckets;
+	unsigned int bits;
+	const char* entries;
+	std::size_t count, entrySize;
+	const boost::uint32_t* masks;
+	if(ld.prefixOnly) {
+		buckets=ld.prefixes.bucketTable();
+		bits=ld.prefixes.bucketBits();
+		entries=reinterpret_cast<const char*>(ld.prefixes.begin());
+		count=ld.prefixes.size();
+		entrySize=sizeof(boost::uint32_t);
+		masks=ld.prefixes.maskTable();
+	} else {
+		buckets=ld.hashes.bucketTable();
+		bits=ld.hashes.bucketBits();
+		entries=reinterpret_cast<const char*>(ld.hashes.begin());
+		count=ld.hashes.size();
+		entrySize=sizeof(Digest);
+		masks=ld.hashes.maskTable();
+	}
+	if(buckets == 0) {
+		buckets=emptyBuckets;
+		bits=0;
+	}
+	if(count && masks == 0)
+		return false;
+
+	std::vector<SnapshotList> lists;
+	fillLists(ld.lists, lists);
+
+	SnapshotHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, sMagic, sizeof(sMagic));
+	hdr.byteOrder=sByteOrder;
+	hdr.formatVersion=sFormatVersion;
+	hdr.listCount=lists.size();
+	hdr.count=count;
+	hdr.bucketBits=bits;
+	hdr.entrySize=entrySize;
+	hdr.generation=ld.generation;
+	hdr.listsOffset=alignOffset(sizeof(hdr));
+	hdr.bucketsOffset=alignOffset(hdr.listsOffset + lists.size()*sizeof(SnapshotList));
+	hdr.digestsOffset=alignOffset(hdr.bucketsOffset + bucketTableSize(bits));
+	hdr.masksOffset=alignOffset(hdr.digestsOffset + hdr.count*entrySize);
+	hdr.filterOffset=alignOffset(hdr.masksOffset + hdr.count*sizeof(boost::uint32_t));
+	hdr.filterBlocks=ld.prefixOnly ? 0 : ld.hashes.filterSize();
+	hdr.compressedOffset=alignOffset(hdr.filterOffset + filterSize(hdr.filterBlocks));
+	std::vector<SnapshotRice> rices;
+	boost::uint64_t end=hdr.compressedOffset;
+	for(std::size_t i=0; i < ld.compressed.size(); ++i) {
+		if(!(ld.compressedMask & ((boost::uint32_t)1 << i)))
+			continue;
+		const RiceIndex& ri=ld.compressed[i];
+		SnapshotRice sr;
+		std::memset(&sr, 0, sizeof(sr));
+		sr.list=i;
+		sr.parameter=ri.parameter();
+		sr.count=ri.size();
+		sr.blocks=ri.blockCount();
+		sr.words=ri.wordCount();
+		rices.push_back(sr);
+	}
+	hdr.compressedCount=rices.size();
+	end+=rices.size()*sizeof(SnapshotRice);
+	for(std::size_t i=0; i < rices.size(); ++i) {
+		rices[i].firstsOffset=alignOffset(end);
+		rices[i].offsetsOffset=alignOffset(rices[i].firstsOffset +
+										   rices[i].blocks*sizeof(boost::uint32_t));
+		rices[i].bitsOffset=alignOffset(rices[i].offsetsOffset +
+										rices[i].blocks*sizeof(boost::uint32_t));
+		end=rices[i].bitsOffset + rices[i].words*sizeof(boost::uint64_t);
+	}
+	hdr.fileSize=end;
+
+	fs::path tname=tempPath(fname);
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary | std::ios::trunc);
+		if(!ofs)
+			return false;
+		ofs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		writePadding(ofs, sizeof(hdr), hdr.listsOffset);
+		if(!lists.empty())
+			ofs.write(reinterpret_cast<const char*>(&lists[0]), lists.size()*sizeof(SnapshotList));
+		writePadding(ofs, hdr.listsOffset + lists.size()*sizeof(SnapshotList), hdr.bucketsOffset);
+		ofs.write(reinterpret_cast<const char*>(buckets), bucketTableSize(bits));
+		writePadding(ofs, hdr.bucketsOffset + bucketTableSize(bits), hdr.digestsOffset);
+		if(hdr.count)
+			ofs.write(entries, hdr.count*entrySize);
+		writePadding(ofs, hdr.digestsOffset + hdr.count*entrySize, hdr.masksOffset);
+		if(hdr.count)
+			ofs.write(reinterpret_cast<const char*>(masks), hdr.count*sizeof(boost::uint32_t));
+		writePadding(ofs, hdr.masksOffset + hdr.count*sizeof(boost::uint32_t), hdr.filterOffset);
+		if(hdr.filterBlocks)
+			ofs.write(reinterpret_cast<const char*>(ld.hashes.filterTable()),
+					  filterSize(hdr.filterBlocks));
+		writePadding(ofs, hdr.filterOffset + filterSize(hdr.filterBlocks), hdr.compressedOffset);
+		boost::uint64_t pos=hdr.compressedOffset + rices.size()*sizeof(SnapshotRice);
+		if(!rices.empty())
+			ofs.write(reinterpret_cast<const char*>(&rices[0]), rices.size()*sizeof(SnapshotRice));
+		for(std::size_t i=0; i < rices.size(); ++i) {
+			const RiceIndex& ri=ld.compressed[rices[i].list];
+			writePadding(ofs, pos, rices[i].firstsOffset);
+			ofs.write(reinterpret_cast<const char*>(ri.firstTable()),
+					  rices[i].blocks*sizeof(boost::uint32_t));
+			pos=rices[i].firstsOffset + rices[i].blocks*sizeof(boost::uint32_t);
+			writePadding(ofs, pos, rices[i].offsetsOffset);
+			ofs.write(reinterpret_cast<const char*>(ri.offsetTable()),
+					  rices[i].blocks*sizeof(boost::uint32_t));
+			pos=rices[i].offsetsOffset + rices[i].blocks*sizeof(boost::uint32_t);
+			writePadding(ofs, pos, rices[i].bitsOffset);
+			ofs.write(reinterpret_cast<const char*>(ri.bitTable()),
+					  rices[i].words*sizeof(boost::uint64_t));
+			pos=rices[i].bitsOffset + rices[i].words*sizeof(boost::uint64_t);
+		}
+		ofs.close();
+		if(!ofs) {
+			fs::remove(tname);
+			return false;
+		}
+	}
+	// rename replaces snapshot atomically, while old file stays mapped by readers
+	fs::rename(tname, fname);
+	return true;
+}
+
+/**
+ * Map snapshot into memory & use it as data of lists
+ *
+ * @param fname name of snapshot
+ * @param ld lists to fill, their index will point into mapped file
+ *
+ * @return false if file couldn't be mapped or has wrong format
+ */
+bool mapSnapshot(const fs::path& fname, ListsData& ld) {
+	boost::shared_ptr<bip::mapped_region> region;
+	try {
+		bip::file_mapping fm(pathString(fname).c_str(), bip::read_only);
+		region.reset(new bip::mapped_region(fm, bip::read_only));
+	} catch(std::exception&) {
+		return false;
+	}
+
+	const char* base=static_cast<const char*>(region->get_address());
+	boost::uint64_t size=region->get_size();
+	if(size < sizeof(SnapshotHeader))
+		return false;
+	const SnapshotHeader& hdr=*reinterpret_cast<const SnapshotHeader*>(base);
+	if(std::memcmp(hdr.magic, sMagic, sizeof(sMagic)) != 0 || hdr.byteOrder != sByteOrder ||
+	   hdr.formatVersion != sFormatVersion || hdr.fileSize != size || hdr.bucketBits > 24 ||
+	   hdr.listCount > MaxLists ||
+	   (hdr.entrySize != sizeof(Digest) && hdr.entrySize != sizeof(boost::uint32_t)) ||
+	   (hdr.entrySize != sizeof(Digest) && hdr.filterBlocks) ||
+	   hdr.listsOffset + hdr.listCount*sizeof(SnapshotList) > size ||
+	   hdr.bucketsOffset % sizeof(boost::uint32_t) != 0 ||
+	   hdr.bucketsOffset + bucketTableSize(hdr.bucketBits) > size ||
+	   hdr.digestsOffset % sizeof(boost::uint32_t) != 0 ||
+	   hdr.digestsOffset + hdr.count*hdr.entrySize > size ||
+	   hdr.masksOffset % sizeof(boost::uint32_t) != 0 ||
+	   hdr.masksOffset + hdr.count*sizeof(boost::uint32_t) > size ||
+	   hdr.filterOffset % sizeof(boost::uint64_t) != 0 ||
+	   hdr.filterOffset + filterSize(hdr.filterBlocks) > size ||
+	   hdr.compressedCount > hdr.listCount || hdr.compressedOffset % sizeof(boost::uint64_t) != 0 ||
+	   hdr.compressedOffset + hdr.compressedCount*sizeof(SnapshotRice) > size)
+		return false;
+
+	const boost::uint32_t* buckets=
+		reinterpret_cast<const boost::uint32_t*>(base + hdr.bucketsOffset);
+	// lookup doesn't check ranges of buckets, so they must be ordered & within digests
+	const std::size_t bucketCount=(std::size_t)1 << hdr.bucketBits;
+	if(buckets[bucketCount] != hdr.count)
+		return false;
+	for(std::size_t i=0; i < bucketCount; ++i) {
+		if(buckets[i] > buckets[i+1])
+			return false;
+	}
+	region->advise(bip::mapped_region::advice_random);
+
+	readLists(reinterpret_cast<const SnapshotList*>(base + hdr.listsOffset), hdr.listCount,
+			  ld.lists);
+	ld.generation=hdr.generation;
+	ld.overlay.clear();
+	const boost::uint32_t* masks=reinterpret_cast<const boost::uint32_t*>(base + hdr.masksOffset);
+	ld.prefixOnly=hdr.entrySize != sizeof(Digest);
+	if(ld.prefixOnly) {
+		ld.hashes.clear();
+		ld.prefixes.attach(region,
+						   reinterpret_cast<const boost::uint32_t*>(base + hdr.digestsOffset),
+						   hdr.count, buckets, hdr.bucketBits, masks);
+	} else {
+		ld.prefixes.clear();
+		ld.hashes.attach(region, reinterpret_cast<const Digest*>(base + hdr.digestsOffset),
+						 hdr.count, buckets, hdr.bucketBits, masks,
+						 reinterpret_cast<const boost::uint64_t*>(base + hdr.filterOffset),
+						 hdr.filterBlocks);
+	}
+	ld.compressed.clear();
+	ld.compressedMask=0;
+	const SnapshotRice* rices=reinterpret_cast<const SnapshotRice*>(base + hdr.compressedOffset);
+	for(std::size_t i=0; i < hdr.compressedCount; ++i) {
+		const SnapshotRice& sr=rices[i];
+		if(sr.list >= hdr.listCount || (ld.compressedMask & ((boost::uint32_t)1 << sr.list)) ||
+		   sr.blocks > size || sr.words > size ||
+		   sr.firstsOffset % sizeof(boost::uint32_t) != 0 ||
+		   sr.firstsOffset + sr.blocks*sizeof(boost::uint32_t) > size ||
+		   sr.offsetsOffset % sizeof(boost::uint32_t) != 0 ||
+		   sr.offsetsOffset + sr.blocks*sizeof(boost::uint32_t) > size ||
+		   sr.bitsOffset % sizeof(boost::uint64_t) != 0 ||
+		   sr.bitsOffset + sr.words*sizeof(boost::uint64_t) > size)
+			return false;
+		if(ld.compressed.size() <= sr.list)
+			ld.compressed.resize(sr.list+1);
+		RiceIndex& ri=ld.compressed[sr.list];
+		ri.attach(region, reinterpret_cast<const boost::uint32_t*>(base + sr.firstsOffset),
+				  reinterpret_cast<const boost::uint32_t*>(base + sr.offsetsOffset), sr.blocks,
+				  reinterpret_cast<const boost::uint64_t*>(base + sr.bitsOffset), sr.words,
+				  sr.count, sr.parameter);
+		if(!ri.valid())
+			return false;
+		ld.compressedMask|=(boost::uint32_t)1 << sr.list;
+	}
+	return true;
+}
+
+fs::path deltaPath(const fs::path& snapshot) {
+	return pathString(snapshot) + ".delta";
+}
+
+/**
+ * Changed digests are found by merge of both indexes, so delta has only digests, which
+ * masks differ from masks in snapshot.  Snapshots of prefixes & snapshots with compressed
+ * lists are always written whole
+ */
+bool makeDelta(const ListsData& base, const ListsData& current, SnapshotDelta& delta) {
+	if(base.lists.size() != current.lists.size() || base.prefixOnly || current.prefixOnly ||
+	   base.compressedMask || current.compressedMask)
+		return false;
+	for(std::size_t i=0; i < base.lists.size(); ++i) {
+		if(base.lists[i].name != current.lists[i].name)
+			return false;
+	}
+	delta.base=base.generation;
+	delta.lists=current.lists;
+	delta.digests.clear();
+	delta.masks.clear();
+	const DigestIndex& b=base.hashes;
+	const DigestIndex& c=current.hashes;
+	std::size_t i=0, j=0;
+	while(i < b.size() || j < c.size()) {
+		if(j == c.size() || (i < b.size() && b.begin()[i] < c.begin()[j])) {
+			delta.digests.push_back(b.begin()[i++]);
+			delta.masks.push_back(0);
+		} else if(i == b.size() || c.begin()[j] < b.begin()[i]) {
+			delta.digests.push_back(c.begin()[j]);
+			delta.masks.push_back(maskAt(c, j++));
+		} else {
+			if(maskAt(b, i) != maskAt(c, j)) {
+				delta.digests.push_back(c.begin()[j]);
+				delta.masks.push_back(maskAt(c, j));
+			}
+			++i;
+			++j;
+		}
+	}
+	return true;
+}
+
+/**
+ * Write delta file.  Like snapshot, it's written under temporary name & renamed
+ */
+bool writeDelta(const fs::path& fname, const SnapshotDelta& delta) {
+	std::vector<SnapshotList> lists;
+	fillLists(delta.lists, lists);
+
+	DeltaHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, sDeltaMagic, sizeof(sDeltaMagic));
+	hdr.byteOrder=sByteOrder;
+	hdr.formatVersion=sDeltaFormatVersion;
+	hdr.listCount=lists.size();
+	hdr.base=delta.base;
+	hdr.count=delta.digests.size();
+	hdr.fileSize=sizeof(hdr) + lists.size()*sizeof(SnapshotList) +
+		hdr.count*(sizeof(Digest) + sizeof(boost::uint32_t));
+
+	fs::path tname=tempPath(fname);
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary | std::ios::trunc);
+		if(!ofs)
+			return false;
+		ofs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		if(!lists.empty())
+			ofs.write(reinterpret_cast<const char*>(&lists[0]), lists.size()*sizeof(SnapshotList));
+		if(hdr.count) {
+			ofs.write(reinterpret_cast<const char*>(&delta.digests[0]), hdr.count*sizeof(Digest));
+			ofs.write(reinterpret_cast<const char*>(&delta.masks[0]),
+					  hdr.count*sizeof(boost::uint32_t));
+		}
+		ofs.close();
+		if(!ofs) {
+			fs::remove(tname);
+			return false;
+		}
+	}
+	fs::rename(tname, fname);
+	return true;
+}
+
+/**
+ * Read delta file
+ *
+ * @return false if file doesn't exist or has wrong format
+ */
+bool readDelta(const fs::path& fname, SnapshotDelta& delta) {
+	std::ifstream ifs(pathString(fname).c_str(), std::ios::binary);
+	DeltaHeader hdr;
+	if(!ifs || !ifs.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)))
+		return false;
+	ifs.seekg(0, std::ios::end);
+	boost::uint64_t size=ifs.tellg();
+	ifs.seekg(sizeof(hdr));
+	if(std::memcmp(hdr.magic, sDeltaMagic, sizeof(sDeltaMagic)) != 0 ||
+	   hdr.byteOrder != sByteOrder || hdr.formatVersion != sDeltaFormatVersion ||
+	   hdr.listCount > MaxLists || hdr.fileSize != size || hdr.count > size/sizeof(Digest) ||
+	   hdr.fileSize != sizeof(hdr) + hdr.listCount*sizeof(SnapshotList) +
+	   hdr.count*(sizeof(Digest) + sizeof(boost::uint32_t)))
+		return false;
+
+	std::vector<SnapshotList> lists(hdr.listCount);
+	delta.digests.resize(hdr.count);
+	delta.masks.resize(hdr.count);
+	if(hdr.listCount &&
+	   !ifs.read(reinterpret_cast<char*>(&lists[0]), hdr.listCount*sizeof(SnapshotList)))
+		return false;
+	if(hdr.count &&
+	   (!ifs.read(reinterpret_cast<char*>(&delta.digests[0]), hdr.count*sizeof(Digest)) ||
+		!ifs.read(reinterpret_cast<char*>(&delta.masks[0]), hdr.count*sizeof(boost::uint32_t))))
+		return false;
+	// overlay is searched by binary search
+	for(std::size_t i=1; i < delta.digests.size(); ++i) {
+		if(!(delta.digests[i-1] < delta.digests[i]))
+			return false;
+	}
+	readLists(lists.empty() ? 0 : &lists[0], lists.size(), delta.lists);
+	delta.base=hdr.base;
+	return true;
+}
+
+/**
+ * Overlay gets its own Bloom filter, so misses don't touch it, like base index.  Bits of
+ * masks are indexes of lists, so delta must have the same lists, as snapshot
+ */
+bool applyDelta(SnapshotDelta& delta, ListsData& ld) {
+	if(delta.lists.size() != ld.lists.size())
+		return false;
+	for(std::size_t i=0; i < ld.lists.size(); ++i) {
+		if(delta.lists[i].name != ld.lists[i].name)
+			return false;
+	}
+	ld.lists=delta.lists;
+	ld.overlay.assign(delta.digests, &delta.masks, true);
+	return true;
+}
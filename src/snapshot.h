@@ -0,0 +1,131 @@
+/**
+ * @file   snapshot.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Binary snapshots of hashes, that are memory-mapped by redirectors
+ *
+ * Snapshot is immutable file, published by updater.  It contains ready to use combined
+ * index of all lists (table of lists, table of buckets, sorted digests or their 32-bit
+ * prefixes, their masks of lists & Bloom filter, followed by compressed lists), addressed
+ * by offsets from start of file, so all redirector's processes could map it read-only and
+ * share the same physical pages.
+ *
+ * Updates are published as delta file next to snapshot: it holds all changes since
+ * snapshot (digests with their new masks of lists), so redirectors read only delta &
+ * keep mapped snapshot.  When delta grows, updater compacts it into new snapshot.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H 1
+
+#include "lists.h"
+
+/**
+ * Header of snapshot file.  All numbers are in native byte order, that is checked with
+ * byteOrder field
+ */
+struct SnapshotHeader {
+	char magic[8];
+	boost::uint32_t byteOrder;
+	boost::uint32_t formatVersion;
+	boost::uint32_t listCount;
+	boost::uint32_t bucketBits;
+	/// size of entry: 16 for digests, or 4 for their prefixes
+	boost::uint32_t entrySize;
+	/// number of lists, kept as compressed prefixes
+	boost::uint32_t compressedCount;
+	/// identifies snapshot for its deltas
+	boost::uint64_t generation;
+	boost::uint64_t count;
+	boost::uint64_t listsOffset;
+	boost::uint64_t bucketsOffset;
+	boost::uint64_t digestsOffset;
+	boost::uint64_t masksOffset;
+	boost::uint64_t filterOffset;
+	/// number of filter's blocks, 0 if there is no filter
+	boost::uint64_t filterBlocks;
+	/// table of compressed lists
+	boost::uint64_t compressedOffset;
+	boost::uint64_t fileSize;
+} ;
+
+/**
+ * Entry of table of compressed lists, that points to data of RiceIndex
+ */
+struct SnapshotRice {
+	/// bit of list
+	boost::uint32_t list;
+	/// parameter of Rice code
+	boost::uint32_t parameter;
+	boost::uint64_t count;
+	boost::uint64_t blocks;
+	/// number of 64-bit words of encoded differences
+	boost::uint64_t words;
+	boost::uint64_t firstsOffset;
+	boost::uint64_t offsetsOffset;
+	boost::uint64_t bitsOffset;
+} ;
+
+/**
+ * Entry of table of lists
+ */
+struct SnapshotList {
+	char name[64];
+	boost::int32_t majorVersion;
+	boost::int32_t minorVersion;
+} ;
+
+/**
+ * Header of delta file, followed by table of lists, sorted digests & their masks
+ */
+struct DeltaHeader {
+	char magic[8];
+	boost::uint32_t byteOrder;
+	boost::uint32_t formatVersion;
+	boost::uint32_t listCount;
+	boost::uint32_t reserved;
+	/// generation of snapshot, to which delta is applied
+	boost::uint64_t base;
+	boost::uint64_t count;
+	boost::uint64_t fileSize;
+} ;
+
+/**
+ * Changes of lists since snapshot
+ */
+struct SnapshotDelta {
+	boost::uint64_t base;
+	/// current versions of lists
+	std::vector<ListInfo> lists;
+	/// changed digests, sorted
+	DigestVector digests;
+	/// new masks of digests, 0 for removed digests
+	std::vector<boost::uint32_t> masks;
+
+	SnapshotDelta() : base(0) { }
+} ;
+
+bool writeSnapshot(const fs::path& fname, const ListsData& ld);
+bool mapSnapshot(const fs::path& fname, ListsData& ld);
+
+/// name of delta file for snapshot
+fs::path deltaPath(const fs::path& snapshot);
+
+/**
+ * Find changes between published snapshot & current data
+ *
+ * @return false if set of lists was changed or data have only prefixes, so new snapshot
+ * is needed
+ */
+bool makeDelta(const ListsData& base, const ListsData& current, SnapshotDelta& delta);
+bool writeDelta(const fs::path& fname, const SnapshotDelta& delta);
+bool readDelta(const fs::path& fname, SnapshotDelta& delta);
+
+/**
+ * Use delta as overlay over base index.  Digests & masks are moved from delta
+ *
+ * @return false if delta has other lists, than base index
+ */
+bool applyDelta(SnapshotDelta& delta, ListsData& ld);
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,65 @@
+/**
+ * @file   stats.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Runtime statistics of redirector: counters & histograms of durations
+ *
+ *
+ */
+
+#include "stats.h"
+
+HistogramData::HistogramData() : buckets(LatencyHistogram::Buckets), count(0), total(0) {
+}
+
+StatValue HistogramData::percentile(double p) const {
+	if(count == 0)
+		return 0;
+	StatValue rank=(StatValue)(p*count);
+	if(rank >= count)
+		rank=count-1;
+	StatValue seen=0;
+	for(std::size_t i=0; i < buckets.size(); ++i) {
+		seen+=buckets[i];
+		if(seen > rank)
+			return i+1 < buckets.size() ? LatencyHistogram::lowerBound(i+1) - 1 :
+				LatencyHistogram::lowerBound(i);
+	}
+	return 0;
+}
+
+void LatencyHistogram::addTo(HistogramData& h) const {
+	for(std::size_t i=0; i < Buckets; ++i) {
+		StatValue n=buckets[i].get();
+		h.buckets[i]+=n;
+		h.count+=n;
+	}
+	h.total+=total.get();
+}
+
+RedirectorStats::RedirectorStats() : started(statNow()) {
+}
+
+ThreadStats* RedirectorStats::addThread() {
+	boost::shared_ptr<ThreadStats> ts(new ThreadStats());
+	boost::mutex::scoped_lock lock(mutex);
+	threads.push_back(ts);
+	return ts.get();
+}
+
+void RedirectorStats::summary(StatsSummary& s) const {
+	s=StatsSummary();
+	s.uptime=(statNow() - started)/1e9;
+	boost::mutex::scoped_lock lock(mutex);
+	for(std::size_t i=0; i < threads.size(); ++i) {
+		const ThreadStats& ts=*threads[i];
+		s.requests+=ts.requests.get();
+		s.parseFailures+=ts.parseFailures.get();
+		s.urlCacheHits+=ts.urlCacheHits.get();
+		s.hostCacheHits+=ts.hostCacheHits.get();
+		for(std::size_t j=0; j < MaxLists; ++j)
+			s.hits[j]+=ts.hits[j].get();
+		for(int t=0; t < StatTimers; ++t)
+			ts.times[t].addTo(s.times[t]);
+	}
+}
@@ -0,0 +1,216 @@
+/**
+ * @file   stats.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Runtime statistics of redirector: counters & histograms of durations
+ *
+ * Each thread, that processes requests, has own counters, that only this thread changes,
+ * so they are updated by plain relaxed stores, without locks & read-modify-write atomic
+ * operations.  Counters of all threads are summed only when statistics is requested.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H 1
+
+#include "common.h"
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+typedef boost::uint64_t StatValue;
+
+/// monotonic time in nanoseconds
+inline StatValue statNow() {
+	return boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+		boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Counter with single writer, that could be read by other threads
+ */
+class StatCounter {
+public:
+	StatCounter() : value(0) { }
+
+	void add(StatValue n=1) {
+		value.store(value.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+	}
+
+	StatValue get() const { return value.load(boost::memory_order_relaxed); }
+
+private:
+	boost::atomic<StatValue> value;
+} ;
+
+/**
+ * Summed histogram of durations
+ */
+struct HistogramData {
+	std::vector<StatValue> buckets;
+	StatValue count;
+	/// sum of all durations
+	StatValue total;
+
+	HistogramData();
+
+	StatValue mean() const { return count ? total/count : 0; }
+
+	/// upper bound of duration, that isn't exceeded by part p of values
+	StatValue percentile(double p) const;
+} ;
+
+/**
+ * Histogram of durations in nanoseconds with single writer.  Each power of two is divided
+ * into 4 buckets, so percentiles are accurate within 25%.  Durations longer than 2^40 ns
+ * are counted in the last bucket
+ */
+class LatencyHistogram {
+public:
+	enum {
+		SubBits=2,
+		Sub=1 << SubBits,
+		MaxBits=40,
+		Buckets=(MaxBits-SubBits+1) << SubBits
+	};
+
+	void add(StatValue ns) {
+		buckets[bucketOf(ns)].add();
+		total.add(ns);
+	}
+
+	/// add values of this histogram to summed one
+	void addTo(HistogramData& h) const;
+
+	static std::size_t bucketOf(StatValue ns) {
+		if(ns < Sub)
+			return ns;
+		unsigned int bits=63 - __builtin_clzll(ns);
+		if(bits >= MaxBits)
+			return Buckets-1;
+		return ((bits-SubBits+1) << SubBits) | ((ns >> (bits-SubBits)) & (Sub-1));
+	}
+
+	/// the smallest duration, that is counted in bucket i
+	static StatValue lowerBound(std::size_t i) {
+		if(i < Sub)
+			return i;
+		unsigned int bits=(i >> SubBits) + SubBits - 1;
+		return (StatValue)(Sub | (i & (Sub-1))) << (bits-SubBits);
+	}
+
+private:
+	StatCounter buckets[Buckets];
+	StatCounter total;
+} ;
+
+/// measured stages of processing of request
+enum StatTimer {
+	TimeVariants,
+	TimeHashing,
+	TimeLookup,
+	/// whole processing of request line
+	TimeRequest,
+	StatTimers
+};
+
+/**
+ * Statistics of one thread
+ */
+struct ThreadStats {
+	StatCounter requests;
+	/// request lines without URL, or with URL, that isn't HTTP
+	StatCounter parseFailures;
+	StatCounter urlCacheHits;
+	StatCounter hostCacheHits;
+	/// requests, that were rewritten, by list in order of priority
+	StatCounter hits[MaxLists];
+	LatencyHistogram times[StatTimers];
+} ;
+
+/**
+ * Statistics of all threads, summed
+ */
+struct StatsSummary {
+	StatValue requests;
+	StatValue parseFailures;
+	StatValue urlCacheHits;
+	StatValue hostCacheHits;
+	std::vector<StatValue> hits;
+	HistogramData times[StatTimers];
+	/// time since start of statistics, in seconds
+	double uptime;
+
+	StatsSummary() : requests(0), parseFailures(0), urlCacheHits(0), hostCacheHits(0),
+					 hits(MaxLists), uptime(0) { }
+} ;
+
+/**
+ * Registry of statistics of threads
+ */
+class RedirectorStats {
+public:
+	RedirectorStats();
+
+	/// statistics for new thread, it lives as long as registry
+	ThreadStats* addThread();
+
+	void summary(StatsSummary& s) const;
+
+private:
+	mutable boost::mutex mutex;
+	std::vector<boost::shared_ptr<ThreadStats> > threads;
+	StatValue started;
+} ;
+
+/**
+ * Measures stages of processing of one request: each call of stage adds time since
+ * previous mark to this stage.  Stages could be repeated, their time is summed & added to
+ * histograms once, with whole time of request, when timer is destroyed.  Does nothing
+ * without statistics
+ */
+class StageTimer {
+public:
+	StageTimer(ThreadStats* s) : stats(s), started(s ? statNow() : 0), last(started), used(0) {
+		for(int t=0; t < TimeRequest; ++t)
+			spent[t]=0;
+	}
+
+	~StageTimer() {
+		if(!stats)
+			return;
+		for(int t=0; t < TimeRequest; ++t) {
+			if(used & (1 << t))
+				stats->times[t].add(spent[t]);
+		}
+		stats->times[TimeRequest].add(statNow() - started);
+	}
+
+	/// start measuring of next stage
+	void mark() {
+		if(stats)
+			last=statNow();
+	}
+
+	/// add time since previous mark to stage t
+	void stage(StatTimer t) {
+		if(!stats)
+			return;
+		StatValue now=statNow();
+		spent[t]+=now - last;
+		used|=1 << t;
+		last=now;
+	}
+
+	ThreadStats* threadStats() const { return stats; }
+
+private:
+	ThreadStats* stats;
+	StatValue started;
+	StatValue last;
+	StatValue spent[TimeRequest];
+	unsigned int used;
+} ;
+
+#endif /* _STATS_H */
@@ -10,17 +10,81 @@
 #include <boost/test/minimal.hpp>
 
 #include "common.h"
+#include "variants.h"
+#include "md5-batch.h"
+#include "lists.h"
+#include "snapshot.h"
+#include "listfile.h"
+#include "updateparser.h"
+#include "updater.h"
+#ifdef GSB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "hashfile.h"
+#include "redirector.h"
+#include "fullhash.h"
+#include "lineio.h"
+#include "stats.h"
+#include "corpus.h"
+#include <boost/md5.hpp>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
 
+bool runDebug=false;
 
-int test_main( int /*argc*/, char* /*argv*/[] ) {
+// count of heap allocations, to check that request path doesn't allocate
+static std::size_t allocCount=0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+	++allocCount;
+	void* p=std::malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) throw() {
+	std::free(p);
+}
+
+bool notLess(const Digest& a, const Digest& b) {
+	return !(a < b);
+}
+
+void testDigests() {
+
+	const char* hexes[]={
+		"da496e96679f98870c00054673a41df4",
+		"51864045d1a5ba4d1e4d1e1f2c6f5e1e",
+		"0123456789abcdef0123456789abcdef"
+	};
+	Digest ds[3];
+	for(int i=0; i < 3; ++i)
+		BOOST_REQUIRE( parseHexDigest(hexes[i], ds[i]) );
+	BOOST_REQUIRE( formatHexDigest(ds[0]) == hexes[0] );
+
+	{
+		Digest d;
+		BOOST_REQUIRE( !parseHexDigest("AAAAAA", d) );
+		BOOST_REQUIRE( !parseHexDigest("zz496e96679f98870c00054673a41df4", d) );
+		BOOST_REQUIRE( parseHexDigest("DA496E96679F98870C00054673A41DF4", d) );
+		BOOST_REQUIRE( d == ds[0] );
+	}
 
 	{
 		HashData h;
 		h.majorVersion=1;
 		h.minorVersion=2;
-		h.hashes.insert("AAAAAA");
-		h.hashes.insert("BBBBBB");
-		h.hashes.insert("CCCCCC");
+		DigestUpdate du;
+		for(int i=0; i < 3; ++i)
+			du.add(ds[i]);
+		DigestVector dv;
+		du.apply(0, 0, dv);
+		h.hashes.assign(dv);
 		std::ofstream ofs("test.dat");
 		boost::archive::text_oarchive oa(ofs);
 		oa << h;
@@ -33,8 +97,1696 @@ int test_main( int /*argc*/, char* /*argv*/[] ) {
 		ia >> h;
 		BOOST_REQUIRE( h.majorVersion == 1 );
 		BOOST_REQUIRE( h.minorVersion == 2 );
+		BOOST_REQUIRE( h.hashes.size() == 3 );
+		for(int i=0; i < 3; ++i)
+			BOOST_REQUIRE( h.hashes.contains(ds[i]) );
+	}
+
+	// updates are applied in order, later operation wins
+	{
+		DigestVector base, result;
+		base.push_back(ds[2]);
+		base.push_back(ds[1]);
+		std::sort(base.begin(), base.end());
+		DigestUpdate du;
+		du.remove(ds[1]);
+		du.add(ds[0]);
+		du.remove(ds[0]);
+		du.remove(ds[2]);
+		du.add(ds[2]);
+		du.apply(&base[0], &base[0]+base.size(), result);
+		BOOST_REQUIRE( result.size() == 1 );
+		BOOST_REQUIRE( result[0] == ds[2] );
+	}
+
+	// large updates are sorted in parallel, with the same result as by one thread
+	{
+		boost::uint32_t seed=777;
+		DigestVector pool(50000), base;
+		for(std::size_t i=0; i < pool.size(); ++i) {
+			for(int j=0; j < 16; ++j) {
+				seed=seed*1103515245+12345;
+				pool[i].bytes[j]=seed >> 24;
+			}
+			// some digests share first bytes, so they get into the same bucket
+			if(i % 7 == 0)
+				pool[i].bytes[0]=pool[i].bytes[1]=0;
+		}
+		for(std::size_t i=0; i < pool.size(); i+=3)
+			base.push_back(pool[i]);
+		std::sort(base.begin(), base.end());
+		base.erase(std::unique(base.begin(), base.end()), base.end());
+		DigestUpdate du;
+		for(std::size_t i=0; i < 300000; ++i) {
+			seed=seed*1103515245+12345;
+			const Digest& d=pool[(seed >> 8) % pool.size()];
+			if(seed & 1)
+				du.add(d);
+			else
+				du.remove(d);
+		}
+		BOOST_REQUIRE( du.ops.size() > DigestUpdate::MinRadixSort );
+		std::vector<DigestUpdate::Op> ops=du.ops;
+		std::map<Digest, bool> lastOp;
+		for(std::size_t j=0; j < ops.size(); ++j)
+			lastOp[ops[j].digest]=ops[j].add;
+		DigestVector first;
+		for(unsigned int t=1; t <= 4; ++t) {
+			du.ops=ops;
+			du.threads=t;
+			DigestVector result;
+			du.apply(&base[0], &base[0]+base.size(), result);
+			BOOST_REQUIRE( du.ops.empty() );
+			BOOST_REQUIRE( std::adjacent_find(result.begin(), result.end(), notLess) == result.end() );
+			if(t == 1)
+				first=result;
+			BOOST_REQUIRE( result == first );
+			// result of each digest is defined by its last operation
+			for(std::size_t i=0; i < pool.size(); i+=97) {
+				std::map<Digest, bool>::const_iterator last=lastOp.find(pool[i]);
+				bool inBase=std::binary_search(base.begin(), base.end(), pool[i]);
+				bool found=std::binary_search(result.begin(), result.end(), pool[i]);
+				BOOST_REQUIRE( found == (last == lastOp.end() ? inBase : last->second) );
+			}
+		}
+	}
+
+	// index lookup on different sizes, including empty & single-bucket ones
+	{
+		boost::uint32_t seed=12345;
+		for(std::size_t n=0; n < 5000; n=n*3+1) {
+			DigestVector dv;
+			for(std::size_t i=0; i < 2*n; ++i) {
+				Digest d;
+				for(int j=0; j < 16; ++j) {
+					seed=seed*1103515245+12345;
+					d.bytes[j]=(unsigned char)(seed >> 16);
+				}
+				dv.push_back(d);
+			}
+			DigestVector present(dv.begin(), dv.begin()+n);
+			std::sort(present.begin(), present.end());
+			DigestVector filtered(present);
+			DigestIndex idx, fidx;
+			idx.assign(present);
+			fidx.assign(filtered, 0, true);
+			BOOST_REQUIRE( idx.size() == n && fidx.size() == n );
+			BOOST_REQUIRE( fidx.filterSize() == DigestIndex::filterBlocksFor(n) );
+			for(std::size_t i=0; i < 2*n; ++i) {
+				BOOST_REQUIRE( idx.contains(dv[i]) == (i < n) );
+				BOOST_REQUIRE( fidx.contains(dv[i]) == (i < n) );
+			}
+		}
+	}
+
+	// variants are hashed as host, followed by path: digest doesn't depend on split,
+	// also when padding with length doesn't fit into the last block
+	{
+		std::string msg;
+		for(std::size_t i=0; i < 64; ++i)
+			msg+=(char)('a' + i%26);
+		for(std::size_t len=55; len <= 64; ++len) {
+			boost::md5 whole(msg.data(), len);
+			for(std::size_t split=0; split <= len; ++split) {
+				boost::md5 m(msg.data(), split);
+				m.process(msg.data()+split, len-split, true);
+				BOOST_REQUIRE( std::memcmp(m.digest(), whole.digest(), 16) == 0 );
+			}
+		}
+	}
+
+	// false positive rate of filter
+	{
+		boost::uint32_t seed=777;
+		DigestVector dv;
+		const std::size_t n=100000;
+		for(std::size_t i=0; i < 2*n; ++i) {
+			Digest d;
+			for(int j=0; j < 16; ++j) {
+				seed=seed*1664525+1013904223;
+				d.bytes[j]=(unsigned char)(seed >> 24);
+			}
+			dv.push_back(d);
+		}
+		DigestVector present(dv.begin(), dv.begin()+n);
+		std::sort(present.begin(), present.end());
+		DigestIndex idx;
+		idx.assign(present, 0, true);
+		std::size_t positives=0;
+		for(std::size_t i=0; i < n; ++i) {
+			BOOST_REQUIRE( idx.mayContain(dv[i]) );
+			positives+=idx.mayContain(dv[n+i]);
+		}
+		std::cerr << "filter false positive rate: " << (double)positives/n*100 << "%" << std::endl;
+		BOOST_REQUIRE( positives < n/50 );
+	}
+
+}
+
+std::string variantsToString(const UrlVariants& uv) {
+	std::string result;
+	for(const UrlVariant* it=uv.begin(); it != uv.end(); ++it) {
+		if(it != uv.begin())
+			result+=' ';
+		result+=it->host.str()+it->path.str();
+	}
+	return result;
+}
+
+void testVariants() {
+	UrlVariants uv;
+	BOOST_REQUIRE( !generateVariants(StringPiece("https://foo", 11), uv) );
+	BOOST_REQUIRE( !generateVariants(StringPiece("http:/", 6), uv) );
+
+	const char* urls[][2]={
+		{ "http://www.example.com",
+		  "www.example.com/ example.com/" },
+		{ "HTTP://www.example.com/",
+		  "www.example.com/ example.com/" },
+		{ "http://example.com./a",
+		  "example.com./ example.com./a example.com/ example.com/a" },
+		{ "http://x.example.com/a?q",
+		  "x.example.com/ x.example.com/a?q x.example.com/a "
+		  "example.com/ example.com/a?q example.com/a" },
+		{ "http://example.com/a/b/",
+		  "example.com/ example.com/a/b/ example.com/a/" },
+		{ "http://example.com/a//b/c",
+		  "example.com/ example.com/a//b/c example.com/a/ example.com/a//b/" },
+		{ "http://a.b.c.d.e.f.g/1/2/3/4/5/6.html?x=1",
+		  "a.b.c.d.e.f.g/ a.b.c.d.e.f.g/1/2/3/4/5/6.html?x=1 a.b.c.d.e.f.g/1/2/3/4/5/6.html "
+		  "a.b.c.d.e.f.g/1/ a.b.c.d.e.f.g/1/2/ a.b.c.d.e.f.g/1/2/3/ "
+		  "f.g/ f.g/1/2/3/4/5/6.html?x=1 f.g/1/2/3/4/5/6.html f.g/1/ f.g/1/2/ f.g/1/2/3/ "
+		  "e.f.g/ e.f.g/1/2/3/4/5/6.html?x=1 e.f.g/1/2/3/4/5/6.html e.f.g/1/ e.f.g/1/2/ e.f.g/1/2/3/ "
+		  "d.e.f.g/ d.e.f.g/1/2/3/4/5/6.html?x=1 d.e.f.g/1/2/3/4/5/6.html d.e.f.g/1/ d.e.f.g/1/2/ d.e.f.g/1/2/3/ "
+		  "c.d.e.f.g/ c.d.e.f.g/1/2/3/4/5/6.html?x=1 c.d.e.f.g/1/2/3/4/5/6.html c.d.e.f.g/1/ c.d.e.f.g/1/2/ c.d.e.f.g/1/2/3/" },
+		{ "http://example.com/?q",
+		  "example.com/ example.com/?q" },
+	};
+	for(std::size_t i=0; i < sizeof(urls)/sizeof(urls[0]); ++i) {
+		std::string url(urls[i][0]);
+		BOOST_REQUIRE( generateVariants(StringPiece(url), uv) );
+		BOOST_REQUIRE( variantsToString(uv) == urls[i][1] );
+	}
+
+	// digests of variants are the same as digests of concatenated strings
+	{
+		std::string url("http://www.howwater.com/");
+		BOOST_REQUIRE( generateVariants(StringPiece(url), uv) );
+		hashVariants(uv);
+		BOOST_REQUIRE( formatHexDigest(uv.digests[0]) == "da496e96679f98870c00054673a41df4" );
+	}
+
+	// generation of variants, hashing & lookup don't touch heap
+	std::string url("http://a.b.c.d.e.f.g/1/2/3/4/5/6.html?x=1");
+	DigestVector dv;
+	Digest d;
+	parseHexDigest("da496e96679f98870c00054673a41df4", d);
+	dv.push_back(d);
+	DigestIndex idx;
+	idx.assign(dv);
+	std::size_t before=allocCount;
+	bool found=false;
+	for(int i=0; i < 100; ++i) {
+		generateVariants(StringPiece(url), uv);
+		hashVariants(uv);
+		for(std::size_t j=0; j < uv.count; ++j)
+			found|=idx.contains(uv.digests[j]);
+	}
+	BOOST_REQUIRE( allocCount == before );
+	BOOST_REQUIRE( uv.size() == UrlVariants::MaxVariants );
+	BOOST_REQUIRE( !found );
+}
+
+void testMd5Batch() {
+	// messages of all lengths around the block boundary, split at different places
+	std::string text;
+	boost::uint32_t seed=42;
+	for(int i=0; i < 200; ++i) {
+		seed=seed*1103515245+12345;
+		text+=(char)('a' + (seed >> 16) % 26);
+	}
+	const std::size_t count=90;
+	UrlVariant msgs[count];
+	Digest expected[count];
+	for(std::size_t i=0; i < count; ++i) {
+		std::size_t len=i < 70 ? i : 100+i;
+		std::size_t split=len ? (i*7) % (len+1) : 0;
+		msgs[i].host=StringPiece(text.data()+i, split);
+		msgs[i].path=StringPiece(text.data()+i+split, len-split);
+		std::string m=msgs[i].host.str()+msgs[i].path.str();
+		boost::md5 h(m.data(), m.size());
+		std::memcpy(expected[i].bytes, h.digest(), 16);
+	}
+
+	const Md5Impl impls[]={ Md5Scalar, Md5Sse2, Md5Avx2, Md5Avx512, Md5Auto };
+	for(std::size_t i=0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+		if(!md5BatchSupported(impls[i])) {
+			std::cerr << "md5 implementation " << impls[i] << " isn't supported" << std::endl;
+			continue;
+		}
+		// different batch sizes to check partially filled lanes
+		for(std::size_t n=1; n <= count; n+=7) {
+			Digest digests[count];
+			BOOST_REQUIRE( md5Batch(impls[i], msgs, n, digests) );
+			for(std::size_t j=0; j < n; ++j)
+				BOOST_REQUIRE( digests[j] == expected[j] );
+		}
+	}
+	BOOST_REQUIRE( md5BatchSupported(Md5Scalar) );
+	BOOST_REQUIRE( md5BatchSupported(Md5Auto) );
+}
+
+HashData makeHash(const char* name, int minor, const Digest& d) {
+	HashData h;
+	h.name=name;
+	h.minorVersion=minor;
+	DigestVector dv(1, d);
+	h.hashes.assign(dv);
+	return h;
+}
+
+bool writeLists(const fs::path& fname, const HashData& h1, const HashData& h2=HashData()) {
+	std::vector<const HashData*> hs;
+	hs.push_back(&h1);
+	hs.push_back(&h2);
+	ListsData ld;
+	combineLists(hs, ld);
+	return writeSnapshot(fname, ld);
+}
+
+void testSnapshot() {
+	HashData h, h2;
+	h.name="goog-black-hash";
+	h.majorVersion=1;
+	h.minorVersion=7;
+	h2.name="goog-malware-hash";
+	h2.minorVersion=3;
+	DigestVector dv, dv2;
+	boost::uint32_t seed=7;
+	for(int i=0; i < 1000; ++i) {
+		Digest d;
+		for(int j=0; j < 16; ++j) {
+			seed=seed*1103515245+12345;
+			d.bytes[j]=(unsigned char)(seed >> 16);
+		}
+		dv.push_back(d);
+		// every 3rd digest is in both lists, every 5th only in second
+		if(i % 3 == 0 || i % 5 == 0)
+			dv2.push_back(d);
+	}
+	DigestVector all(dv);
+	std::sort(dv.begin(), dv.end());
+	std::sort(dv2.begin(), dv2.end());
+	for(std::size_t i=0; i < all.size(); i+=5)
+		dv.erase(std::lower_bound(dv.begin(), dv.end(), all[i]));
+	h.hashes.assign(dv);
+	h2.hashes.assign(dv2);
+
+	std::vector<const HashData*> hs;
+	hs.push_back(&h);
+	hs.push_back(&h2);
+	ListsData ld;
+	combineLists(hs, ld);
+	BOOST_REQUIRE( ld.hashes.size() == 1000 );
+	BOOST_REQUIRE( writeSnapshot("test.snap", ld) );
+	{
+		ListsData m;
+		BOOST_REQUIRE( mapSnapshot("test.snap", m) );
+		BOOST_REQUIRE( m.lists.size() == 2 );
+		BOOST_REQUIRE( m.lists[0].name == "goog-black-hash" && m.bitOf("goog-black-hash") == 0 );
+		BOOST_REQUIRE( m.lists[0].majorVersion == 1 && m.lists[0].minorVersion == 7 );
+		BOOST_REQUIRE( m.lists[1].name == "goog-malware-hash" && m.lists[1].minorVersion == 3 );
+		BOOST_REQUIRE( m.bitOf("goog-white-domain") == -1 );
+		BOOST_REQUIRE( m.hashes.size() == 1000 );
+		BOOST_REQUIRE( m.hashes.bucketBits() == ld.hashes.bucketBits() );
+		BOOST_REQUIRE( m.hashes.filterSize() == ld.hashes.filterSize() && m.hashes.filterSize() );
+		for(std::size_t i=0; i < all.size(); ++i) {
+			boost::uint32_t expected=i % 5 == 0 ? 2 : (i % 3 == 0 ? 3 : 1);
+			BOOST_REQUIRE( m.hashes.lookup(all[i]) == expected );
+		}
+		Digest d;
+		parseHexDigest("da496e96679f98870c00054673a41df4", d);
+		BOOST_REQUIRE( !m.hashes.contains(d) );
+
+		// mapping stays valid while snapshot is replaced
+		HashData e;
+		e.name="goog-black-hash";
+		BOOST_REQUIRE( writeLists("test.snap", e) );
+		BOOST_REQUIRE( m.hashes.contains(all[0]) );
+		ListsData m2;
+		BOOST_REQUIRE( mapSnapshot("test.snap", m2) );
+		BOOST_REQUIRE( m2.hashes.empty() && !m2.loaded() );
+		BOOST_REQUIRE( !m2.hashes.contains(all[0]) );
+	}
+
+	// delta has only changed digests & gives the same results over snapshot
+	ld.generation=7;
+	BOOST_REQUIRE( writeSnapshot("test.snap", ld) );
+	ListsData base;
+	BOOST_REQUIRE( mapSnapshot("test.snap", base) && base.generation == 7 );
+	h.minorVersion=8;
+	dv.assign(h.hashes.begin()+10, h.hashes.end());
+	Digest added;
+	parseHexDigest("da496e96679f98870c00054673a41df4", added);
+	dv.insert(std::lower_bound(dv.begin(), dv.end(), added), added);
+	h.hashes.assign(dv);
+	dv2.assign(h2.hashes.begin(), h2.hashes.end());
+	dv2.erase(dv2.begin());
+	h2.hashes.assign(dv2);
+	ListsData cur;
+	combineLists(hs, cur);
+	SnapshotDelta delta;
+	BOOST_REQUIRE( makeDelta(base, cur, delta) && delta.base == 7 );
+	BOOST_REQUIRE( delta.digests.size() >= 11 && delta.digests.size() <= 12 );
+	BOOST_REQUIRE( writeDelta(deltaPath("test.snap"), delta) );
+	SnapshotDelta rd;
+	BOOST_REQUIRE( readDelta(deltaPath("test.snap"), rd) );
+	BOOST_REQUIRE( rd.base == 7 && rd.digests == delta.digests && rd.masks == delta.masks );
+	BOOST_REQUIRE( rd.lists.size() == 2 && rd.lists[0].minorVersion == 8 );
+	// masks of delta with other lists would mean other lists
+	SnapshotDelta other=rd;
+	other.lists.pop_back();
+	BOOST_REQUIRE( !applyDelta(other, base) && base.lists[0].minorVersion == 7 );
+	other.lists=rd.lists;
+	std::swap(other.lists[0], other.lists[1]);
+	BOOST_REQUIRE( !applyDelta(other, base) && base.overlay.size() == 0 );
+	BOOST_REQUIRE( applyDelta(rd, base) );
+	BOOST_REQUIRE( base.lists[0].minorVersion == 8 && base.hashes.size() == 1000 );
+	all.push_back(added);
+	UrlVariants uv;
+	uv.count=1;
+	for(std::size_t i=0; i < all.size(); ++i) {
+		uv.digests[0]=all[i];
+		BOOST_REQUIRE( base.check(uv) == cur.hashes.lookup(all[i]) );
+	}
+	// set of lists is changed
+	cur.lists[1].name="goog-white-domain";
+	BOOST_REQUIRE( !makeDelta(base, cur, delta) );
+	// digests of delta must be sorted & unique
+	std::swap(delta.digests[0], delta.digests[1]);
+	BOOST_REQUIRE( writeDelta(deltaPath("test.snap"), delta) );
+	BOOST_REQUIRE( !readDelta(deltaPath("test.snap"), rd) );
+	delta.digests[1]=delta.digests[0];
+	BOOST_REQUIRE( writeDelta(deltaPath("test.snap"), delta) );
+	BOOST_REQUIRE( !readDelta(deltaPath("test.snap"), rd) );
+	{
+		std::ofstream ofs(pathString(deltaPath("test.snap")).c_str(),
+						  std::ios::binary | std::ios::app);
+		ofs << "garbage";
+	}
+	BOOST_REQUIRE( !readDelta(deltaPath("test.snap"), rd) );
+	BOOST_REQUIRE( !readDelta("does-not-exist.delta", rd) );
+	fs::remove(deltaPath("test.snap"));
+
+	// index of prefixes gives the same masks for listed digests
+	{
+		ListsData pl;
+		combineLists(hs, pl);
+		std::size_t full=pl.hashes.memoryUsage();
+		pl.usePrefixes();
+		BOOST_REQUIRE( pl.prefixOnly && pl.hashes.empty() && pl.prefixes.size() <= all.size() );
+		BOOST_REQUIRE( pl.prefixes.memoryUsage()*2 < full );
+		BOOST_REQUIRE( writeSnapshot("test.snap", pl) );
+		ListsData mp;
+		BOOST_REQUIRE( mapSnapshot("test.snap", mp) && mp.prefixOnly && mp.hashes.empty() );
+		BOOST_REQUIRE( mp.prefixes.size() == pl.prefixes.size() && mp.lists[0].minorVersion == 8 );
+		for(std::size_t i=0; i < all.size(); ++i) {
+			uv.digests[0]=all[i];
+			BOOST_REQUIRE( mp.check(uv) == cur.hashes.lookup(all[i]) );
+			BOOST_REQUIRE( pl.prefixes.lookup(all[i].prefix()) == cur.hashes.lookup(all[i]) );
+		}
+		// without confirmation digest with the same prefix is treated as listed
+		Digest other=all[1];
+		other.bytes[15]^=1;
+		uv.digests[0]=other;
+		BOOST_REQUIRE( mp.check(uv) == cur.hashes.lookup(all[1]) && mp.check(uv) != 0 );
+		// snapshot of prefixes doesn't have deltas
+		BOOST_REQUIRE( !makeDelta(mp, pl, delta) );
+
+		// masks of digests with the same prefix are merged
+		DigestVector same(2, other);
+		same[0]=all[1];
+		std::sort(same.begin(), same.end());
+		std::vector<boost::uint32_t> masks;
+		masks.push_back(1);
+		masks.push_back(4);
+		DigestIndex di;
+		di.assign(same, &masks);
+		PrefixIndex pi;
+		pi.assign(di);
+		BOOST_REQUIRE( pi.size() == 1 && pi.lookup(other.prefix()) == 5 );
+		BOOST_REQUIRE( pi.lookup(other.prefix()+1) == 0 && pi.lookup(0) == 0 );
+	}
+
+	// buckets, that aren't ordered or point outside of digests, are rejected
+	ListsData m;
+	BOOST_REQUIRE( writeSnapshot("test.snap", cur) && mapSnapshot("test.snap", m) );
+	SnapshotHeader shdr;
+	boost::uint32_t next;
+	{
+		std::ifstream ifs("test.snap", std::ios::binary);
+		ifs.read(reinterpret_cast<char*>(&shdr), sizeof(shdr));
+		ifs.seekg(shdr.bucketsOffset + 2*sizeof(boost::uint32_t));
+		ifs.read(reinterpret_cast<char*>(&next), sizeof(next));
+	}
+	BOOST_REQUIRE( next < shdr.count );
+	boost::uint32_t bad[2]={ (boost::uint32_t)shdr.count+1, (boost::uint32_t)shdr.count };
+	for(int i=0; i < 2; ++i) {
+		{
+			std::fstream sf("test.snap", std::ios::binary | std::ios::in | std::ios::out);
+			sf.seekp(shdr.bucketsOffset + sizeof(boost::uint32_t));
+			sf.write(reinterpret_cast<const char*>(&bad[i]), sizeof(bad[i]));
+		}
+		BOOST_REQUIRE( !mapSnapshot("test.snap", m) );
+	}
+
+	// truncated files are rejected
+	{
+		std::ofstream ofs("test.snap", std::ios::binary | std::ios::trunc);
+		ofs << "GSBSNAP";
+	}
+	BOOST_REQUIRE( !mapSnapshot("test.snap", m) );
+	BOOST_REQUIRE( !mapSnapshot("does-not-exist.snap", m) );
+}
+
+void testReload() {
+	Digest d1, d2;
+	parseHexDigest("da496e96679f98870c00054673a41df4", d1);
+	parseHexDigest("0123456789abcdef0123456789abcdef", d2);
+	fs::create_directory("test-hashes");
+	HashFile hf;
+	hf.fname="test-hashes/lists.snap";
+	ListConfig lc;
+	lc.name="goog-black-hash";
+	lc.file="test-hashes/black-hash.dat";
+	hf.lists.push_back(lc);
+	fs::remove(hf.fname);
+	fs::remove(lc.file);
+
+	// interval is long, so reload could happen only by notification
+	HashWatcher watcher(3600);
+	watcher.add(&hf);
+	watcher.start();
+	BOOST_REQUIRE( !hf.loaded() );
+
+	// data file is used, while there is no snapshot
+	{
+		std::ofstream ofs(pathString(lc.file).c_str(), std::ios::binary);
+		boost::archive::text_oarchive oa(ofs);
+		oa << makeHash("goog-black-hash", 1, d1);
+	}
+	for(int i=0; i < 500 && !hf.loaded(); ++i)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	BOOST_REQUIRE( hf.loaded() );
+	HashFile::DataPtr old=hf.current();
+	BOOST_REQUIRE( old->hashes.contains(d1) );
+	BOOST_REQUIRE( old->lists.size() == 1 && old->lists[0].minorVersion == 1 );
+
+	BOOST_REQUIRE( writeLists(hf.fname, makeHash("goog-black-hash", 2, d2)) );
+	for(int i=0; i < 500 && hf.current()->lists[0].minorVersion != 2; ++i)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	HashFile::DataPtr cur=hf.current();
+	BOOST_REQUIRE( cur->lists[0].minorVersion == 2 );
+	BOOST_REQUIRE( cur->hashes.contains(d2) && !cur->hashes.contains(d1) );
+	// readers, that hold old snapshot, still could use it
+	BOOST_REQUIRE( old->hashes.contains(d1) );
+
+	// only delta is read, snapshot stays mapped
+	SnapshotDelta delta;
+	delta.base=cur->generation;
+	delta.lists=cur->lists;
+	delta.lists[0].minorVersion=3;
+	delta.digests.push_back(d2);
+	delta.masks.push_back(0);
+	delta.digests.push_back(d1);
+	delta.masks.push_back(1);
+	BOOST_REQUIRE( writeDelta(deltaPath(hf.fname), delta) );
+	for(int i=0; i < 500 && hf.current()->lists[0].minorVersion != 3; ++i)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	HashFile::DataPtr upd=hf.current();
+	BOOST_REQUIRE( upd->lists[0].minorVersion == 3 && upd->hashes.begin() == cur->hashes.begin() );
+	BOOST_REQUIRE( upd->overlay.size() == 2 );
+	watcher.stop();
+
+	UrlVariants uv;
+	uv.count=1;
+	uv.digests[0]=d2;
+	BOOST_REQUIRE( cur->check(uv) == 1 );
+	BOOST_REQUIRE( upd->check(uv) == 0 );
+	uv.digests[0]=d1;
+	BOOST_REQUIRE( cur->check(uv) == 0 );
+	BOOST_REQUIRE( upd->check(uv) == 1 );
+
+	// delta for other snapshot is ignored
+	delta.base=cur->generation+1;
+	BOOST_REQUIRE( writeDelta(deltaPath(hf.fname), delta) );
+	BOOST_REQUIRE( hf.updateHash() );
+	BOOST_REQUIRE( hf.current()->overlay.empty() && hf.current()->lists[0].minorVersion == 2 );
+	fs::remove_all("test-hashes");
+}
+
+void testListFile() {
+	fs::create_directory("test-hashes");
+	boost::uint32_t seed=4321;
+	DigestVector dv(100000);
+	for(std::size_t i=0; i < dv.size(); ++i) {
+		for(int j=0; j < 16; ++j) {
+			seed=seed*1103515245+12345;
+			dv[i].bytes[j]=seed >> 24;
+		}
+	}
+	std::sort(dv.begin(), dv.end());
+	dv.erase(std::unique(dv.begin(), dv.end()), dv.end());
+	DigestVector copy(dv);
+	HashData h;
+	h.name="goog-black-hash";
+	h.majorVersion=1;
+	h.minorVersion=77;
+	h.hashes.assign(copy);
+
+	// binary file is read back as is
+	fs::path bname="test-hashes/black.bin";
+	BOOST_REQUIRE( writeListFile(bname, h) );
+	BOOST_REQUIRE( isListFile(bname) );
+	HashData r;
+	BOOST_REQUIRE( loadListFile(bname, r) );
+	BOOST_REQUIRE( r.name == h.name && r.majorVersion == 1 && r.minorVersion == 77 );
+	BOOST_REQUIRE( r.hashes.size() == dv.size() );
+	BOOST_REQUIRE( std::equal(dv.begin(), dv.end(), r.hashes.begin()) );
+	BOOST_REQUIRE( digestsChecksum(&dv[0], 10, digestsChecksum(&dv[10], 0, 0)) ==
+				   digestsChecksum(&dv[0], 10) );
+	BOOST_REQUIRE( digestsChecksum(&dv[10], dv.size()-10, digestsChecksum(&dv[0], 10)) ==
+				   digestsChecksum(&dv[0], dv.size()) );
+
+	// files in old format are still read
+	fs::path tname="test-hashes/black.dat";
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary);
+		boost::archive::text_oarchive oa(ofs);
+		oa << h;
+	}
+	BOOST_REQUIRE( !isListFile(tname) );
+	HashData t;
+	BOOST_REQUIRE( loadListFile(tname, t) );
+	BOOST_REQUIRE( t.minorVersion == 77 && t.hashes.size() == dv.size() );
+	BOOST_REQUIRE( std::equal(dv.begin(), dv.end(), t.hashes.begin()) );
+
+	// damaged & truncated files are rejected, & list isn't changed
+	{
+		std::fstream fs(pathString(bname).c_str(), std::ios::binary | std::ios::in | std::ios::out);
+		fs.seekp(sizeof(ListFileHeader) + 1000);
+		fs.put('x');
+	}
+	BOOST_REQUIRE( !loadListFile(bname, r) );
+	BOOST_REQUIRE( r.minorVersion == 77 && r.hashes.size() == dv.size() );
+	fs::resize_file(bname, fs::file_size(bname)-1);
+	BOOST_REQUIRE( !loadListFile(bname, r) );
+	{
+		std::ofstream ofs(pathString(tname).c_str(), std::ios::binary);
+		ofs << "garbage";
+	}
+	BOOST_REQUIRE( !loadListFile(tname, t) );
+
+	// count, that overflows size of digests, is rejected without allocation of digests
+	BOOST_REQUIRE( writeListFile(bname, h) );
+	{
+		std::fstream fs(pathString(bname).c_str(), std::ios::binary | std::ios::in | std::ios::out);
+		ListFileHeader hdr;
+		BOOST_REQUIRE( fs.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) );
+		hdr.count+=(boost::uint64_t)1 << 60;
+		fs.seekp(0);
+		fs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+	}
+	BOOST_REQUIRE( !loadListFile(bname, r) );
+	BOOST_REQUIRE( r.minorVersion == 77 && r.hashes.size() == dv.size() );
+
+	// empty list
+	HashData e;
+	e.name="goog-malware-hash";
+	BOOST_REQUIRE( writeListFile(bname, e) );
+	BOOST_REQUIRE( loadListFile(bname, r) );
+	BOOST_REQUIRE( r.name == e.name && r.hashes.empty() && r.minorVersion == -1 );
+	fs::remove_all("test-hashes");
+}
+
+/**
+ * Encode body in chunks of given size
+ */
+std::string chunkedBody(const std::string& body, std::size_t size) {
+	std::ostringstream os;
+	for(std::size_t i=0; i < body.size(); i+=size) {
+		std::string chunk=body.substr(i, size);
+		os << std::hex << chunk.size() << (i ? "\r\n" : ";ext=1\r\n") << chunk << "\r\n";
+	}
+	os << "0\r\n\r\n";
+	return os.str();
+}
+
+#ifdef GSB_HAVE_ZLIB
+std::string gzipString(const std::string& s) {
+	z_stream zs;
+	std::memset(&zs, 0, sizeof(zs));
+	deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	std::string result(deflateBound(&zs, s.size()) + 32, 0);
+	zs.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(s.data()));
+	zs.avail_in=s.size();
+	zs.next_out=reinterpret_cast<Bytef*>(&result[0]);
+	zs.avail_out=result.size();
+	deflate(&zs, Z_FINISH);
+	result.resize(zs.total_out);
+	deflateEnd(&zs);
+	return result;
+}
+#endif
+
+void testUpdateParser() {
+	const char* hexes[]={
+		"da496e96679f98870c00054673a41df4",
+		"51864045d1a5ba4d1e4d1e1f2c6f5e1e",
+		"0123456789abcdef0123456789abcdef"
+	};
+	Digest ds[3];
+	for(int i=0; i < 3; ++i)
+		parseHexDigest(hexes[i], ds[i]);
+	std::string body=std::string("[goog-black-hash 1.5]\n+") + hexes[0] + "\r\n+" + hexes[1] +
+		"\n+zz\n  +" + hexes[2] + "  \n\nignored\n";
+
+	// the same result for any split of data into buffers & chunks
+	for(int chunked=0; chunked < 2; ++chunked) {
+		for(std::size_t csize=1; csize < 60; csize+=chunked ? 7 : 100) {
+			std::string data=chunked ? chunkedBody(body, csize) : body;
+			for(std::size_t step=1; step < data.size(); step+=13) {
+				UpdateParser p("goog-black-hash", chunked);
+				for(std::size_t i=0; i < data.size(); i+=step)
+					BOOST_REQUIRE( p.feed(data.data()+i, std::min(step, data.size()-i)) );
+				BOOST_REQUIRE( p.done() );
+				HashData h;
+				BOOST_REQUIRE( p.finish(h) );
+				BOOST_REQUIRE( h.majorVersion == 1 && h.minorVersion == 5 );
+				BOOST_REQUIRE( h.hashes.size() == 3 );
+				for(int i=0; i < 3; ++i)
+					BOOST_REQUIRE( h.hashes.contains(ds[i]) );
+			}
+		}
+	}
+
+	// incremental update is applied to current hashes, full update replaces them
+	HashData h;
+	{
+		UpdateParser p("goog-black-hash", false);
+		std::string data=std::string("[goog-black-hash 1.5]\n+") + hexes[0] + "\n+" + hexes[1];
+		BOOST_REQUIRE( p.feed(data.data(), data.size()) && !p.done() );
+		BOOST_REQUIRE( p.finish(h) && h.hashes.size() == 2 && p.nextPoll() == 0 );
+	}
+	{
+		UpdateParser p("goog-black-hash", true);
+		std::string data=chunkedBody(std::string("[goog-black-hash 1.6 update]\n-") + hexes[0] +
+									 "\n+" + hexes[2] + "\n", 10);
+		BOOST_REQUIRE( p.feed(data.data(), data.size()) && p.done() );
+		BOOST_REQUIRE( p.finish(h) && h.minorVersion == 6 && h.hashes.size() == 2 );
+		BOOST_REQUIRE( !h.hashes.contains(ds[0]) && h.hashes.contains(ds[1]) && h.hashes.contains(ds[2]) );
+	}
+	{
+		UpdateParser p("goog-black-hash", false);
+		std::string data=std::string("n:1200\r\n[goog-black-hash 2.1]\n+") + hexes[0] + "\n\n";
+		BOOST_REQUIRE( p.feed(data.data(), data.size()) && p.done() && p.nextPoll() == 1200 );
+		BOOST_REQUIRE( p.finish(h) && h.majorVersion == 2 && h.hashes.size() == 1 );
+	}
+
+	{
+		// trailers after last chunk are skipped
+		UpdateParser p("goog-black-hash", true);
+		std::string data=std::string("a\r\n[goog-blac\r\n") + "0\r\nX-Sum: 1\r\n\r\n";
+		BOOST_REQUIRE( p.feed(data.data(), data.size()-3) && !p.done() );
+		BOOST_REQUIRE( p.feed(data.data()+data.size()-3, 3) && p.done() );
+	}
+#ifdef GSB_HAVE_ZLIB
+	// compressed body, split at any place
+	BOOST_REQUIRE( UpdateParser::gzipSupported() );
+	std::string gz=gzipString(body);
+	for(std::size_t step=1; step < gz.size(); step+=5) {
+		UpdateParser p("goog-black-hash", false, true);
+		for(std::size_t i=0; i < gz.size(); i+=step)
+			BOOST_REQUIRE( p.feed(gz.data()+i, std::min(step, gz.size()-i)) );
+		BOOST_REQUIRE( p.done() && p.finish(h) && h.minorVersion == 5 && h.hashes.size() == 3 );
+	}
+	{
+		// truncated compressed stream
+		UpdateParser p("goog-black-hash", false, true);
+		std::string data=gzipString(std::string("[goog-black-hash 1.7]\n+") + hexes[0] + "\n");
+		BOOST_REQUIRE( p.feed(data.data(), data.size()-10) );
+		BOOST_REQUIRE( !p.finish(h) && h.minorVersion == 5 );
+		UpdateParser bad("goog-black-hash", false, true);
+		BOOST_REQUIRE( !bad.feed("not gzip data", 13) );
+	}
+#endif
+
+	// wrong header or encoding
+	const char* bad[]={ "[goog-malware-hash 1.5]\n", "goog-black-hash 1.5\n",
+						"[goog-black-hash 1.]\n", "[goog-black-hash 1.5\n" };
+	for(std::size_t i=0; i < sizeof(bad)/sizeof(bad[0]); ++i) {
+		UpdateParser p("goog-black-hash", false);
+		BOOST_REQUIRE( !p.feed(bad[i], std::strlen(bad[i])) );
 	}
+	UpdateParser p("goog-black-hash", true);
+	BOOST_REQUIRE( !p.feed("zz\r\n", 4) );
+	HashData e;
+	UpdateParser empty("goog-black-hash", false);
+	BOOST_REQUIRE( !empty.finish(e) );
+}
+
+/**
+ * HTTP server for tests: replies to each request for update of list with response,
+ * configured for this list, or with fallback response (404 by default).  Connections are kept alive, unless limit of
+ * requests per connection is set
+ */
+class TestServer {
+public:
+	TestServer() : fallback("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"),
+				   perConnection(0), connections(0),
+				   acceptor(io, ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), 0)) { }
+
+	~TestServer() {
+		stop();
+	}
+
+	void start(std::size_t c) {
+		count=c;
+		connections=0;
+		requests.clear();
+		thread.reset(new boost::thread(boost::bind(&TestServer::run, this)));
+	}
+
+	void stop() {
+		if(thread)
+			thread->join();
+		thread.reset();
+	}
+
+	std::string port() const {
+		return boost::lexical_cast<std::string>(acceptor.local_endpoint().port());
+	}
+
+	std::map<std::string, std::string> responses;
+	/// response to requests, that aren't for lists from responses
+	std::string fallback;
+	std::vector<std::string> requests;
+	/// connection is closed after this number of requests, 0 - by client only
+	std::size_t perConnection;
+	std::size_t connections;
+
+private:
+	void run() {
+		while(requests.size() < count) {
+			ba::ip::tcp::socket socket(io);
+			acceptor.accept(socket);
+			++connections;
+			ba::streambuf buf;
+			for(std::size_t n=0; requests.size() < count && (perConnection == 0 || n < perConnection); ++n) {
+				boost::system::error_code ec;
+				std::size_t len=ba::read_until(socket, buf, "\r\n\r\n", ec);
+				if(ec)
+					break;
+				std::string request(ba::buffers_begin(buf.data()), ba::buffers_begin(buf.data())+len);
+				buf.consume(len);
+				// body of POST request
+				std::string::size_type cl=request.find("Content-Length: ");
+				if(cl != std::string::npos) {
+					std::size_t blen=std::atoi(request.c_str()+cl+16);
+					if(buf.size() < blen)
+						ba::read(socket, buf, ba::transfer_exactly(blen-buf.size()), ec);
+					request.append(ba::buffers_begin(buf.data()), ba::buffers_begin(buf.data())+blen);
+					buf.consume(blen);
+				}
+				requests.push_back(request);
+				std::string response=fallback;
+				for(std::map<std::string, std::string>::iterator it=responses.begin();
+					it != responses.end(); ++it) {
+					if(request.find("version=" + it->first + ":") != std::string::npos)
+						response=it->second;
+				}
+				ba::write(socket, ba::buffer(response));
+				if(request.find("\r\nConnection: close\r\n") != std::string::npos)
+					break;
+			}
+		}
+	}
+
+	ba::io_service io;
+	ba::ip::tcp::acceptor acceptor;
+	std::size_t count;
+	boost::shared_ptr<boost::thread> thread;
+} ;
+
+void testUpdater() {
+	UpdaterOptions opts;
+	opts.pollInterval=1000;
+	opts.maxPollInterval=4000;
+	BOOST_REQUIRE( nextPollDelay(opts, 0, 0, 0.5) == 1000 );
+	BOOST_REQUIRE( nextPollDelay(opts, 0, 300, 0.5) == 300 );
+	BOOST_REQUIRE( nextPollDelay(opts, 0, 0, 0) == 900 && nextPollDelay(opts, 0, 0, 0.99999) == 1100 );
+	BOOST_REQUIRE( nextPollDelay(opts, 1, 0, 0.5) == 60 );
+	BOOST_REQUIRE( nextPollDelay(opts, 3, 0, 0.5) == 240 );
+	BOOST_REQUIRE( nextPollDelay(opts, 3, 600, 0.5) == 600 );
+	BOOST_REQUIRE( nextPollDelay(opts, 30, 0, 0.5) == 4000 );
+
+	const char* hexes[]={
+		"da496e96679f98870c00054673a41df4",
+		"51864045d1a5ba4d1e4d1e1f2c6f5e1e"
+	};
+	Digest ds[2];
+	for(int i=0; i < 2; ++i)
+		parseHexDigest(hexes[i], ds[i]);
+	fs::create_directory("test-hashes");
+	ListConfigs lists(2);
+	lists[0].name="goog-black-hash";
+	lists[0].file="test-hashes/black.dat";
+	lists[1].name="goog-malware-hash";
+	lists[1].file="test-hashes/malware.dat";
+	fs::remove(lists[0].file);
+	fs::remove(lists[1].file);
+	opts.snapshot="test-hashes/lists.snap";
+	opts.server="127.0.0.1";
+	opts.key="KEY";
+	opts.timeout=10;
+
+	// both lists are fetched, saved & published; failed list isn't changed
+	TestServer server;
+	std::string body=std::string("n:900\n[goog-black-hash 1.3]\n+") + hexes[0] + "\n+" + hexes[1] + "\n\n";
+	server.responses["goog-black-hash"]="HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" +
+		chunkedBody(body, 20);
+	opts.port=server.port();
+	server.start(2);
+	{
+		ba::io_service io;
+		Updater u(io, opts, lists);
+		BOOST_REQUIRE( u.runOnce() );
+		BOOST_REQUIRE( u.hash(0).minorVersion == 3 && u.hash(0).hashes.size() == 2 );
+		BOOST_REQUIRE( u.hash(1).minorVersion == -1 && u.hash(1).hashes.empty() );
+	}
+	server.stop();
+	// the same connection is used for both lists
+	BOOST_REQUIRE( server.requests.size() == 2 && server.connections == 1 );
+	for(std::size_t i=0; i < server.requests.size(); ++i) {
+		BOOST_REQUIRE( boost::starts_with(server.requests[i], "GET /safebrowsing/update?client=api&apikey=KEY&version=goog-") );
+	}
+	HashData h;
+	BOOST_REQUIRE( loadListFile(lists[0].file, h) && h.hashes.size() == 2 );
+	BOOST_REQUIRE( !fs::exists(lists[1].file) );
+	ListsData ld;
+	BOOST_REQUIRE( mapSnapshot(opts.snapshot, ld) && ld.hashes.size() == 2 );
+
+	BOOST_REQUIRE( !fs::exists(deltaPath(opts.snapshot)) );
+
+	// incremental update with Content-Length is applied to saved list & published as delta
+	opts.deltaLimit=50;
+	body="[goog-black-hash 1.4 update]\n-" + std::string(hexes[0]) + "\n";
+	server.responses["goog-black-hash"]="HTTP/1.1 200 OK\r\nContent-Length: " +
+		boost::lexical_cast<std::string>(body.size()) + "\r\n\r\n" + body;
+	server.start(2);
+	{
+		ba::io_service io;
+		Updater u(io, opts, lists);
+		BOOST_REQUIRE( u.runOnce() );
+		BOOST_REQUIRE( u.hash(0).minorVersion == 4 && u.hash(0).hashes.size() == 1 );
+		BOOST_REQUIRE( u.hash(0).hashes.contains(ds[1]) );
+	}
+	server.stop();
+	BOOST_REQUIRE( server.requests[0].find(":1:3 HTTP") != std::string::npos );
+	BOOST_REQUIRE( server.connections == 1 );
+	ListsData base;
+	SnapshotDelta delta;
+	BOOST_REQUIRE( mapSnapshot(opts.snapshot, base) && base.generation == ld.generation );
+	BOOST_REQUIRE( readDelta(deltaPath(opts.snapshot), delta) && delta.base == base.generation );
+	BOOST_REQUIRE( delta.digests.size() == 1 && delta.digests[0] == ds[0] && delta.masks[0] == 0 );
+	BOOST_REQUIRE( delta.lists[0].minorVersion == 4 );
+
+	// larger delta is compacted into new snapshot
+	opts.deltaLimit=5;
+
+	// connection, closed by server, is reopened
+	server.responses["goog-malware-hash"]="HTTP/1.1 200 OK\r\nContent-Length: 24\r\n\r\n"
+		"[goog-malware-hash 1.1]\n";
+	server.perConnection=1;
+	server.start(2);
+	{
+		ba::io_service io;
+		Updater u(io, opts, lists);
+		BOOST_REQUIRE( u.runOnce() );
+		BOOST_REQUIRE( u.hash(0).minorVersion == 4 && u.hash(1).minorVersion == 1 );
+	}
+	server.stop();
+	BOOST_REQUIRE( server.requests.size() == 2 && server.connections == 2 );
+	BOOST_REQUIRE( !fs::exists(deltaPath(opts.snapshot)) );
+	BOOST_REQUIRE( mapSnapshot(opts.snapshot, ld) && ld.generation > base.generation );
+	BOOST_REQUIRE( ld.hashes.size() == 1 && ld.lists[1].minorVersion == 1 );
+	server.responses.erase("goog-malware-hash");
+
+#ifdef GSB_HAVE_ZLIB
+	// compressed body is decompressed, in any encoding of transfer
+	body="[goog-black-hash 1.6]\n+" + std::string(hexes[0]) + "\n+" + hexes[1] + "\n\n";
+	std::string gz=gzipString(body);
+	for(int chunked=0; chunked < 2; ++chunked) {
+		server.perConnection=0;
+		server.responses["goog-black-hash"]=chunked ?
+			"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Encoding: gzip\r\n\r\n" +
+			chunkedBody(gz, 7) :
+			"HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: " +
+			boost::lexical_cast<std::string>(gz.size()) + "\r\n\r\n" + gz;
+		server.start(2);
+		{
+			ba::io_service io;
+			Updater u(io, opts, lists);
+			BOOST_REQUIRE( u.runOnce() );
+			BOOST_REQUIRE( u.hash(0).minorVersion == 6 && u.hash(0).hashes.size() == 2 );
+		}
+		server.stop();
+		BOOST_REQUIRE( server.requests[0].find("\r\nAccept-Encoding: gzip\r\n") != std::string::npos );
+		BOOST_REQUIRE( server.connections == 1 );
+	}
+	// damaged compressed data
+	server.responses["goog-black-hash"]="HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+		"Content-Length: 40\r\n\r\n" + gz.substr(0, 20) + std::string(20, 'x');
+	server.start(2);
+	{
+		ba::io_service io;
+		Updater u(io, opts, lists);
+		BOOST_REQUIRE( !u.runOnce() );
+		BOOST_REQUIRE( u.hash(0).minorVersion == 6 );
+	}
+	server.stop();
+#endif
+
+	// truncated body doesn't change list
+	HashData saved;
+	BOOST_REQUIRE( loadListFile(lists[0].file, saved) );
+	int minor=saved.minorVersion;
+	std::size_t size=saved.hashes.size();
+	server.perConnection=1;
+	server.responses["goog-black-hash"]="HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" +
+		chunkedBody("[goog-black-hash 1.5]\n+" + std::string(hexes[0]) + "\n", 10).substr(0, 30);
+	server.start(2);
+	{
+		ba::io_service io;
+		Updater u(io, opts, lists);
+		BOOST_REQUIRE( !u.runOnce() );
+		BOOST_REQUIRE( u.hash(0).minorVersion == minor && u.hash(0).hashes.size() == size );
+	}
+	server.stop();
+
+	// nothing listens on port
+	{
+		UpdaterOptions o=opts;
+		{
+			TestServer closed;
+			o.port=closed.port();
+		}
+		ba::io_service io;
+		Updater u(io, o, lists);
+		BOOST_REQUIRE( !u.runOnce() );
+	}
+	fs::remove_all("test-hashes");
+}
+
+Digest md5Digest(const std::string& s) {
+	Digest d;
+	boost::md5 h(s.data(), s.size());
+	std::memcpy(d.bytes, h.digest(), 16);
+	return d;
+}
+
+/**
+ * Confirmation of prefixes, that fails on request
+ */
+class TestSource : public FullHashSource {
+public:
+	TestSource() : fail(true), count(0) { }
+
+	virtual boost::uint32_t confirm(const ListsData&, const Digest&, boost::uint32_t candidates) {
+		if(!fail)
+			return candidates;
+		++count;
+		return 0;
+	}
+	virtual boost::uint32_t failures() const { return count; }
+
+	bool fail;
+	boost::uint32_t count;
+} ;
+
+void testFullHash() {
+	Digest d1, d2, d3;
+	parseHexDigest("da496e96679f98870c00054673a41df4", d1);
+	parseHexDigest("51864045d1a5ba4d1e4d1e1f2c6f5e1e", d2);
+	d3=d1;
+	d3.bytes[15]^=1;
+	std::string raw1(reinterpret_cast<const char*>(d1.bytes), sizeof(Digest));
+	std::string raw2(reinterpret_cast<const char*>(d2.bytes), sizeof(Digest));
+
+	FullHashes fh;
+	unsigned int lifetime=0;
+	BOOST_REQUIRE( parseFullHashes("600\ngoog-black-hash:12:32\n" + raw1 + raw2 +
+								   "goog-malware-hash:3:16\n" + raw2, fh, lifetime) );
+	BOOST_REQUIRE( lifetime == 600 && fh.size() == 3 );
+	BOOST_REQUIRE( fh[0].list == "goog-black-hash" && fh[0].digest == d1 && fh[1].digest == d2 );
+	BOOST_REQUIRE( fh[2].list == "goog-malware-hash" && fh[2].digest == d2 );
+	fh.clear();
+	lifetime=0;
+	BOOST_REQUIRE( parseFullHashes("goog-black-hash:1:16\n" + raw1, fh, lifetime) );
+	BOOST_REQUIRE( lifetime == 0 && fh.size() == 1 );
+	BOOST_REQUIRE( parseFullHashes("", fh, lifetime) && parseFullHashes("30\n", fh, lifetime) );
+	BOOST_REQUIRE( lifetime == 30 );
+	BOOST_REQUIRE( !parseFullHashes("goog-black-hash:1:17\n" + raw1 + "x", fh, lifetime) );
+	BOOST_REQUIRE( !parseFullHashes("goog-black-hash:1:32\n" + raw1, fh, lifetime) );
+	BOOST_REQUIRE( !parseFullHashes("600\ngoog-black-hash\n", fh, lifetime) );
+
+	HashData h=makeHash("goog-black-hash", 1, d1);
+	HashData h2=makeHash("goog-malware-hash", 1, d2);
+	std::vector<const HashData*> hs;
+	hs.push_back(&h);
+	hs.push_back(&h2);
+	ListsData ld;
+	combineLists(hs, ld);
+	ld.usePrefixes();
+
+	fs::create_directory("test-hashes");
+	TestServer server;
+	FullHashOptions opts;
+	opts.server="127.0.0.1";
+	opts.port=server.port();
+	opts.key="KEY";
+	opts.file="test-hashes/fullhash.cache";
+	fs::remove(opts.file);
+	// server knows d1 also in list, where its prefix isn't found locally
+	server.fallback="HTTP/1.0 200 OK\r\n\r\n600\ngoog-black-hash:1:16\n" + raw1 +
+		"goog-malware-hash:2:16\n" + raw1;
+	UrlVariants uv;
+	uv.count=1;
+	uv.digests[0]=d1;
+	const std::size_t all=UrlVariants::MaxVariants;
+	server.start(1);
+	{
+		FullHashCache cache(opts);
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 1 );
+		// result is cached for all digests with the same prefix
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 1 );
+		uv.digests[0]=d3;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 0 );
+		server.stop();
+		BOOST_REQUIRE( server.requests.size() == 1 && cache.failures() == 0 && cache.size() == 1 );
+		BOOST_REQUIRE( boost::starts_with(server.requests[0],
+										  "POST /safebrowsing/gethash?client=api&apikey=KEY HTTP/1.0\r\n") );
+		BOOST_REQUIRE( boost::ends_with(server.requests[0], "\r\n\r\n4:4\n" + raw1.substr(0, 4)) );
+
+		// results with zero lifetime aren't reused
+		server.fallback="HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\n0\ngarbage";
+		uv.digests[0]=d2;
+		server.start(2);
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 0 );
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 0 );
+		server.stop();
+		BOOST_REQUIRE( server.requests.size() == 2 && cache.failures() == 0 );
+		BOOST_REQUIRE( cache.save() );
+	}
+	// saved cache is used after restart, expired entries are dropped
+	{
+		FullHashCache cache(opts);
+		BOOST_REQUIRE( cache.load() && cache.size() == 1 );
+		uv.digests[0]=d1;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 1 && cache.failures() == 0 );
+	}
+	// processes, that share cache file, don't drop entries of each other
+	fs::remove(opts.file);
+	server.fallback="HTTP/1.0 200 OK\r\n\r\n600\ngoog-black-hash:1:16\n" + raw1;
+	server.start(2);
+	{
+		FullHashCache first(opts), second(opts);
+		uv.digests[0]=d1;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &first) == 1 );
+		uv.digests[0]=d2;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &second) == 0 );
+		server.stop();
+		// lookups don't save cache, & background flush saves it only once a minute
+		first.flush();
+		BOOST_REQUIRE( !fs::exists(opts.file) );
+		BOOST_REQUIRE( first.save() && second.save() );
+		FullHashCache cache(opts);
+		BOOST_REQUIRE( cache.load() && cache.size() == 2 );
+		uv.digests[0]=d1;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 1 && cache.failures() == 0 );
+	}
+	// prefix isn't confirmed, if server isn't available, & requests are delayed after error
+	{
+		FullHashOptions o=opts;
+		{
+			TestServer closed;
+			o.port=closed.port();
+		}
+		FullHashCache cache(o);
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 0 && cache.failures() == 1 );
+		uv.digests[0]=d2;
+		BOOST_REQUIRE( ld.check(uv, false, 0, all, &cache) == 0 && cache.failures() == 2 );
+	}
+	{
+		std::ofstream ofs(pathString(opts.file).c_str(), std::ios::binary | std::ios::trunc);
+		ofs << "GSBFULL";
+	}
+	FullHashCache damaged(opts);
+	BOOST_REQUIRE( !damaged.load() && damaged.size() == 0 );
 
+	// verdicts aren't cached, if prefixes weren't confirmed
+	HashFile hashes;
+	hashes.fname="test-hashes/lists.snap";
+	VerdictCache urlCache(64);
+	TestSource source;
+	Redirector r;
+	r.hashes=&hashes;
+	r.urlCache=&urlCache;
+	r.fullHashes=&source;
+	r.okErr=true;
+	ListConfig lc;
+	lc.name="goog-black-hash";
+	lc.url="http://blocked/";
+	r.lists.push_back(lc);
+	std::string url="http://evil.com/";
+	HashData eh=makeHash("goog-black-hash", 1, md5Digest("evil.com/"));
+	hs.assign(1, &eh);
+	combineLists(hs, ld);
+	ld.usePrefixes();
+	BOOST_REQUIRE( writeSnapshot(hashes.fname, ld) && hashes.updateHash() );
+	std::string reply;
+	r.process(StringPiece(url), uv, reply);
+	BOOST_REQUIRE( reply == "ERR" && source.count == 1 );
+	source.fail=false;
+	r.process(StringPiece(url), uv, reply);
+	BOOST_REQUIRE( reply == "OK rewrite-url=http://blocked/" );
+	fs::remove_all("test-hashes");
+}
+
+/**
+ * Check that compressed prefixes give the same answers as sorted vector
+ */
+void checkRice(const std::vector<boost::uint32_t>& ps) {
+	RiceIndex ri;
+	ri.assign(ps);
+	BOOST_REQUIRE( ri.size() == ps.size() && ri.valid() );
+	BOOST_REQUIRE( ri.blockCount() == (ps.size() + RiceIndex::BlockSize - 1)/RiceIndex::BlockSize );
+	std::vector<boost::uint32_t> decoded;
+	ri.decode(decoded);
+	BOOST_REQUIRE( decoded == ps );
+	for(std::size_t i=0; i < ps.size(); ++i) {
+		BOOST_REQUIRE( ri.contains(ps[i]) );
+		boost::uint32_t p=ps[i]+1;
+		BOOST_REQUIRE( ri.contains(p) == std::binary_search(ps.begin(), ps.end(), p) );
+		p=ps[i]-1;
+		BOOST_REQUIRE( ri.contains(p) == std::binary_search(ps.begin(), ps.end(), p) );
+	}
+}
+
+void testRiceIndex() {
+	RiceIndex empty;
+	std::vector<boost::uint32_t> ps;
+	empty.assign(ps);
+	BOOST_REQUIRE( empty.empty() && !empty.contains(0) && empty.memoryUsage() == 0 );
+
+	std::size_t sizes[]={ 1, 31, 32, 33, 1000, 100000 };
+	for(std::size_t s=0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+		ps.clear();
+		for(std::size_t i=0; i < sizes[s]; ++i)
+			ps.push_back(md5Digest(boost::lexical_cast<std::string>(i)).prefix());
+		std::sort(ps.begin(), ps.end());
+		ps.erase(std::unique(ps.begin(), ps.end()), ps.end());
+		checkRice(ps);
+	}
+	// random prefixes take about parameter+2 bits & 2 bits of block index
+	RiceIndex ri;
+	ri.assign(ps);
+	BOOST_REQUIRE( ri.parameter() >= 14 && ri.memoryUsage()*8 < ps.size()*(ri.parameter()+5) );
+
+	// dense prefixes, with outliers, that are written without Rice code
+	ps.clear();
+	for(boost::uint32_t i=0; i < 500; ++i)
+		ps.push_back(i*2);
+	ps.push_back(0x7fffffff);
+	ps.push_back(0xfffffffe);
+	ps.push_back(0xffffffff);
+	checkRice(ps);
+	ri.assign(ps);
+	BOOST_REQUIRE( ri.parameter() < 10 && ri.memoryUsage() < ps.size()*2 );
+
+	// compressed list is kept outside of combined index & confirmed like prefixes
+	Digest d1=md5Digest("evil.com/"), d2=md5Digest("malware.com/");
+	HashData h=makeHash("goog-black-hash", 1, d1);
+	HashData h2=makeHash("goog-malware-hash", 3, d2);
+	std::vector<const HashData*> hs;
+	hs.push_back(&h);
+	hs.push_back(&h2);
+	ListsData ld;
+	combineLists(hs, ld, 2);
+	BOOST_REQUIRE( ld.compressedMask == 2 && ld.hashes.size() == 1 && ld.compressed[1].size() == 1 );
+	BOOST_REQUIRE( ld.lists[1].minorVersion == 3 );
+	UrlVariants uv;
+	uv.count=2;
+	uv.digests[0]=d1;
+	uv.digests[1]=d2;
+	TestSource source;
+	BOOST_REQUIRE( ld.check(uv) == 3 && ld.check(uv, false, 1) == 2 );
+	BOOST_REQUIRE( ld.check(uv, false, 0, UrlVariants::MaxVariants, &source) == 1 );
+	BOOST_REQUIRE( source.count == 1 );
+	source.fail=false;
+	BOOST_REQUIRE( ld.check(uv, false, 0, UrlVariants::MaxVariants, &source) == 3 );
+
+	// compressed lists are stored in snapshot, that is always written whole
+	BOOST_REQUIRE( writeSnapshot("test.snap", ld) );
+	ListsData m;
+	BOOST_REQUIRE( mapSnapshot("test.snap", m) && m.compressedMask == 2 );
+	BOOST_REQUIRE( m.compressed[1].size() == 1 && m.compressed[1].contains(d2.prefix()) );
+	BOOST_REQUIRE( m.check(uv) == 3 && m.check(uv, false, 1) == 2 && m.hashes.size() == 1 );
+	SnapshotDelta delta;
+	BOOST_REQUIRE( !makeDelta(m, ld, delta) );
+	combineLists(hs, ld);
+	BOOST_REQUIRE( ld.compressedMask == 0 && ld.compressed.empty() && ld.hashes.size() == 2 );
+	BOOST_REQUIRE( !makeDelta(m, ld, delta) );
+	fs::remove("test.snap");
+}
+
+void testRedirector() {
+	fs::create_directory("test-hashes");
+	HashFile hashes;
+	hashes.fname="test-hashes/lists.snap";
+	BOOST_REQUIRE( writeLists(hashes.fname, makeHash("goog-black-hash", 1, md5Digest("evil.com/"))) );
+	BOOST_REQUIRE( hashes.updateHash() );
+
+	Redirector r;
+	r.hashes=&hashes;
+	ListConfig lc;
+	lc.name="goog-black-hash";
+	lc.url="http://blocked/";
+	r.lists.push_back(lc);
+	lc.name="goog-malware-hash";
+	lc.url="http://malware/";
+	r.lists.push_back(lc);
+	UrlVariants uv;
+	std::string reply;
+
+	// classic protocol: new url with rest of fields, or input line
+	r.process(StringPiece("http://www.evil.com/x?y 10.0.0.1/-   -  GET"), uv, reply);
+	BOOST_REQUIRE( reply == "http://blocked/ 10.0.0.1/- - GET" );
+	r.process(StringPiece("http://good.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "http://good.com/ 10.0.0.1/- - GET" );
+	r.emitEmpty=true;
+	r.process(StringPiece("http://good.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply.empty() );
+	r.process(StringPiece(""), uv, reply);
+	BOOST_REQUIRE( reply.empty() );
+
+	// channel-ID & OK/ERR replies
+	r.concurrency=true;
+	r.process(StringPiece("7 http://good.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "7" );
+	r.emitEmpty=false;
+	r.process(StringPiece("7 http://good.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "7 http://good.com/ 10.0.0.1/- - GET" );
+	r.process(StringPiece("3 http://evil.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "3 http://blocked/ 10.0.0.1/- - GET" );
+	r.okErr=true;
+	r.process(StringPiece("12 http://evil.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "12 OK rewrite-url=http://blocked/" );
+	r.process(StringPiece("0 ftp://evil.com/ 10.0.0.1/- - GET"), uv, reply);
+	BOOST_REQUIRE( reply == "0 ERR" );
+	r.concurrency=false;
+	r.process(StringPiece("http://evil.com/"), uv, reply);
+	BOOST_REQUIRE( reply == "OK rewrite-url=http://blocked/" );
+
+	// pool answers every channel, in any order
+	r.concurrency=true;
+	std::ostringstream os;
+	const int count=1000;
+	{
+		ReplyWriter out(os);
+		WorkerPool pool(r, 4, out);
+		for(int i=0; i < count; ++i) {
+			std::ostringstream line;
+			line << i << (i % 3 ? " http://good.com/" : " http://evil.com/") << " 10.0.0.1/- - GET";
+			std::string s=line.str();
+			pool.submit(s);
+		}
+		pool.finish();
+	}
+	std::vector<bool> seen(count, false);
+	std::istringstream is(os.str());
+	int id;
+	std::string rest;
+	int lines=0;
+	while(is >> id && std::getline(is, rest)) {
+		BOOST_REQUIRE( id >= 0 && id < count && !seen[id] );
+		seen[id]=true;
+		BOOST_REQUIRE( rest == (id % 3 ? " ERR" : " OK rewrite-url=http://blocked/") );
+		++lines;
+	}
+	BOOST_REQUIRE( lines == count );
+
+	// cached results are the same & are dropped after reload
+	HashData bh=makeHash("goog-black-hash", 1, md5Digest("evil.com/"));
+	HashData mh=makeHash("goog-malware-hash", 1, md5Digest("bad.org/"));
+	BOOST_REQUIRE( writeLists(hashes.fname, bh, mh) );
+	BOOST_REQUIRE( hashes.updateHash() );
+	VerdictCache urlCache(1024), hostCache(256);
+	r.urlCache=&urlCache;
+	r.hostCache=&hostCache;
+	r.concurrency=false;
+	for(int i=0; i < 2; ++i) {
+		r.process(StringPiece("http://evil.com/a"), uv, reply);
+		BOOST_REQUIRE( reply == "OK rewrite-url=http://blocked/" );
+		r.process(StringPiece("http://evil.com/b"), uv, reply);
+		BOOST_REQUIRE( reply == "OK rewrite-url=http://blocked/" );
+		r.process(StringPiece("http://bad.org/c"), uv, reply);
+		BOOST_REQUIRE( reply == "OK rewrite-url=http://malware/" );
+		r.process(StringPiece("http://good.com/"), uv, reply);
+		BOOST_REQUIRE( reply == "ERR" );
+	}
+	BOOST_REQUIRE( urlCache.stats().hits == 4 && hostCache.stats().hits == 1 );
+	// path of host from malware hash is in black hash
+	BOOST_REQUIRE( writeLists(hashes.fname, makeHash("goog-black-hash", 2, md5Digest("bad.org/d")), mh) );
+	BOOST_REQUIRE( hashes.updateHash() );
+	r.process(StringPiece("http://evil.com/a"), uv, reply);
+	BOOST_REQUIRE( reply == "ERR" );
+	r.process(StringPiece("http://bad.org/c"), uv, reply);
+	BOOST_REQUIRE( reply == "OK rewrite-url=http://malware/" );
+	r.process(StringPiece("http://bad.org/d"), uv, reply);
+	BOOST_REQUIRE( reply == "OK rewrite-url=http://blocked/" );
+
+	// priority is defined by configuration, not by order of lists in snapshot
+	std::swap(r.lists[0], r.lists[1]);
+	r.urlCache=0;
+	r.process(StringPiece("http://bad.org/d"), uv, reply);
+	BOOST_REQUIRE( reply == "OK rewrite-url=http://malware/" );
+
+	// staged lookup stops early, but gives the same results as check of all variants
+	r.hostCache=0;
+	const char* urls[]={ "http://bad.org/d", "http://a.b.c.bad.org/d", "http://x.bad.org/c?q",
+						 "http://bad.org/c/d/e/f/g/h", "http://evil.com/", "http://good.com/d" };
+	for(std::size_t i=0; i < sizeof(urls)/sizeof(urls[0]); ++i) {
+		std::string full;
+		r.staged=false;
+		r.process(StringPiece(urls[i]), uv, full);
+		r.staged=true;
+		r.process(StringPiece(urls[i]), uv, reply);
+		BOOST_REQUIRE( reply == full );
+	}
+	fs::remove_all("test-hashes");
+}
+
+boost::uint64_t sameHash(const StringPiece&) {
+	return 42;
+}
+
+void testVerdictCache() {
+	VerdictCache c(64);
+	Verdict v;
+	BOOST_REQUIRE( !c.get(StringPiece("a", 1), 1, v) );
+	c.put(StringPiece("a", 1), 1, 2);
+	BOOST_REQUIRE( c.get(StringPiece("a", 1), 1, v) && v == 2 );
+	BOOST_REQUIRE( !c.get(StringPiece("a", 1), 2, v) );
+	c.put(StringPiece("a", 1), 2, VerdictNone);
+	BOOST_REQUIRE( c.get(StringPiece("a", 1), 2, v) && v == VerdictNone );
+
+	// size is bounded, & referenced entry survives eviction
+	c.put(StringPiece("hot", 3), 2, 1);
+	for(int i=0; i < 10000; ++i) {
+		std::ostringstream os;
+		os << "key" << i;
+		std::string k=os.str();
+		c.put(StringPiece(k), 2, VerdictNone);
+		BOOST_REQUIRE( c.get(StringPiece("hot", 3), 2, v) && v == 1 );
+	}
+	VerdictCache::Stats st=c.stats();
+	BOOST_REQUIRE( st.entries <= 16*8*1 && st.entries > 64 );
+	BOOST_REQUIRE( st.hits == 10002 && st.misses == 2 );
+
+	// keys with the same hash don't share verdicts
+	VerdictCache cc(64, sameHash);
+	cc.put(StringPiece("http://popular.com/"), 1, VerdictNone);
+	BOOST_REQUIRE( !cc.get(StringPiece("http://evil.com/x"), 1, v) );
+	cc.put(StringPiece("http://evil.com/x"), 1, 1);
+	BOOST_REQUIRE( cc.get(StringPiece("http://popular.com/"), 1, v) && v == VerdictNone );
+	BOOST_REQUIRE( cc.get(StringPiece("http://evil.com/x"), 1, v) && v == 1 );
+	BOOST_REQUIRE( !cc.get(StringPiece("http://evil.com/"), 1, v) );
+	BOOST_REQUIRE( cc.stats().entries == 2 );
+	// key is replaced in place, even if earlier entry of set became stale
+	VerdictCache dc(64, sameHash);
+	dc.put(StringPiece("http://a.com/"), 2, VerdictNone);
+	dc.put(StringPiece("http://k.com/"), 2, VerdictNone);
+	dc.put(StringPiece("http://a.com/"), 1, VerdictNone);
+	dc.put(StringPiece("http://k.com/"), 2, 1);
+	BOOST_REQUIRE( dc.stats().entries == 2 );
+	dc.put(StringPiece("http://k.com/"), 1, VerdictNone);
+	BOOST_REQUIRE( !dc.get(StringPiece("http://k.com/"), 2, v) );
+}
+
+void testLineIO() {
+	std::string longLine(300, 'x');
+	std::string data="first\n  second \t\r\n\n"+longLine+"\nlast";
+	int fds[2];
+	BOOST_REQUIRE( ::pipe(fds) == 0 );
+	BOOST_REQUIRE( ::write(fds[1], data.data(), data.size()) == (ssize_t)data.size() );
+	::close(fds[1]);
+
+	// small buffer, so it has to be compacted & extended
+	LineReader in(fds[0], 16);
+	StringPiece l;
+	BOOST_REQUIRE( in.next(l) && l == StringPiece("first", 5) );
+	BOOST_REQUIRE( in.next(l) && trimPiece(l) == StringPiece("second", 6) );
+	BOOST_REQUIRE( in.next(l) && l.empty() );
+	BOOST_REQUIRE( in.next(l) && l == StringPiece(longLine) );
+	BOOST_REQUIRE( !in.buffered() );
+	BOOST_REQUIRE( in.next(l) && l == StringPiece("last", 4) );
+	BOOST_REQUIRE( !in.next(l) );
+	::close(fds[0]);
+	BOOST_REQUIRE( trimPiece(StringPiece(" \t ", 3)).empty() );
+
+	std::ostringstream os;
+	ReplyWriter out(os, 10, 1000000);
+	BOOST_REQUIRE( !out.due() );
+	out.add("abc");
+	BOOST_REQUIRE( !out.due() && os.str().empty() );
+	out.add("defghi");
+	BOOST_REQUIRE( out.due() );
+	out.flush();
+	BOOST_REQUIRE( os.str() == "abc\ndefghi\n" && !out.due() );
+	ReplyWriter late(os, 1000, 0);
+	late.add("x");
+	BOOST_REQUIRE( late.due() );
+}
+
+/**
+ * Lists of corpus & number of URLs of corpus, that are found in them
+ */
+std::size_t countCorpusHits(const Corpus& c, ListsData& ld) {
+	std::vector<HashData> hs;
+	c.makeLists(hs);
+	std::vector<const HashData*> hp;
+	for(std::size_t i=0; i < hs.size(); ++i)
+		hp.push_back(&hs[i]);
+	combineLists(hp, ld);
+	std::size_t hits=0;
+	UrlVariants uv;
+	for(std::size_t i=0; i < c.urls.size(); ++i) {
+		BOOST_REQUIRE( generateVariants(StringPiece(c.urls[i]), uv) && uv.count > 0 );
+		hashVariants(uv);
+		if(ld.check(uv))
+			++hits;
+	}
+	return hits;
+}
+
+void testCorpus() {
+	CorpusOptions opts;
+	opts.hashes=10000;
+	opts.urls=20000;
+	opts.hosts=1000;
+	opts.hitRatio=0.05;
+	Corpus c, c2;
+	CorpusGenerator gen(opts), gen2(opts);
+	gen.generate(c);
+	gen2.generate(c2);
+	// the same seed gives the same corpus
+	BOOST_REQUIRE( c.urls == c2.urls && c.planted == c2.planted && c.digests == c2.digests );
+	BOOST_REQUIRE( c.names == opts.lists && c.urls.size() == opts.urls );
+	BOOST_REQUIRE( c.planted > 800 && c.planted < 1200 );
+	BOOST_REQUIRE( c.digests[0].size() + c.digests[1].size() == opts.hashes + c.planted );
+
+	// planted URLs are found by the same rules as redirector uses, other URLs aren't found
+	ListsData ld;
+	BOOST_REQUIRE( countCorpusHits(c, ld) == c.planted );
+	BOOST_REQUIRE( ld.hashes.size() == opts.hashes + c.planted );
+
+	// popular hosts take the most of URLs, & paths are limited by depth
+	std::map<std::string, std::size_t> hosts;
+	std::size_t queries=0;
+	for(std::size_t i=0; i < c.urls.size(); ++i) {
+		const std::string& url=c.urls[i];
+		BOOST_REQUIRE( url.compare(0, 7, "http://") == 0 );
+		std::string::size_type path=url.find('/', 7);
+		BOOST_REQUIRE( path != std::string::npos );
+		++hosts[url.substr(7, path-7)];
+		std::string::size_type q=url.find('?');
+		if(q != std::string::npos)
+			++queries;
+		BOOST_REQUIRE( (std::size_t)std::count(url.begin()+path, q == std::string::npos ? url.end() :
+											   url.begin()+q, '/') <= opts.maxDepth+1 );
+	}
+	std::size_t top=0;
+	for(std::map<std::string, std::size_t>::const_iterator it=hosts.begin(); it != hosts.end(); ++it)
+		top=std::max(top, it->second);
+	BOOST_REQUIRE( hosts.size() < opts.hosts && top > opts.urls/20 );
+	BOOST_REQUIRE( queries > opts.urls/5 && queries < opts.urls*2/5 );
+
+	// without skew hosts are used evenly
+	opts.zipf=0;
+	opts.hitRatio=0;
+	Corpus u;
+	CorpusGenerator ugen(opts);
+	ugen.generate(u);
+	hosts.clear();
+	for(std::size_t i=0; i < u.urls.size(); ++i)
+		++hosts[u.urls[i].substr(7, u.urls[i].find('/', 7)-7)];
+	top=0;
+	for(std::map<std::string, std::size_t>::const_iterator it=hosts.begin(); it != hosts.end(); ++it)
+		top=std::max(top, it->second);
+	BOOST_REQUIRE( u.planted == 0 && top < opts.urls/100 );
+
+	// any URL could be planted, so it's found, but URLs on other paths aren't
+	Corpus p;
+	opts.hashes=100;
+	CorpusGenerator pgen(opts);
+	pgen.generateLists(p);
+	BOOST_REQUIRE( pgen.plant("http://www.example.com/a/b/c.html?q=1", p) );
+	BOOST_REQUIRE( !pgen.plant("not an url", p) );
+	p.urls.push_back("http://www.example.com/a/b/c.html?q=1");
+	p.urls.push_back("http://www.example.com/a/b/");
+	p.urls.push_back("http://www.example.com/a/");
+	ListsData pld;
+	BOOST_REQUIRE( countCorpusHits(p, pld) == 1 );
+}
+
+void addCounts(ThreadStats* ts, int n) {
+	for(int i=0; i < n; ++i) {
+		ts->requests.add();
+		ts->hits[1].add(2);
+		ts->times[TimeLookup].add(i);
+	}
+}
+
+void testStats() {
+	// buckets cover all durations without gaps, each is narrower than quarter of its bound
+	for(StatValue v=0; v < 100000; v+=v/7+1) {
+		std::size_t b=LatencyHistogram::bucketOf(v);
+		BOOST_REQUIRE( b+1 < LatencyHistogram::Buckets );
+		BOOST_REQUIRE( LatencyHistogram::lowerBound(b) <= v && v < LatencyHistogram::lowerBound(b+1) );
+		BOOST_REQUIRE( (LatencyHistogram::lowerBound(b+1) - LatencyHistogram::lowerBound(b))*4 <=
+					   std::max((StatValue)4, LatencyHistogram::lowerBound(b)) );
+	}
+	BOOST_REQUIRE( LatencyHistogram::bucketOf((StatValue)1 << 50) == LatencyHistogram::Buckets-1 );
+
+	LatencyHistogram lh;
+	for(int i=0; i < 990; ++i)
+		lh.add(1000);
+	for(int i=0; i < 10; ++i)
+		lh.add(1000000);
+	HistogramData hd;
+	lh.addTo(hd);
+	BOOST_REQUIRE( hd.count == 1000 && hd.mean() == (990*1000 + 10*1000000)/1000 );
+	BOOST_REQUIRE( hd.percentile(0.5) >= 1000 && hd.percentile(0.5) < 1250 );
+	BOOST_REQUIRE( hd.percentile(0.999) >= 1000000 && hd.percentile(0.999) < 1250000 );
+	BOOST_REQUIRE( HistogramData().percentile(0.5) == 0 );
+
+	// counters of threads are summed
+	RedirectorStats rs;
+	boost::thread t1(boost::bind(addCounts, rs.addThread(), 10000));
+	boost::thread t2(boost::bind(addCounts, rs.addThread(), 5000));
+	t1.join();
+	t2.join();
+	StatsSummary sum;
+	rs.summary(sum);
+	BOOST_REQUIRE( sum.requests == 15000 && sum.hits[1] == 30000 && sum.hits[0] == 0 );
+	BOOST_REQUIRE( sum.times[TimeLookup].count == 15000 && sum.times[TimeRequest].count == 0 );
+
+	// redirector counts requests, matches by list, failures & stages of lookup
+	fs::create_directory("test-hashes");
+	HashFile hashes;
+	hashes.fname="test-hashes/stats.snap";
+	BOOST_REQUIRE( writeLists(hashes.fname, makeHash("goog-black-hash", 5, md5Digest("evil.com/")),
+							  makeHash("goog-malware-hash", 7, md5Digest("bad.org/"))) );
+	BOOST_REQUIRE( hashes.updateHash() && hashes.reloads.get() == 1 );
+	Redirector r;
+	r.hashes=&hashes;
+	ListConfig lc;
+	lc.name="goog-malware-hash";
+	lc.url="http://malware/";
+	r.lists.push_back(lc);
+	lc.name="goog-black-hash";
+	lc.url="http://blocked/";
+	r.lists.push_back(lc);
+	VerdictCache cache(1024);
+	r.urlCache=&cache;
+	RedirectorStats stats;
+	r.stats=&stats;
+	ThreadStats* ts=stats.addThread();
+	UrlVariants uv;
+	std::string reply;
+	const char* lines[]={ "http://evil.com/x", "http://bad.org/", "http://good.com/",
+						  "http://evil.com/x", "ftp://evil.com/", "", "http://bad.org/a/b" };
+	for(std::size_t i=0; i < sizeof(lines)/sizeof(lines[0]); ++i)
+		r.process(StringPiece(lines[i]), uv, reply, ts);
+	r.staged=true;
+	r.process(StringPiece("http://www.bad.org/c"), uv, reply, ts);
+	BOOST_REQUIRE( reply == "http://malware/" );
+	stats.summary(sum);
+	BOOST_REQUIRE( sum.requests == 8 && sum.parseFailures == 2 && sum.urlCacheHits == 1 );
+	BOOST_REQUIRE( sum.hits[0] == 3 && sum.hits[1] == 2 && sum.hits[2] == 0 );
+	BOOST_REQUIRE( sum.times[TimeRequest].count == 8 && sum.times[TimeVariants].count == 5 );
+	BOOST_REQUIRE( sum.times[TimeHashing].count == 5 && sum.times[TimeLookup].count == 5 );
+
+	std::ostringstream os;
+	r.writeStats(os);
+	std::string out=os.str();
+	BOOST_REQUIRE( out.find("\nrequests 8\n") != std::string::npos );
+	BOOST_REQUIRE( out.find("\nhits.goog-malware-hash 3\nhits.goog-black-hash 2\n") != std::string::npos );
+	BOOST_REQUIRE( out.find("\ntime.request.count 8\n") != std::string::npos );
+	BOOST_REQUIRE( out.find("\nreloads 1\nreload_failures 0\n") != std::string::npos );
+	BOOST_REQUIRE( out.find("\nversion.goog-black-hash 1.5\nversion.goog-malware-hash 1.7\n") !=
+				   std::string::npos );
+	BOOST_REQUIRE( out.find("\nindex_entries 2\n") != std::string::npos );
+	BOOST_REQUIRE( out.find("\nurl_cache_entries 5\n") != std::string::npos );
+
+	// statistics file is replaced as whole
+	StatsReporter reporter(r, "test-hashes/stats.txt", 0);
+	BOOST_REQUIRE( reporter.write() );
+	std::ifstream ifs("test-hashes/stats.txt");
+	std::string line;
+	BOOST_REQUIRE( std::getline(ifs, line) && line.compare(0, 4, "pid ") == 0 );
+	BOOST_REQUIRE( !fs::exists("test-hashes/stats.txt.tmp") );
+	ifs.close();
+	fs::remove_all("test-hashes");
+}
+
+int test_main( int /*argc*/, char* /*argv*/[] ) {
+	testDigests();
+	testVariants();
+	testMd5Batch();
+	testSnapshot();
+	testListFile();
+	testUpdateParser();
+	testUpdater();
+	testReload();
+	testRedirector();
+	testFullHash();
+	testRiceIndex();
+	testCorpus();
+	testLineIO();
+	testVerdictCache();
+	testStats();
 
 	return 0;
 }
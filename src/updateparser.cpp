@@ -0,0 +1,348 @@
+/**
+ * @file   updateparser.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Incremental parser of updates of lists
+ *
+ *
+ */
+
+#include "updateparser.h"
+#include "probes.h"
+#include <iostream>
+
+namespace {
+
+/// longer lines with size of chunk are treated as error
+const std::size_t sMaxSizeLine=256;
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+/**
+ * Parse decimal number
+ *
+ * @return position after number, or 0 if there are no digits
+ */
+const char* parseNumber(const char* b, const char* e, int& n) {
+	n=0;
+	const char* p=b;
+	for(; p != e && isDigit(*p) && p-b < 9; ++p)
+		n=n*10 + (*p-'0');
+	return p == b ? 0 : p;
+}
+
+}
+
+#ifdef GSB_HAVE_ZLIB
+#include <zlib.h>
+
+/**
+ * Streaming decompression of gzip data
+ */
+class Inflater {
+public:
+	Inflater() : ended(false) {
+		std::memset(&zs, 0, sizeof(zs));
+		// 16 selects gzip header & trailer
+		valid=inflateInit2(&zs, 16+MAX_WBITS) == Z_OK;
+	}
+
+	~Inflater() {
+		if(valid)
+			inflateEnd(&zs);
+	}
+
+	void input(const char* data, std::size_t n) {
+		zs.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		zs.avail_in=n;
+	}
+
+	/**
+	 * Decompress next part of input
+	 *
+	 * @return number of bytes, 0 if more input is needed, or -1 on error
+	 */
+	long output(char* buf, std::size_t size) {
+		if(!valid)
+			return -1;
+		if(ended || zs.avail_in == 0)
+			return 0;
+		zs.next_out=reinterpret_cast<Bytef*>(buf);
+		zs.avail_out=size;
+		int r=inflate(&zs, Z_NO_FLUSH);
+		if(r == Z_STREAM_END)
+			ended=true;
+		else if(r != Z_OK && r != Z_BUF_ERROR)
+			return -1;
+		return size-zs.avail_out;
+	}
+
+	/// end of compressed stream was reached
+	bool finished() const { return ended; }
+
+private:
+	z_stream zs;
+	bool valid;
+	bool ended;
+} ;
+
+bool UpdateParser::gzipSupported() {
+	return true;
+}
+#else
+class Inflater {
+public:
+	void input(const char*, std::size_t) { }
+	long output(char*, std::size_t) { return -1; }
+	bool finished() const { return false; }
+} ;
+
+bool UpdateParser::gzipSupported() {
+	return false;
+}
+#endif
+
+UpdateParser::UpdateParser(const std::string& n, bool c, bool gzip)
+	: name(n), chunked(c), state(c ? ChunkSize : Body), bodyDone(false), chunkLeft(0),
+	  hasHeader(false), isUpdate(false), majorVersion(0), minorVersion(0), pollDelay(0) {
+	if(gzip) {
+		inflater.reset(new Inflater());
+		inflated.resize(65536);
+	}
+}
+
+UpdateParser::~UpdateParser() {
+}
+
+bool UpdateParser::feed(const char* p, std::size_t n) {
+	GSB_PROBE2(update__data, name.c_str(), n);
+	const char* end=p+n;
+	while(p != end && state != Done) {
+		if(state == Body)
+			return feedContent(p, end-p);
+		if(state == ChunkData) {
+			std::size_t len=std::min(chunkLeft, (std::size_t)(end-p));
+			if(!feedContent(p, len))
+				return false;
+			p+=len;
+			chunkLeft-=len;
+			if(chunkLeft == 0)
+				state=ChunkEnd;
+			continue;
+		}
+		// size of chunk, end of line after its data, or trailer
+		const char* nl=static_cast<const char*>(std::memchr(p, '\n', end-p));
+		if(state != ChunkEnd)
+			sizeLine.append(p, nl ? nl : end);
+		if(sizeLine.size() > sMaxSizeLine)
+			return false;
+		if(nl == 0)
+			return true;
+		if(state == ChunkSize) {
+			if(!chunkSize())
+				return false;
+		} else if(state == ChunkEnd) {
+			state=ChunkSize;
+		} else {
+			// trailers end with empty line
+			if(sizeLine.empty() || sizeLine == "\r")
+				state=Done;
+			sizeLine.clear();
+		}
+		p=nl+1;
+	}
+	return true;
+}
+
+/**
+ * Parse size of chunk, extensions after ';' are ignored
+ */
+bool UpdateParser::chunkSize() {
+	std::size_t size=0;
+	std::size_t i=0;
+	while(i < sizeLine.size() && isSpace(sizeLine[i]))
+		++i;
+	std::size_t start=i;
+	for(; i < sizeLine.size() && i-start < 16; ++i) {
+		char c=sizeLine[i];
+		int v;
+		if(isDigit(c))
+			v=c-'0';
+		else if(c >= 'a' && c <= 'f')
+			v=c-'a'+10;
+		else if(c >= 'A' && c <= 'F')
+			v=c-'A'+10;
+		else
+			break;
+		size=size*16 + v;
+	}
+	bool valid=i != start && (i == sizeLine.size() || isSpace(sizeLine[i]) || sizeLine[i] == ';');
+	if(runDebug)
+		std::cerr << "chunk length = " << size << std::endl;
+	sizeLine.clear();
+	if(!valid) {
+		if(runDebug)
+			std::cerr << "Bad chunk size" << std::endl;
+		return false;
+	}
+	chunkLeft=size;
+	// trailers after last chunk aren't used
+	state=size ? ChunkData : Trailer;
+	return true;
+}
+
+/**
+ * Decompress content of body, if it's compressed
+ */
+bool UpdateParser::feedContent(const char* p, std::size_t n) {
+	if(!inflater)
+		return feedBody(p, n);
+	inflater->input(p, n);
+	while(true) {
+		long r=inflater->output(&inflated[0], inflated.size());
+		if(r < 0) {
+			if(runDebug)
+				std::cerr << "Error in compressed data" << std::endl;
+			return false;
+		}
+		if(r == 0)
+			return true;
+		if(!feedBody(&inflated[0], r))
+			return false;
+	}
+}
+
+/**
+ * Split data into lines.  Complete lines are parsed in place, & rest of data is kept
+ * till next call
+ */
+bool UpdateParser::feedBody(const char* p, std::size_t n) {
+	const char* end=p+n;
+	while(p != end && !bodyDone) {
+		const char* nl=static_cast<const char*>(std::memchr(p, '\n', end-p));
+		if(nl == 0) {
+			partial.append(p, end);
+			return true;
+		}
+		bool result;
+		if(partial.empty()) {
+			result=line(p, nl);
+		} else {
+			partial.append(p, nl);
+			result=line(partial.data(), partial.data()+partial.size());
+			partial.clear();
+		}
+		if(!result)
+			return false;
+		p=nl+1;
+	}
+	return true;
+}
+
+bool UpdateParser::line(const char* b, const char* e) {
+	while(b != e && isSpace(*b))
+		++b;
+	while(e != b && isSpace(e[-1]))
+		--e;
+	int delay;
+	if(!hasHeader && e-b > 2 && b[0] == 'n' && b[1] == ':' && parseNumber(b+2, e, delay) == e) {
+		pollDelay=delay;
+		return true;
+	}
+	if(!hasHeader)
+		return header(b, e);
+	if(b == e) {
+		bodyDone=true;
+		if(!chunked)
+			state=Done;
+		return true;
+	}
+	Digest d;
+	if((*b == '+' || *b == '-') && parseHexDigest(b+1, e-b-1, d)) {
+		if(*b == '+')
+			update.add(d);
+		else
+			update.remove(d);
+	} else if(runDebug) {
+		std::cerr << "String " << std::string(b, e) << " not matched" << std::endl;
+	}
+	return true;
+}
+
+/**
+ * Parse "[NAME MAJOR.MINOR]" or "[NAME MAJOR.MINOR update]"
+ */
+bool UpdateParser::header(const char* b, const char* e) {
+	if(runDebug)
+		std::cerr << "First line='" << std::string(b, e) << "'" << std::endl;
+	const char* p=static_cast<const char*>(std::memchr(b, '[', e-b));
+	if(p == 0) {
+		if(runDebug)
+			std::cerr << "First line not matched" << std::endl;
+		return false;
+	}
+	const char* n=++p;
+	while(p != e && !isSpace(*p) && *p != ']')
+		++p;
+	std::string hname(n, p);
+	int mjv, mnv;
+	bool matched=p != n && p != e && *p++ == ' ' && (p=parseNumber(p, e, mjv)) != 0 &&
+		p != e && *p++ == '.' && (p=parseNumber(p, e, mnv)) != 0;
+	static const char updateSuffix[]=" update";
+	const std::size_t suffixLen=sizeof(updateSuffix)-1;
+	bool upd=false;
+	if(matched && (std::size_t)(e-p) > suffixLen &&
+	   std::memcmp(p, updateSuffix, suffixLen) == 0) {
+		upd=true;
+		p+=suffixLen;
+	}
+	if(!matched || p == e || *p != ']') {
+		if(runDebug)
+			std::cerr << "First line not matched" << std::endl;
+		return false;
+	}
+	if(hname != name) {
+		if(runDebug)
+			std::cerr << "Wrong name of hash \"" << hname << "\" instead of " << name << std::endl;
+		return false;
+	}
+	if(runDebug)
+		std::cerr << hname << " " << mjv << " " << mnv << std::endl;
+	GSB_PROBE4(update__header, name.c_str(), mjv, mnv, upd);
+	hasHeader=true;
+	isUpdate=upd;
+	majorVersion=mjv;
+	minorVersion=mnv;
+	return true;
+}
+
+bool UpdateParser::finish(HashData& h) {
+	// last line without newline
+	if(!partial.empty() && !bodyDone) {
+		std::string rest;
+		rest.swap(partial);
+		if(!line(rest.data(), rest.data()+rest.size()))
+			return false;
+	}
+	// compressed data should be complete, unless list is already complete
+	if(!hasHeader || (inflater && !inflater->finished() && !bodyDone))
+		return false;
+
+	DigestVector dv;
+	if(isUpdate)
+		update.apply(h.hashes.begin(), h.hashes.end(), dv);
+	else
+		update.apply(0, 0, dv);
+	GSB_PROBE3(update__parsed, name.c_str(), update.ops.size(), dv.size());
+	update.clear();
+	h.majorVersion=majorVersion;
+	h.minorVersion=minorVersion;
+	h.hashes.assign(dv);
+	return true;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file   updateparser.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Incremental parser of updates of lists
+ *
+ *
+ */
+
+#ifndef _UPDATEPARSER_H
+#define _UPDATEPARSER_H 1
+
+#include "common.h"
+#include <boost/scoped_ptr.hpp>
+
+class Inflater;
+
+/**
+ * Parses body of update response as it arrives from socket, decoding HTTP chunked
+ * transfer encoding if needed.  Body starts with "[NAME MAJOR.MINOR]" line ("update" is
+ * added after version for incremental updates), followed by "+HASH" & "-HASH" lines, and
+ * ends with empty line.  Optional "n:SECONDS" line before it sets time till next poll.
+ * Lines are parsed directly in buffers, passed to feed(); only line, split between
+ * buffers, is copied.  Body, compressed by gzip, is decompressed on the fly
+ */
+class UpdateParser {
+public:
+	/**
+	 * @param name expected name of list
+	 * @param chunked body is in chunked transfer encoding
+	 * @param gzip body is compressed with gzip
+	 */
+	UpdateParser(const std::string& name, bool chunked, bool gzip=false);
+	~UpdateParser();
+
+	/// is decompression of gzip supported?
+	static bool gzipSupported();
+
+	/**
+	 * Parse next part of body
+	 *
+	 * @return false if body has wrong format
+	 */
+	bool feed(const char* data, std::size_t n);
+
+	/// end of body is reached, following data are ignored.  For chunked body this is
+	/// end of last chunk & trailers, so next response could be read from connection
+	bool done() const { return state == Done; }
+
+	/**
+	 * Parse rest of data & apply changes to list
+	 *
+	 * @param h list to update
+	 *
+	 * @return false if there was no valid header
+	 */
+	bool finish(HashData& h);
+
+	/// number of parsed records
+	std::size_t records() const { return update.ops.size(); }
+
+	/// time till next poll in seconds, requested by server, or 0
+	unsigned int nextPoll() const { return pollDelay; }
+
+private:
+	enum State {
+		ChunkSize,
+		ChunkData,
+		ChunkEnd,
+		Trailer,
+		Body,
+		Done
+	};
+
+	bool feedContent(const char* data, std::size_t n);
+	bool feedBody(const char* data, std::size_t n);
+	bool chunkSize();
+	bool line(const char* b, const char* e);
+	bool header(const char* b, const char* e);
+
+	std::string name;
+	bool chunked;
+	State state;
+	/// empty line, that ends list, was found
+	bool bodyDone;
+	std::size_t chunkLeft;
+	/// beginnings of lines, that aren't complete in previous buffer
+	std::string partial;
+	std::string sizeLine;
+	bool hasHeader;
+	bool isUpdate;
+	int majorVersion;
+	int minorVersion;
+	unsigned int pollDelay;
+	DigestUpdate update;
+	boost::scoped_ptr<Inflater> inflater;
+	std::vector<char> inflated;
+} ;
+
+#endif /* _UPDATEPARSER_H */
@@ -0,0 +1,450 @@
+/**
+ * @file   updater.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Asynchronous fetching of updates of lists & their scheduling
+ *
+ *
+ */
+
+#include "updater.h"
+#include "listfile.h"
+#include "snapshot.h"
+#include "probes.h"
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+unsigned int nextPollDelay(const UpdaterOptions& opts, unsigned int failures,
+						   unsigned int serverDelay, double random) {
+	double delay;
+	if(failures == 0) {
+		delay=serverDelay ? serverDelay : opts.pollInterval;
+	} else {
+		delay=60;
+		for(unsigned int i=1; i < failures && delay < opts.maxPollInterval; ++i)
+			delay*=2;
+		if(delay > opts.maxPollInterval)
+			delay=opts.maxPollInterval;
+		if(delay < serverDelay)
+			delay=serverDelay;
+	}
+	delay*=1 + 0.1*(2*random - 1);
+	return delay < 1 ? 1 : (unsigned int)(delay + 0.5);
+}
+
+ListFetcher::ListFetcher(ba::io_service& io, const UpdaterOptions& o, HashData& h,
+						 const SocketPtr& sock, bool connected)
+	: opts(o), hash(h), resolver(io), socket(sock), reused(connected), timer(io), buf(65536),
+	  left(-1), chunked(false), gzip(false), keepAlive(false), pollDelay(0), finished(false),
+	  reusable(false) {
+}
+
+void ListFetcher::start(const Handler& h) {
+	handler=h;
+	std::ostringstream os;
+	os << "GET " << "/safebrowsing/update?client=api&apikey="
+	   << opts.key << "&version=" << hash.name << ":" << hash.majorVersion
+	   << ":" << hash.minorVersion << " HTTP/1.1\r\n"
+	   << "Host: " << opts.server << "\r\n";
+	if(UpdateParser::gzipSupported())
+		os << "Accept-Encoding: gzip\r\n";
+	os << "\r\n";
+	request=os.str();
+
+	timer.expires_from_now(boost::posix_time::seconds(opts.timeout));
+	timer.async_wait(boost::bind(&ListFetcher::onTimeout, shared_from_this(),
+								 ba::placeholders::error));
+	if(reused)
+		sendRequest();
+	else
+		resolve();
+}
+
+void ListFetcher::resolve() {
+	ba::ip::tcp::resolver::query query(opts.server, opts.port);
+	resolver.async_resolve(query, boost::bind(&ListFetcher::onResolve, shared_from_this(),
+											  ba::placeholders::error,
+											  ba::placeholders::iterator));
+}
+
+/**
+ * Server could close connection, that was idle, at any time.  If nothing was received
+ * from it, request is repeated over new connection
+ *
+ * @return true if request is repeated
+ */
+bool ListFetcher::retry() {
+	if(!reused || finished || response.size() != 0)
+		return false;
+	if(runDebug)
+		std::cerr << "Connection was closed by server, reconnecting" << std::endl;
+	reused=false;
+	ErrorCode ignored;
+	socket->close(ignored);
+	resolve();
+	return true;
+}
+
+void ListFetcher::onResolve(const ErrorCode& ec, ba::ip::tcp::resolver::iterator it) {
+	if(ec || finished) {
+		if(runDebug && ec)
+			std::cerr << "Error resolving " << opts.server << ": " << ec.message() << std::endl;
+		finish(false);
+		return;
+	}
+	ba::async_connect(*socket, it, boost::bind(&ListFetcher::onConnect, shared_from_this(),
+											   ba::placeholders::error));
+}
+
+void ListFetcher::onConnect(const ErrorCode& ec) {
+	if(ec || finished) {
+		if(runDebug && ec)
+			std::cerr << "Error opening stream to " << opts.server << ": " << ec.message()
+					  << std::endl;
+		finish(false);
+		return;
+	}
+	sendRequest();
+}
+
+void ListFetcher::sendRequest() {
+	ba::async_write(*socket, ba::buffer(request),
+					boost::bind(&ListFetcher::onWrite, shared_from_this(), ba::placeholders::error));
+}
+
+void ListFetcher::onWrite(const ErrorCode& ec) {
+	if(ec || finished) {
+		if(!retry())
+			finish(false);
+		return;
+	}
+	ba::async_read_until(*socket, response, "\r\n\r\n",
+						 boost::bind(&ListFetcher::onHeaders, shared_from_this(),
+									 ba::placeholders::error));
+}
+
+/**
+ * Parse status line & headers of response
+ *
+ * @return false if response isn't successful
+ */
+bool ListFetcher::parseHeaders() {
+	std::istream is(&response);
+	std::string ts;
+	std::getline(is, ts);
+	if(runDebug)
+		std::cerr << hash.name << ": " << ts << std::endl;
+	std::istringstream status(ts);
+	std::string version;
+	int code=0;
+	status >> version >> code;
+	if(!boost::starts_with(version, "HTTP/") || code == 0) {
+		if(runDebug)
+			std::cerr << "Bad response string: " << ts << std::endl;
+		return false;
+	}
+	keepAlive=version != "HTTP/1.0";
+
+	while(std::getline(is, ts)) {
+		boost::trim(ts);
+		if(ts.empty())
+			break;
+		std::string::size_type colon=ts.find(':');
+		if(colon == std::string::npos)
+			continue;
+		std::string name=ts.substr(0, colon);
+		std::string value=boost::trim_copy(ts.substr(colon+1));
+		try {
+			if(boost::iequals(name, "Content-Length"))
+				left=boost::lexical_cast<long long>(value);
+			else if(boost::iequals(name, "Transfer-Encoding"))
+				chunked=boost::icontains(value, "chunked");
+			else if(boost::iequals(name, "Content-Encoding"))
+				gzip=boost::iequals(value, "gzip");
+			else if(boost::iequals(name, "Connection"))
+				keepAlive=boost::iequals(value, "keep-alive");
+			else if(boost::iequals(name, "Retry-After"))
+				pollDelay=boost::lexical_cast<unsigned int>(value);
+		} catch(boost::bad_lexical_cast&) {
+			if(runDebug)
+				std::cerr << "Bad header: " << ts << std::endl;
+		}
+	}
+	if(code != 200) {
+		if(runDebug)
+			std::cerr << "Non-successfull answer: " << code << std::endl;
+		return false;
+	}
+	if(chunked)
+		left=-1;
+	else if(left == 0)
+		return false;
+	if(gzip && !UpdateParser::gzipSupported())
+		return false;
+	parser.reset(new UpdateParser(hash.name, chunked, gzip));
+	return true;
+}
+
+void ListFetcher::onHeaders(const ErrorCode& ec) {
+	if(ec && retry())
+		return;
+	if(ec || finished || !parseHeaders()) {
+		finish(false);
+		return;
+	}
+	// part of body, that was read together with headers
+	std::size_t n=response.size();
+	if(left >= 0 && (long long)n > left)
+		n=left;
+	if(!parser->feed(ba::buffer_cast<const char*>(response.data()), n)) {
+		finish(false);
+		return;
+	}
+	response.consume(response.size());
+	if(left >= 0)
+		left-=n;
+	readBody();
+}
+
+void ListFetcher::readBody() {
+	// body with known length is read completely, so connection could be reused
+	if(left == 0 || (left < 0 && parser->done())) {
+		finish(parser->finish(hash));
+		return;
+	}
+	socket->async_read_some(ba::buffer(buf),
+						   boost::bind(&ListFetcher::onBody, shared_from_this(),
+									   ba::placeholders::error,
+									   ba::placeholders::bytes_transferred));
+}
+
+void ListFetcher::onBody(const ErrorCode& ec, std::size_t n) {
+	if(finished)
+		return;
+	if(left >= 0 && (long long)n > left)
+		n=left;
+	if(n && !parser->feed(&buf[0], n)) {
+		finish(false);
+		return;
+	}
+	if(left >= 0)
+		left-=n;
+	if(ec == ba::error::eof) {
+		// body without length ends with connection, chunked body should be complete
+		bool complete=left <= 0 && (parser->done() || !chunked);
+		finish(complete && parser->finish(hash));
+	} else if(ec) {
+		if(runDebug)
+			std::cerr << "Error reading " << hash.name << ": " << ec.message() << std::endl;
+		finish(false);
+	} else {
+		readBody();
+	}
+}
+
+void ListFetcher::onTimeout(const ErrorCode& ec) {
+	if(ec == ba::error::operation_aborted || finished)
+		return;
+	if(runDebug)
+		std::cerr << "Timeout of request for " << hash.name << std::endl;
+	finish(false);
+}
+
+void ListFetcher::finish(bool result) {
+	if(finished)
+		return;
+	finished=true;
+	ErrorCode ignored;
+	timer.cancel(ignored);
+	resolver.cancel();
+	reusable=result && keepAlive && (chunked ? parser->done() : left == 0);
+	if(!reusable)
+		socket->close(ignored);
+	if(parser && parser->nextPoll())
+		pollDelay=parser->nextPoll();
+	if(runDebug)
+		std::cerr << "result = " << result << std::endl;
+	// handler holds reference to fetcher, so it's released here
+	Handler h;
+	h.swap(handler);
+	h(result);
+}
+
+Updater::Updater(ba::io_service& i, const UpdaterOptions& o, const ListConfigs& lists)
+	: io(i), opts(o), connections(0), active(0), daemon(false), updated(false) {
+	std::srand(std::time(0) ^ ::getpid());
+	for(std::size_t n=0; n < lists.size(); ++n) {
+		StatePtr st(new ListState(io));
+		st->config=lists[n];
+		st->hash.name=lists[n].name;
+		if(fs::exists(lists[n].file) && !loadListFile(lists[n].file, st->hash)) {
+			if(runDebug)
+				std::cerr << "Error reading " << lists[n].file << std::endl;
+		}
+		states.push_back(st);
+	}
+}
+
+bool Updater::runOnce() {
+	daemon=false;
+	updated=false;
+	for(std::size_t i=0; i < states.size(); ++i)
+		fetch(i);
+	io.run();
+	io.reset();
+	// snapshot is also published if it's missing or has older format
+	ListsData published;
+	if(updated || !mapSnapshot(opts.snapshot, published))
+		publish();
+	return updated;
+}
+
+void Updater::runDaemon() {
+	daemon=true;
+	ListsData published;
+	if(!mapSnapshot(opts.snapshot, published))
+		publish();
+	for(std::size_t i=0; i < states.size(); ++i)
+		fetch(i);
+	io.run();
+}
+
+/**
+ * Fetch list over idle connection, or over new one, if limit of connections isn't
+ * reached yet.  Otherwise list waits for free connection
+ */
+void Updater::fetch(std::size_t i) {
+	if(!idle.empty()) {
+		SocketPtr socket=idle.back();
+		idle.pop_back();
+		startFetch(i, socket, true);
+	} else if(connections < std::max(opts.connections, 1u)) {
+		++connections;
+		startFetch(i, SocketPtr(new ba::ip::tcp::socket(io)), false);
+	} else {
+		waiting.push_back(i);
+	}
+}
+
+void Updater::startFetch(std::size_t i, const SocketPtr& socket, bool connected) {
+	ListState& st=*states[i];
+	boost::shared_ptr<ListFetcher> f(new ListFetcher(io, opts, st.hash, socket, connected));
+	st.majorVersion=st.hash.majorVersion;
+	st.minorVersion=st.hash.minorVersion;
+	GSB_PROBE1(update__start, st.hash.name.c_str());
+	++active;
+	f->start(boost::bind(&Updater::onFetched, this, i, f, _1));
+}
+
+void Updater::onFetched(std::size_t i, boost::shared_ptr<ListFetcher> f, bool result) {
+	ListState& st=*states[i];
+	GSB_PROBE2(update__finish, st.hash.name.c_str(), result);
+	--active;
+	SocketPtr socket=f->release();
+	if(socket)
+		idle.push_back(socket);
+	else
+		--connections;
+	if(!waiting.empty()) {
+		std::size_t next=waiting.front();
+		waiting.pop_front();
+		fetch(next);
+	} else if(active == 0) {
+		// connections aren't kept till next polls
+		boost::system::error_code ignored;
+		for(std::size_t j=0; j < idle.size(); ++j)
+			idle[j]->close(ignored);
+		connections-=idle.size();
+		idle.clear();
+	}
+
+	if(result) {
+		std::cerr << "Hash " << st.hash.name << " updated from " << st.majorVersion << "."
+				  << st.minorVersion << " to " << st.hash.majorVersion << "."
+				  << st.hash.minorVersion << std::endl;
+		try {
+			if(!writeListFile(st.config.file, st.hash) && runDebug)
+				std::cerr << "Error writing " << st.config.file << std::endl;
+		} catch(std::exception& x) {
+			if(runDebug)
+				std::cerr << "Catch exception: " << x.what() << std::endl;
+		}
+		st.failures=0;
+		updated=true;
+		// in daemon mode redirectors get each list as soon as it's ready
+		if(daemon)
+			publish();
+	} else {
+		++st.failures;
+	}
+	if(daemon)
+		schedule(i, nextPollDelay(opts, st.failures, f->nextPoll(), std::rand()/(RAND_MAX+1.0)));
+}
+
+void Updater::schedule(std::size_t i, unsigned int delay) {
+	ListState& st=*states[i];
+	if(runDebug)
+		std::cerr << "Next poll of " << st.hash.name << " in " << delay << " seconds" << std::endl;
+	st.timer.expires_from_now(boost::posix_time::seconds(delay));
+	st.timer.async_wait(boost::bind(&Updater::onTimer, this, i, ba::placeholders::error));
+}
+
+void Updater::onTimer(std::size_t i, const boost::system::error_code& ec) {
+	if(!ec)
+		fetch(i);
+}
+
+/**
+ * Publish combined lists for redirectors.  Changes since current snapshot are written to
+ * delta file, while it's small enough; otherwise snapshot is compacted: new snapshot
+ * with all changes replaces it, & delta is removed
+ */
+void Updater::publish() {
+	std::vector<const HashData*> hp;
+	boost::uint32_t compress=0;
+	for(std::size_t i=0; i < states.size(); ++i) {
+		hp.push_back(&states[i]->hash);
+		if(states[i]->config.compressed && i < MaxLists)
+			compress|=(boost::uint32_t)1 << i;
+	}
+	try {
+		ListsData ld;
+		combineLists(hp, ld, compress);
+		if(opts.prefixOnly)
+			ld.usePrefixes();
+		fs::path dname=deltaPath(opts.snapshot);
+		ListsData base;
+		SnapshotDelta delta;
+		if(mapSnapshot(opts.snapshot, base) && opts.deltaLimit &&
+		   makeDelta(base, ld, delta) &&
+		   delta.digests.size()*100 <= (boost::uint64_t)base.hashes.size()*opts.deltaLimit) {
+			if(runDebug)
+				std::cerr << "Publishing delta with " << delta.digests.size() << " changes" << std::endl;
+			if(!writeDelta(dname, delta)) {
+				if(runDebug)
+					std::cerr << "Error writing delta " << dname << std::endl;
+				return;
+			}
+			GSB_PROBE2(update__publish, delta.base, delta.digests.size());
+			return;
+		}
+		// generation is unique, even if previous snapshot is lost
+		ld.generation=std::max(base.generation+1, (boost::uint64_t)std::time(0));
+		if(!writeSnapshot(opts.snapshot, ld)) {
+			if(runDebug)
+				std::cerr << "Error writing snapshot " << opts.snapshot << std::endl;
+			return;
+		}
+		GSB_PROBE2(update__publish, ld.generation, 0);
+		// redirectors ignore delta for other snapshot, so it could be removed after rename
+		fs::remove(dname);
+	} catch(std::exception& x) {
+		if(runDebug)
+			std::cerr << "Catch exception: " << x.what() << std::endl;
+	}
+}
@@ -0,0 +1,193 @@
+/**
+ * @file   updater.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Asynchronous fetching of updates of lists & their scheduling
+ *
+ *
+ */
+
+#ifndef _UPDATER_H
+#define _UPDATER_H 1
+
+#include "common.h"
+#include "updateparser.h"
+
+#include <deque>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+namespace ba=boost::asio;
+
+/**
+ * Options of updater, read from configuration file
+ */
+struct UpdaterOptions {
+	/// host & port of Safe Browsing API
+	std::string server;
+	std::string port;
+	std::string key;
+	/// combined snapshot of lists for redirectors
+	fs::path snapshot;
+	/// time between polls of list in daemon mode, if server doesn't give it, in seconds
+	unsigned int pollInterval;
+	/// maximal time between polls after errors
+	unsigned int maxPollInterval;
+	/// maximal duration of one request
+	unsigned int timeout;
+	/// maximal number of connections to server, that are kept alive between requests
+	unsigned int connections;
+	/// maximal size of delta in percents of snapshot, 0 - always write snapshot
+	unsigned int deltaLimit;
+	/// publish only prefixes of digests
+	bool prefixOnly;
+
+	UpdaterOptions() : server("sb.google.com"), port("http"), pollInterval(1800),
+					   maxPollInterval(14400), timeout(300), connections(1), deltaLimit(5),
+					   prefixOnly(false) { }
+} ;
+
+/**
+ * Calculate delay till next poll of list.  After errors delay grows exponentially,
+ * starting from one minute.  Random jitter of 10% is added, so polls of several
+ * updaters & lists are spread in time
+ *
+ * @param opts options of updater
+ * @param failures number of failed polls in row
+ * @param serverDelay delay, requested by server, or 0
+ * @param random random number in range [0, 1)
+ *
+ * @return delay in seconds
+ */
+unsigned int nextPollDelay(const UpdaterOptions& opts, unsigned int failures,
+						   unsigned int serverDelay, double random);
+
+typedef boost::shared_ptr<ba::ip::tcp::socket> SocketPtr;
+
+/**
+ * One request for update of list.  Update is applied to list only after whole response
+ * was received & parsed, so list isn't changed on errors.  Request could be sent over
+ * connection, kept alive after previous request; if server has closed it meanwhile,
+ * request is repeated over new connection
+ */
+class ListFetcher : public boost::enable_shared_from_this<ListFetcher> {
+public:
+	/// called with result of request
+	typedef boost::function<void (bool)> Handler;
+
+	/**
+	 * @param socket connection to use
+	 * @param connected connection is already open
+	 */
+	ListFetcher(ba::io_service& io, const UpdaterOptions& opts, HashData& h,
+				const SocketPtr& socket, bool connected);
+
+	void start(const Handler& handler);
+
+	/// time till next poll in seconds, requested by server, or 0
+	unsigned int nextPoll() const { return pollDelay; }
+
+	/// connection, if it could be used for next request, or empty pointer
+	SocketPtr release() const { return reusable ? socket : SocketPtr(); }
+
+private:
+	typedef boost::system::error_code ErrorCode;
+
+	void resolve();
+	void sendRequest();
+	bool retry();
+	void onResolve(const ErrorCode& ec, ba::ip::tcp::resolver::iterator it);
+	void onConnect(const ErrorCode& ec);
+	void onWrite(const ErrorCode& ec);
+	void onHeaders(const ErrorCode& ec);
+	void readBody();
+	void onBody(const ErrorCode& ec, std::size_t n);
+	void onTimeout(const ErrorCode& ec);
+	bool parseHeaders();
+	void finish(bool result);
+
+	const UpdaterOptions& opts;
+	HashData& hash;
+	Handler handler;
+	ba::ip::tcp::resolver resolver;
+	SocketPtr socket;
+	/// connection was open before request
+	bool reused;
+	ba::deadline_timer timer;
+	std::string request;
+	ba::streambuf response;
+	std::vector<char> buf;
+	boost::scoped_ptr<UpdateParser> parser;
+	/// length of rest of body, if it's known
+	long long left;
+	bool chunked;
+	bool gzip;
+	bool keepAlive;
+	unsigned int pollDelay;
+	bool finished;
+	bool reusable;
+} ;
+
+/**
+ * Updates all configured lists concurrently, using up to given number of connections,
+ * that are kept alive while there are requests to send.  Each list is saved to its data
+ * file as soon as it's updated, & its changes are published for redirectors
+ */
+class Updater {
+public:
+	Updater(ba::io_service& io, const UpdaterOptions& opts, const ListConfigs& lists);
+
+	/**
+	 * Fetch all lists once & publish snapshot
+	 *
+	 * @return true if at least one list was updated
+	 */
+	bool runOnce();
+
+	/**
+	 * Poll lists till io_service is stopped
+	 */
+	void runDaemon();
+
+	const HashData& hash(std::size_t i) const { return states[i]->hash; }
+
+private:
+	struct ListState {
+		ListConfig config;
+		HashData hash;
+		/// version of list before current request
+		int majorVersion;
+		int minorVersion;
+		unsigned int failures;
+		ba::deadline_timer timer;
+
+		ListState(ba::io_service& io) : majorVersion(1), minorVersion(-1), failures(0),
+										timer(io) { }
+	} ;
+	typedef boost::shared_ptr<ListState> StatePtr;
+
+	void fetch(std::size_t i);
+	void startFetch(std::size_t i, const SocketPtr& socket, bool connected);
+	void onFetched(std::size_t i, boost::shared_ptr<ListFetcher> f, bool result);
+	void schedule(std::size_t i, unsigned int delay);
+	void onTimer(std::size_t i, const boost::system::error_code& ec);
+	void publish();
+
+	ba::io_service& io;
+	const UpdaterOptions& opts;
+	std::vector<StatePtr> states;
+	/// open connections without requests
+	std::vector<SocketPtr> idle;
+	/// lists, waiting for free connection
+	std::deque<std::size_t> waiting;
+	/// number of open connections
+	unsigned int connections;
+	/// number of requests in progress
+	unsigned int active;
+	bool daemon;
+	bool updated;
+} ;
+
+#endif /* _UPDATER_H */
@@ -0,0 +1,164 @@
+/**
+ * @file   variants.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Generation of host/path variants of URL, that are checked against hashes
+ *
+ *
+ */
+
+#include "variants.h"
+#include "md5-batch.h"
+
+namespace {
+
+const StringPiece sRootPath("/", 1);
+
+inline char lowerChar(char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+}
+
+/**
+ * Generate host and its suffixes, formed from up to 5 last components of host name
+ *
+ * @param host host name
+ * @param hv array of at least UrlVariants::MaxHosts elements to fill
+ *
+ * @return number of generated variants
+ */
+std::size_t generateHostVariants(const StringPiece& host, StringPiece* hv) {
+	std::size_t count=0;
+	hv[count++]=host;
+
+	const char* b=host.data;
+	const char* e=host.end();
+	while(e != b && *(e-1) == '.')
+		--e;
+	unsigned int components=0;
+	for(const char* p=e; p != b && count < UrlVariants::MaxHosts; --p) {
+		if(*(p-1) != '.' || p == e || *p == '.')
+			continue;
+		// p points to start of non-empty component
+		if(++components < 2)
+			continue;
+		StringPiece s(p, e-p);
+		if(!(s == host))
+			hv[count++]=s;
+	}
+	// the first component of host
+	if(count < UrlVariants::MaxHosts && e != b && *b != '.' && components >= 1) {
+		StringPiece s(b, e-b);
+		if(!(s == host))
+			hv[count++]=s;
+	}
+	return count;
+}
+
+/**
+ * Generate path parts for one host: root, full path with & without query, and up to 3
+ * prefixes of path
+ *
+ * @param path path part of URL, empty or starting with '/'
+ * @param query query part of URL, that should directly follow path
+ * @param pv array of at least UrlVariants::MaxPaths elements to fill
+ *
+ * @return number of generated variants
+ */
+std::size_t generatePathVariants(const StringPiece& path, const StringPiece& query,
+								 StringPiece* pv) {
+	std::size_t count=0;
+	pv[count++]=sRootPath;
+	if(path.empty())
+		return count;
+
+	if(!query.empty())
+		pv[count++]=StringPiece(path.data, path.size+query.size);
+	if(!(path == sRootPath))
+		pv[count++]=path;
+
+	unsigned int prefixes=0;
+	for(std::size_t i=1; i+1 < path.size && prefixes < 3; ++i) {
+		if(path.data[i] == '/' && path.data[i-1] != '/') {
+			pv[count++]=StringPiece(path.data, i+1);
+			++prefixes;
+		}
+	}
+	return count;
+}
+
+/**
+ * Extract host part of http URL, everything between scheme & first slash
+ *
+ * @return host, or piece with null data if it isn't http URL
+ */
+StringPiece urlHost(const StringPiece& url) {
+	static const char scheme[]="http://";
+	const std::size_t schemeLen=sizeof(scheme)-1;
+
+	if(url.size < schemeLen)
+		return StringPiece();
+	for(std::size_t i=0; i < schemeLen; ++i) {
+		if(lowerChar(url.data[i]) != scheme[i])
+			return StringPiece();
+	}
+	StringPiece host(url.data+schemeLen, url.size-schemeLen);
+	const char* slash=static_cast<const char*>(std::memchr(host.data, '/', host.size));
+	if(slash != 0)
+		host.size=slash-host.data;
+	return host;
+}
+
+/**
+ * Generate list of URL variants to check
+ *
+ * TODO: use url parser from cpp-netlib?
+ *
+ * @param url URL to parse, only http:// is supported
+ * @param uv variants to fill, pointing into url
+ *
+ * @return true, if success, false - if no variants generated
+ */
+bool generateVariants(const StringPiece& url, UrlVariants& uv) {
+	uv.count=0;
+	StringPiece host=urlHost(url), path, query;
+	if(host.data == 0)
+		return false;
+	if(host.end() != url.end()) {
+		path=StringPiece(host.end(), url.end()-host.end());
+		const char* q=static_cast<const char*>(std::memchr(path.data, '?', path.size));
+		if(q != 0) {
+			query=StringPiece(q, path.end()-q);
+			path.size=q-path.data;
+		}
+	}
+
+	StringPiece hv[UrlVariants::MaxHosts];
+	StringPiece pv[UrlVariants::MaxPaths];
+	std::size_t hc=generateHostVariants(host, hv);
+	std::size_t pc=generatePathVariants(path, query, pv);
+	for(std::size_t hi=0; hi < hc; ++hi) {
+		for(std::size_t pi=0; pi < pc; ++pi) {
+			UrlVariant& v=uv.variants[uv.count++];
+			v.host=hv[hi];
+			v.path=pv[pi];
+		}
+	}
+
+	return uv.count > 0;
+}
+
+/**
+ * Calculate MD5 digests for all variants of URL
+ *
+ * @param uv variants of URL
+ * @param first index of first variant to hash
+ * @param last index after last variant to hash
+ */
+void hashVariants(UrlVariants& uv, std::size_t first, std::size_t last) {
+	if(last > uv.count)
+		last=uv.count;
+	if(first < last)
+		md5Batch(uv.variants+first, last-first, uv.digests+first);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file   variants.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Generation of host/path variants of URL, that are checked against hashes
+ *
+ *
+ */
+
+#ifndef _VARIANTS_H
+#define _VARIANTS_H 1
+
+#include <cstring>
+#include <string>
+#include <ostream>
+
+#include "digest.h"
+
+/**
+ * Piece of string, that doesn't own its data
+ */
+struct StringPiece {
+	const char* data;
+	std::size_t size;
+
+	StringPiece() : data(0), size(0) { }
+	StringPiece(const char* d, std::size_t s) : data(d), size(s) { }
+	explicit StringPiece(const std::string& s) : data(s.data()), size(s.size()) { }
+
+	bool empty() const { return size == 0; }
+	const char* end() const { return data+size; }
+	std::string str() const { return std::string(data, size); }
+} ;
+
+inline bool operator==(const StringPiece& a, const StringPiece& b) {
+	return a.size == b.size && std::memcmp(a.data, b.data, a.size) == 0;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const StringPiece& s) {
+	return os.write(s.data, s.size);
+}
+
+/**
+ * One variant of URL: concatenation of host & path parts
+ */
+struct UrlVariant {
+	StringPiece host;
+	StringPiece path;
+
+	std::size_t size() const { return host.size+path.size; }
+} ;
+
+inline std::ostream& operator<<(std::ostream& os, const UrlVariant& v) {
+	return os << v.host << v.path;
+}
+
+/**
+ * Fixed-size set of URL's variants & their MD5 digests.  All variants are pieces of
+ * original URL, so it should outlive this object
+ */
+struct UrlVariants {
+	enum {
+		/// host itself + 4 suffixes
+		MaxHosts=5,
+		/// "/", path with query, path, and 3 path prefixes
+		MaxPaths=6,
+		MaxVariants=MaxHosts*MaxPaths
+	};
+
+	UrlVariant variants[MaxVariants];
+	/// filled by hashVariants
+	Digest digests[MaxVariants];
+	std::size_t count;
+
+	UrlVariants() : count(0) { }
+
+	const UrlVariant* begin() const { return variants; }
+	const UrlVariant* end() const { return variants+count; }
+	std::size_t size() const { return count; }
+} ;
+
+std::size_t generateHostVariants(const StringPiece& host, StringPiece* hv);
+std::size_t generatePathVariants(const StringPiece& path, const StringPiece& query,
+								 StringPiece* pv);
+StringPiece urlHost(const StringPiece& url);
+bool generateVariants(const StringPiece& url, UrlVariants& uv);
+void hashVariants(UrlVariants& uv, std::size_t first=0,
+				  std::size_t last=UrlVariants::MaxVariants);
+
+#endif /* _VARIANTS_H */
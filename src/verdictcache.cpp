@@ -0,0 +1,107 @@
+/**
+ * @file   verdictcache.cpp
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Bounded cache of results of recent lookups
+ *
+ *
+ */
+
+#include "verdictcache.h"
+
+boost::uint64_t VerdictCache::hashKey(const StringPiece& s) {
+	boost::uint64_t h=14695981039346656037ULL;
+	for(std::size_t i=0; i < s.size; ++i) {
+		h^=(unsigned char)s.data[i];
+		h*=1099511628211ULL;
+	}
+	h^=h >> 33;
+	h*=0xff51afd7ed558ccdULL;
+	h^=h >> 33;
+	h*=0xc4ceb9fe1a85ec53ULL;
+	h^=h >> 33;
+	return h;
+}
+
+VerdictCache::VerdictCache(std::size_t entries, KeyHash kh) : hash(kh) {
+	std::size_t perShard=(entries+Shards*Ways-1)/(Shards*Ways);
+	if(perShard == 0)
+		perShard=1;
+	for(unsigned int i=0; i < Shards; ++i) {
+		boost::shared_ptr<Shard> s(new Shard());
+		s->sets.resize(perShard);
+		s->hits=0;
+		s->misses=0;
+		shards.push_back(s);
+	}
+}
+
+bool VerdictCache::get(const StringPiece& key, boost::uint32_t generation, Verdict& v) {
+	boost::uint64_t h=hash(key);
+	Shard& s=*shards[h & (Shards-1)];
+	boost::mutex::scoped_lock lock(s.mutex);
+	Set& set=setFor(s, h);
+	for(unsigned int i=0; i < Ways; ++i) {
+		Entry& e=set.ways[i];
+		if(e.generation == generation && e.matches(h, key)) {
+			e.ref=1;
+			v=e.verdict;
+			++s.hits;
+			return true;
+		}
+	}
+	++s.misses;
+	return false;
+}
+
+void VerdictCache::put(const StringPiece& key, boost::uint32_t generation, Verdict v) {
+	boost::uint64_t h=hash(key);
+	Shard& s=*shards[h & (Shards-1)];
+	boost::mutex::scoped_lock lock(s.mutex);
+	Set& set=setFor(s, h);
+	Entry* victim=0;
+	// the same key is replaced in place, so set never has two entries for it
+	for(unsigned int i=0; i < Ways && victim == 0; ++i) {
+		if(set.ways[i].used && set.ways[i].matches(h, key))
+			victim=&set.ways[i];
+	}
+	// otherwise free entry, or entry of old generation
+	for(unsigned int i=0; i < Ways && victim == 0; ++i) {
+		Entry& e=set.ways[i];
+		if(!e.used || e.generation != generation)
+			victim=&e;
+	}
+	// otherwise clock hand skips recently referenced entries, clearing their bits
+	while(victim == 0) {
+		Entry& e=set.ways[set.hand];
+		set.hand=(set.hand+1) % Ways;
+		if(e.ref)
+			e.ref=0;
+		else
+			victim=&e;
+	}
+	victim->key=h;
+	victim->text.assign(key.data, key.size);
+	victim->generation=generation;
+	victim->verdict=v;
+	victim->ref=0;
+	victim->used=1;
+}
+
+VerdictCache::Stats VerdictCache::stats() const {
+	Stats st;
+	for(std::size_t i=0; i < shards.size(); ++i) {
+		const Shard& s=*shards[i];
+		boost::mutex::scoped_lock lock(s.mutex);
+		st.hits+=s.hits;
+		st.misses+=s.misses;
+		for(std::size_t j=0; j < s.sets.size(); ++j) {
+			for(unsigned int k=0; k < Ways; ++k) {
+				st.entries+=s.sets[j].ways[k].used;
+				st.memory+=s.sets[j].ways[k].text.capacity();
+			}
+		}
+		st.memory+=sizeof(Shard) + s.sets.size()*sizeof(Set);
+	}
+	return st;
+}
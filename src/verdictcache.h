@@ -0,0 +1,112 @@
+/**
+ * @file   verdictcache.h
+ * @author Alex Ott <alexott@gmail.com>
+ *
+ * @brief  Bounded cache of results of recent lookups
+ *
+ *
+ */
+
+#ifndef _VERDICTCACHE_H
+#define _VERDICTCACHE_H 1
+
+#include "variants.h"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// result of lookup: number of matched list, counted from 1 in order of priority
+typedef boost::uint8_t Verdict;
+/// URL isn't found in any list
+const Verdict VerdictNone=0;
+
+/**
+ * Set-associative cache, that maps string (URL or host) to verdict.  Entry keeps 64-bit
+ * hash of key, that selects shard & set & is compared first, & key itself, so keys with
+ * the same hash never share verdict.  Key is copied into buffer of evicted entry, so
+ * memory is allocated only while buffers grow.  Cache is divided into shards with
+ * separate locks; inside each set of entries evicted one is selected by CLOCK algorithm.
+ *
+ * Entries are tagged by generation of hashes & entries of old generations are ignored,
+ * so cache is invalidated without locking when new hashes are loaded.
+ */
+class VerdictCache {
+public:
+	struct Stats {
+		boost::uint64_t hits;
+		boost::uint64_t misses;
+		std::size_t entries;
+		std::size_t memory;
+
+		Stats() : hits(0), misses(0), entries(0), memory(0) { }
+		double hitRate() const {
+			return hits+misses ? (double)hits/(hits+misses) : 0;
+		}
+	} ;
+
+	typedef boost::uint64_t (*KeyHash)(const StringPiece& key);
+
+	/**
+	 * @param entries maximal number of entries, rounded up to multiple of set size
+	 * @param hash function, that hashes keys
+	 */
+	VerdictCache(std::size_t entries, KeyHash hash=hashKey);
+
+	/// FNV-1a with final mixing from MurmurHash3, so all its bits could be used
+	static boost::uint64_t hashKey(const StringPiece& key);
+
+	bool get(const StringPiece& key, boost::uint32_t generation, Verdict& v);
+	void put(const StringPiece& key, boost::uint32_t generation, Verdict v);
+	Stats stats() const;
+
+private:
+	enum {
+		Ways=8,
+		ShardBits=4,
+		Shards=1 << ShardBits
+	};
+
+	struct Entry {
+		boost::uint64_t key;
+		boost::uint32_t generation;
+		boost::uint8_t verdict;
+		/// referenced since last pass of clock hand
+		boost::uint8_t ref;
+		boost::uint8_t used;
+		std::string text;
+
+		Entry() : key(0), generation(0), verdict(VerdictNone), ref(0), used(0) { }
+
+		bool matches(boost::uint64_t h, const StringPiece& k) const {
+			return used && key == h && text.size() == k.size &&
+				std::memcmp(text.data(), k.data, k.size) == 0;
+		}
+	} ;
+
+	struct Set {
+		Entry ways[Ways];
+		unsigned int hand;
+
+		Set() : hand(0) { }
+	} ;
+
+	struct Shard {
+		std::vector<Set> sets;
+		boost::uint64_t hits;
+		boost::uint64_t misses;
+		mutable boost::mutex mutex;
+	} ;
+
+	Set& setFor(Shard& s, boost::uint64_t h) const {
+		return s.sets[(h >> ShardBits) % s.sets.size()];
+	}
+
+	std::vector<boost::shared_ptr<Shard> > shards;
+	KeyHash hash;
+} ;
+
+#endif /* _VERDICTCACHE_H */